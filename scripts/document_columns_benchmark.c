@@ -0,0 +1,497 @@
+/*
+ * Compares the document queries before and after the typed document columns
+ * (json_data holding every key vs. columns + document_content).
+ *
+ * The statements below are those of database_fts_index(),
+ * database_create_document_iterator() and get_document as they were
+ * introduced with the typed columns, and as they were right before. The
+ * embedding, stats and path hierarchy steps of database_fts_index() are the
+ * same in both versions and are left out.
+ *
+ * A synthetic index is written with the old schema, then copied and migrated
+ * with the same migration as sist2 runs on open.
+ *
+ * Usage: document_columns_benchmark [document count] [directory for the databases]
+ */
+#include <sqlite3.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CRASH_IF_NOT_SQLITE_OK(x) do { \
+    int _ret = x;                      \
+    if (_ret != SQLITE_OK && _ret != SQLITE_DONE && _ret != SQLITE_ROW) { \
+        fprintf(stderr, "sqlite error @ %s:%d: %s\n", __FILE__, __LINE__, sqlite3_errstr(_ret)); \
+        exit(1);                       \
+    }                                  \
+} while (0)
+
+#define CONTENT_WORDS 500
+#define GET_DOCUMENT_COUNT 20000
+
+static const char *IndexSchemaBefore =
+        "CREATE TABLE mime(id INTEGER PRIMARY KEY, name TEXT);"
+        "CREATE TABLE document ("
+        "   id INTEGER PRIMARY KEY,"
+        "   parent INTEGER REFERENCES document(id),"
+        "   mime INTEGER REFERENCES mime(id),"
+        "   path TEXT NOT NULL,"
+        "   version INTEGER NOT NULL,"
+        "   mtime INTEGER NOT NULL,"
+        "   size INTEGER NOT NULL,"
+        "   thumbnail_count INTEGER NOT NULL,"
+        "   json_data TEXT CHECK ( json_data IS NULL OR json_valid(json_data) )"
+        ");"
+        "CREATE UNIQUE INDEX document_path_idx ON document(path);"
+        "CREATE TABLE delete_list (id INTEGER PRIMARY KEY);"
+        "CREATE TABLE tag (id INTEGER NOT NULL, tag TEXT NOT NULL, PRIMARY KEY (id, tag));"
+        "CREATE TABLE descriptor (id INTEGER PRIMARY KEY);"
+        "CREATE TABLE embedding ("
+        "   id INTEGER, model_id INTEGER NOT NULL, start INTEGER NOT NULL, end INTEGER,"
+        "   embedding BLOB NOT NULL, PRIMARY KEY (id, model_id, start)"
+        ");"
+        "CREATE TABLE model (id INTEGER PRIMARY KEY, path TEXT NOT NULL UNIQUE, size INTEGER NOT NULL);";
+
+// IndexDatabaseTypedColumnsMigration
+static const char *IndexMigration =
+        "BEGIN;"
+        "ALTER TABLE document ADD COLUMN name TEXT;"
+        "ALTER TABLE document ADD COLUMN dir_path TEXT;"
+        "ALTER TABLE document ADD COLUMN extension TEXT;"
+        "ALTER TABLE document ADD COLUMN width INTEGER;"
+        "ALTER TABLE document ADD COLUMN height INTEGER;"
+        "ALTER TABLE document ADD COLUMN duration INTEGER;"
+        "ALTER TABLE document ADD COLUMN pages INTEGER;"
+        "ALTER TABLE document ADD COLUMN title TEXT;"
+        "ALTER TABLE document ADD COLUMN author TEXT;"
+        "ALTER TABLE document ADD COLUMN checksum TEXT;"
+        "CREATE TABLE document_content ("
+        "   id INTEGER PRIMARY KEY REFERENCES document(id),"
+        "   content TEXT NOT NULL"
+        ");"
+        "INSERT INTO document_content (id, content)"
+        " SELECT id, json_data->>'content' FROM document WHERE json_data->>'content' IS NOT NULL;"
+        "UPDATE document SET"
+        "  name = json_data->>'name',"
+        "  dir_path = json_data->>'path',"
+        "  extension = json_data->>'extension',"
+        "  width = CAST(json_data->>'width' AS INTEGER),"
+        "  height = CAST(json_data->>'height' AS INTEGER),"
+        "  duration = CAST(json_data->>'duration' AS INTEGER),"
+        "  pages = CAST(json_data->>'pages' AS INTEGER),"
+        "  title = json_data->>'title',"
+        "  author = json_data->>'author',"
+        "  checksum = json_data->>'checksum',"
+        "  json_data = NULLIF(json_remove(json_data, '$.name', '$.path', '$.extension', '$.width', '$.height',"
+        "   '$.duration', '$.pages', '$.title', '$.author', '$.checksum', '$.content'), '{}')"
+        " WHERE json_data IS NOT NULL;"
+        "COMMIT;"
+        "VACUUM;";
+
+#define FTS_SEARCH_TABLE \
+        "CREATE VIRTUAL TABLE fts.search USING fts5 (" \
+        "   name, content, title, path, content='document_view', content_rowid='id'" \
+        ");" \
+        "INSERT INTO fts.search(search, rank) VALUES('rank', 'bm25(8, 3, 8, 5)');"
+
+static const char *FtsSchemaBefore =
+        "CREATE TABLE fts.document_index ("
+        "   id INTEGER PRIMARY KEY, index_id INTEGER NOT NULL, size INTEGER NOT NULL, name TEXT NOT NULL,"
+        "   path TEXT NOT NULL, mtime INTEGER NOT NULL, mime TEXT, thumbnail_count INTEGER NOT NULL,"
+        "   json_data TEXT NOT NULL"
+        ");"
+        "CREATE VIEW fts.document_view (id, name, content, title, path) AS"
+        " SELECT id, json_data->>'name', json_data->>'content', json_data->>'title', json_data->>'path'"
+        " FROM document_index;"
+        FTS_SEARCH_TABLE;
+
+static const char *FtsSchemaAfter =
+        "CREATE TABLE fts.document_index ("
+        "   id INTEGER PRIMARY KEY, index_id INTEGER NOT NULL, size INTEGER NOT NULL, name TEXT NOT NULL,"
+        "   path TEXT NOT NULL, mtime INTEGER NOT NULL, mime TEXT, thumbnail_count INTEGER NOT NULL,"
+        "   title TEXT, json_data TEXT NOT NULL"
+        ");"
+        "CREATE TABLE fts.document_content (id INTEGER PRIMARY KEY, content TEXT NOT NULL);"
+        "CREATE VIEW fts.document_view (id, name, content, title, path) AS"
+        " SELECT doc.id, doc.name, c.content, doc.title, doc.path"
+        " FROM document_index doc LEFT JOIN document_content c ON c.id = doc.id;"
+        FTS_SEARCH_TABLE;
+
+#define PATH_TMP_TABLE \
+        "CREATE TEMP TABLE path_tmp (" \
+        " path TEXT, index_id TEXT, count INTEGER NOT NULL, depth INTEGER NOT NULL," \
+        " children INTEGER NOT NULL DEFAULT(0), total INTEGER AS (count + children)," \
+        " PRIMARY KEY (path, index_id)" \
+        ");"
+
+#define FTS_SEARCH_BUILD \
+        "INSERT INTO fts.search(search) VALUES ('delete-all');" \
+        "INSERT INTO fts.search(rowid, name, content, title, path)" \
+        " SELECT id, name, content, title, path from fts.document_view;"
+
+static const char *FtsIndexBefore =
+        "WITH docs AS ("
+        " SELECT "
+        "  ((SELECT id FROM descriptor) << 32) | document.id as id,"
+        "  (SELECT id FROM descriptor) as index_id,"
+        "  size,"
+        "  document.json_data ->> 'name' as name,"
+        "  document.json_data ->> 'path' as path,"
+        "  mtime,"
+        "  m.name as mime,"
+        "  thumbnail_count,"
+        "  document.json_data"
+        " FROM document"
+        " LEFT JOIN mime m ON m.id=document.mime"
+        " )"
+        " INSERT"
+        " INTO fts.document_index (id, index_id, size, name, path, mtime, mime, thumbnail_count, json_data)"
+        " SELECT * FROM docs WHERE true"
+        " on conflict (id) do update set "
+        "  size=excluded.size, mtime=excluded.mtime, mime=excluded.mime, json_data=excluded.json_data;"
+        "DELETE FROM fts.document_index"
+        " WHERE id IN (SELECT id FROM delete_list)"
+        "  AND index_id = (SELECT id FROM descriptor);"
+        PATH_TMP_TABLE
+        "INSERT INTO path_tmp (path, index_id, count, depth)"
+        " SELECT path, index_id, count(*), CASE WHEN length(json_data->>'path') == 0 THEN 0"
+        " ELSE 1 + length(json_data->>'path') - length(REPLACE(json_data->>'path', '/', ''))"
+        " END as depth FROM fts.document_index WHERE depth > 0"
+        " GROUP BY path;"
+        FTS_SEARCH_BUILD;
+
+#define DOCUMENT_JSON_SQL(content) \
+        "json_patch(COALESCE(doc.json_data, '{}'), json_object(" \
+        "'name', doc.name, 'path', doc.dir_path, 'extension', doc.extension," \
+        "'width', doc.width, 'height', doc.height, 'duration', doc.duration, 'pages', doc.pages," \
+        "'title', doc.title, 'author', doc.author, 'checksum', doc.checksum, 'content', " content "))"
+
+static const char *FtsIndexAfter =
+        "WITH docs AS ("
+        " SELECT "
+        "  ((SELECT id FROM descriptor) << 32) | doc.id as id,"
+        "  (SELECT id FROM descriptor) as index_id,"
+        "  size,"
+        "  COALESCE(doc.name, '') as name,"
+        "  COALESCE(doc.dir_path, '') as path,"
+        "  mtime,"
+        "  m.name as mime,"
+        "  thumbnail_count,"
+        "  doc.title,"
+        "  " DOCUMENT_JSON_SQL("NULL") " as json_data"
+        " FROM document doc"
+        " LEFT JOIN mime m ON m.id=doc.mime"
+        " )"
+        " INSERT"
+        " INTO fts.document_index (id, index_id, size, name, path, mtime, mime, thumbnail_count, title, json_data)"
+        " SELECT * FROM docs WHERE true"
+        " on conflict (id) do update set "
+        "  size=excluded.size, mtime=excluded.mtime, mime=excluded.mime, title=excluded.title,"
+        "  json_data=excluded.json_data;"
+        "DELETE FROM fts.document_content"
+        " WHERE id >> 32 = (SELECT id FROM descriptor)"
+        "  AND (id & 0xFFFFFFFF) NOT IN (SELECT id FROM document_content);"
+        "INSERT INTO fts.document_content (id, content)"
+        " SELECT ((SELECT id FROM descriptor) << 32) | id, content FROM document_content WHERE true"
+        " ON CONFLICT (id) DO UPDATE SET content=excluded.content;"
+        "DELETE FROM fts.document_index"
+        " WHERE id IN (SELECT id FROM delete_list)"
+        "  AND index_id = (SELECT id FROM descriptor);"
+        "DELETE FROM fts.document_content"
+        " WHERE id NOT IN (SELECT id FROM fts.document_index);"
+        PATH_TMP_TABLE
+        "INSERT INTO path_tmp (path, index_id, count, depth)"
+        " SELECT path, index_id, count(*), CASE WHEN length(path) == 0 THEN 0"
+        " ELSE 1 + length(path) - length(REPLACE(path, '/', ''))"
+        " END as depth FROM fts.document_index WHERE depth > 0"
+        " GROUP BY path;"
+        FTS_SEARCH_BUILD;
+
+#define ITERATOR_EMBEDDINGS \
+        "SELECT CASE" \
+        " WHEN emb.embedding IS NULL THEN j" \
+        " ELSE json_set(j," \
+        "  '$.emb', json_group_object(m.path, json(emb_to_json(emb.embedding)))," \
+        "  '$.embedding', 1" \
+        "     ) END"
+
+static const char *IteratorBefore =
+        "WITH doc (id, j) AS ("
+        "SELECT"
+        " document.id,"
+        " json_set(document.json_data,"
+        "  '$._id', document.id,"
+        "  '$.index', (SELECT id FROM descriptor),"
+        "  '$.size', document.size,"
+        "  '$.mtime', document.mtime,"
+        "  '$.mime', mim.name,"
+        "  '$.thumbnail', document.thumbnail_count,"
+        "  '$.tag', json_group_array(t.tag))"
+        " FROM document"
+        "  LEFT JOIN mime mim ON mim.id = document.mime"
+        "  LEFT JOIN tag t ON t.id = document.id"
+        " GROUP BY document.id)"
+        ITERATOR_EMBEDDINGS
+        " FROM doc"
+        " LEFT JOIN embedding emb ON doc.id = emb.id"
+        " LEFT JOIN model m ON emb.model_id = m.id"
+        " GROUP BY doc.id";
+
+static const char *IteratorAfter =
+        "WITH docs (id, j) AS ("
+        "SELECT"
+        " doc.id,"
+        " json_set(" DOCUMENT_JSON_SQL("c.content") ","
+        "  '$._id', doc.id,"
+        "  '$.index', (SELECT id FROM descriptor),"
+        "  '$.size', doc.size,"
+        "  '$.mtime', doc.mtime,"
+        "  '$.mime', mim.name,"
+        "  '$.thumbnail', doc.thumbnail_count,"
+        "  '$.tag', json_group_array(t.tag))"
+        " FROM document doc"
+        "  LEFT JOIN document_content c ON c.id = doc.id"
+        "  LEFT JOIN mime mim ON mim.id = doc.mime"
+        "  LEFT JOIN tag t ON t.id = doc.id"
+        " GROUP BY doc.id)"
+        ITERATOR_EMBEDDINGS
+        " FROM docs"
+        " LEFT JOIN embedding emb ON docs.id = emb.id"
+        " LEFT JOIN model m ON emb.model_id = m.id"
+        " GROUP BY docs.id";
+
+static const char *GetDocumentBefore =
+        "SELECT json_set(json_data, "
+        "'$._id', CAST (doc.id AS TEXT),"
+        "'$.thumbnail', doc.thumbnail_count,"
+        "'$.mime', m.name,"
+        "'$.size', doc.size"
+        ") FROM document doc LEFT JOIN mime m ON m.id=doc.mime WHERE doc.id=?";
+
+static const char *GetDocumentAfter =
+        "SELECT json_set(" DOCUMENT_JSON_SQL("c.content") ","
+        "'$._id', CAST (doc.id AS TEXT),"
+        "'$.thumbnail', doc.thumbnail_count,"
+        "'$.mime', m.name,"
+        "'$.size', doc.size"
+        ") FROM document doc"
+        " LEFT JOIN document_content c ON c.id=doc.id"
+        " LEFT JOIN mime m ON m.id=doc.mime WHERE doc.id=?";
+
+static const char *Words[] = {
+        "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do",
+        "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua", "enim",
+        "minim", "veniam", "quis", "nostrud", "exercitation", "ullamco", "laboris", "nisi", "aliquip", "commodo"
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// The iterator only calls it for documents with embeddings, there are none here
+static void emb_to_json_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    sqlite3_result_text(ctx, "[]", -1, SQLITE_STATIC);
+}
+
+static sqlite3 *open_index(const char *path) {
+    sqlite3 *db;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_open(path, &db));
+    sqlite3_create_function(db, "emb_to_json", 1, SQLITE_UTF8, NULL, emb_to_json_func, NULL, NULL);
+    return db;
+}
+
+static void populate(sqlite3 *db, int doc_count) {
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, IndexSchemaBefore, NULL, NULL, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db, "BEGIN;"
+                "INSERT INTO descriptor VALUES (1);"
+                "INSERT INTO mime VALUES (1, 'image/jpeg'), (2, 'application/pdf'), (3, 'text/plain'),"
+                " (4, 'video/mp4');",
+            NULL, NULL, NULL));
+
+    // The keys that got a column, plus one that did not (exif_make)
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db, "INSERT INTO document (id, mime, path, version, mtime, size, thumbnail_count, json_data)"
+                " VALUES (?1, ?2, ?3, 1, ?4, ?5, ?6, json_patch('{}', json_object("
+                "  'name', ?7, 'path', ?8, 'extension', ?9, 'width', ?10, 'height', ?11, 'duration', ?12,"
+                "  'pages', ?13, 'title', ?14, 'author', ?15, 'checksum', ?16, 'content', ?17, 'exif_make', ?18)));",
+            -1, &stmt, NULL));
+
+    char path[128], dir_path[64], name[32], title[64], checksum[41];
+    char *content = malloc(CONTENT_WORDS * 16);
+
+    srand(42);
+    for (int id = 1; id <= doc_count; id++) {
+        int mime = 1 + id % 4;
+        const char *extension = mime == 1 ? "jpg" : mime == 2 ? "pdf" : mime == 3 ? "txt" : "mp4";
+
+        snprintf(dir_path, sizeof(dir_path), "dir%d/sub%d", id % 100, id % 1000);
+        snprintf(name, sizeof(name), "file%d", id);
+        snprintf(path, sizeof(path), "%s/%s.%s", dir_path, name, extension);
+        for (int i = 0; i < 40; i++) {
+            checksum[i] = "0123456789abcdef"[rand() % 16];
+        }
+        checksum[40] = '\0';
+
+        sqlite3_bind_int(stmt, 1, id);
+        sqlite3_bind_int(stmt, 2, mime);
+        sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, 1600000000 + rand() % 100000000);
+        sqlite3_bind_int(stmt, 5, rand() % 10000000);
+        sqlite3_bind_int(stmt, 6, mime == 3 ? 0 : 1);
+        sqlite3_bind_text(stmt, 7, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 8, dir_path, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 9, extension, -1, SQLITE_STATIC);
+        for (int i = 10; i <= 18; i++) {
+            sqlite3_bind_null(stmt, i);
+        }
+
+        if (mime == 1 || mime == 4) {
+            sqlite3_bind_int(stmt, 10, 1920);
+            sqlite3_bind_int(stmt, 11, 1080);
+        }
+        if (mime == 4) {
+            sqlite3_bind_int(stmt, 12, rand() % 3600);
+        }
+        if (mime == 1) {
+            sqlite3_bind_text(stmt, 18, "Canon", -1, SQLITE_STATIC);
+        }
+        if (mime == 2) {
+            snprintf(title, sizeof(title), "%s %s %s", Words[rand() % 30], Words[rand() % 30], Words[rand() % 30]);
+            sqlite3_bind_int(stmt, 13, 1 + rand() % 300);
+            sqlite3_bind_text(stmt, 14, title, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 15, Words[rand() % 30], -1, SQLITE_STATIC);
+        }
+        sqlite3_bind_text(stmt, 16, checksum, -1, SQLITE_STATIC);
+
+        if (mime == 2 || mime == 3) {
+            char *c = content;
+            for (int i = 0; i < CONTENT_WORDS; i++) {
+                c += sprintf(c, i == 0 ? "%s" : " %s", Words[rand() % 30]);
+            }
+            sqlite3_bind_text(stmt, 17, content, -1, SQLITE_STATIC);
+        }
+
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_step(stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(stmt));
+    }
+    free(content);
+    sqlite3_finalize(stmt);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL));
+}
+
+static double time_fts_index(sqlite3 *db, const char *fts_path, const char *schema, const char *sql) {
+    remove(fts_path);
+
+    char attach[PATH_MAX];
+    snprintf(attach, sizeof(attach), "ATTACH DATABASE '%s' AS fts;", fts_path);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, attach, NULL, NULL, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, schema, NULL, NULL, NULL));
+
+    double start = now();
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, sql, NULL, NULL, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL));
+    double elapsed = now() - start;
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, "DROP TABLE temp.path_tmp; DETACH DATABASE fts;", NULL, NULL, NULL));
+    remove(fts_path);
+    return elapsed;
+}
+
+static double time_iterator(sqlite3 *db, const char *sql, long *bytes) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
+
+    *bytes = 0;
+    double start = now();
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        *bytes += sqlite3_column_bytes(stmt, 0);
+    }
+    double elapsed = now() - start;
+
+    sqlite3_finalize(stmt);
+    return elapsed;
+}
+
+static double time_get_document(sqlite3 *db, const char *sql, int doc_count) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
+
+    srand(1);
+    double start = now();
+    for (int i = 0; i < GET_DOCUMENT_COUNT; i++) {
+        sqlite3_bind_int(stmt, 1, 1 + rand() % doc_count);
+        if (sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_bytes(stmt, 0) == 0) {
+            fprintf(stderr, "get_document returned nothing\n");
+            exit(1);
+        }
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(stmt));
+    }
+    double elapsed = now() - start;
+
+    sqlite3_finalize(stmt);
+    return elapsed;
+}
+
+static void run(const char *name, const char *index_path, const char *fts_path, int doc_count,
+                const char *fts_schema, const char *fts_index, const char *iterator, const char *get_document) {
+    sqlite3 *db = open_index(index_path);
+
+    // Once so that both versions start with the index in the page cache
+    long bytes;
+    time_iterator(db, iterator, &bytes);
+
+    double fts_time = time_fts_index(db, fts_path, fts_schema, fts_index);
+    double iterator_time = time_iterator(db, iterator, &bytes);
+    double get_document_time = time_get_document(db, get_document, doc_count);
+
+    printf("%-7s fts index %6.2fs | iterator %6.2fs (%ld MiB) | get_document %6.0f/s\n",
+           name, fts_time, iterator_time, bytes / (1024 * 1024), GET_DOCUMENT_COUNT / get_document_time);
+
+    sqlite3_close(db);
+}
+
+int main(int argc, char **argv) {
+    int doc_count = argc > 1 ? (int) strtol(argv[1], NULL, 10) : 100000;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+
+    char before_path[PATH_MAX], after_path[PATH_MAX], fts_path[PATH_MAX];
+    snprintf(before_path, sizeof(before_path), "%s/document_columns_before.sist2", dir);
+    snprintf(after_path, sizeof(after_path), "%s/document_columns_after.sist2", dir);
+    snprintf(fts_path, sizeof(fts_path), "%s/document_columns_fts.sist2", dir);
+    remove(before_path);
+    remove(after_path);
+
+    sqlite3 *db = open_index(before_path);
+    double start = now();
+    populate(db, doc_count);
+    printf("Inserted %d documents in %.2fs\n", doc_count, now() - start);
+
+    char vacuum[PATH_MAX * 2];
+    snprintf(vacuum, sizeof(vacuum), "VACUUM INTO '%s';", after_path);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, vacuum, NULL, NULL, NULL));
+    sqlite3_close(db);
+
+    db = open_index(after_path);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db, IndexMigration, NULL, NULL, NULL));
+    sqlite3_close(db);
+
+    for (int i = 0; i < 3; i++) {
+        run("before", before_path, fts_path, doc_count, FtsSchemaBefore, FtsIndexBefore, IteratorBefore,
+            GetDocumentBefore);
+        run("after", after_path, fts_path, doc_count, FtsSchemaAfter, FtsIndexAfter, IteratorAfter,
+            GetDocumentAfter);
+    }
+
+    remove(before_path);
+    remove(after_path);
+    return 0;
+}
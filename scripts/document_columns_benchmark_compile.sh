@@ -0,0 +1,3 @@
+# Run from the root of the repository
+gcc -I/mnt/work/vcpkg/installed/x64-linux/include -O2 scripts/document_columns_benchmark.c \
+  -L/mnt/work/vcpkg/installed/x64-linux/lib -lsqlite3 -lpthread -ldl -lm -o document_columns_benchmark
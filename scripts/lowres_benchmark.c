@@ -0,0 +1,195 @@
+/*
+ * Times the decode and scale steps of an image thumbnail, with and without
+ * reduced-resolution decoding (see get_thumbnail_lowres() in media.c).
+ *
+ * The JPEG files given on the command line are used, or a synthetic
+ * 4000x3000 photo-like JPEG if there are none. Each image is decoded
+ * ITERATIONS times and scaled to TN_SIZE pixels on its largest side with the
+ * same filters as scale_frame().
+ *
+ * Usage: lowres_benchmark [image.jpg...]
+ */
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TN_SIZE 552
+#define ITERATIONS 20
+
+typedef struct {
+    uint8_t *data;
+    int size;
+} image_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static image_t encode_synthetic_jpeg(int width, int height) {
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    AVCodecContext *enc = avcodec_alloc_context3(codec);
+    enc->width = width;
+    enc->height = height;
+    enc->time_base = (AVRational) {1, 1};
+    enc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    enc->flags |= AV_CODEC_FLAG_QSCALE;
+    enc->global_quality = FF_QP2LAMBDA * 3;
+    if (avcodec_open2(enc, codec, NULL) != 0) {
+        fprintf(stderr, "Could not open the MJPEG encoder\n");
+        exit(1);
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    frame->width = width;
+    frame->height = height;
+    frame->format = enc->pix_fmt;
+    frame->quality = enc->global_quality;
+    av_frame_get_buffer(frame, 0);
+
+    // Gradients with some noise, so that the blocks are not all flat
+    srand(42);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            frame->data[0][y * frame->linesize[0] + x] = (uint8_t) ((x * 255 / width + y * 255 / height) / 2
+                                                                   + rand() % 32);
+        }
+    }
+    for (int y = 0; y < height / 2; y++) {
+        for (int x = 0; x < width / 2; x++) {
+            frame->data[1][y * frame->linesize[1] + x] = (uint8_t) (x * 255 / (width / 2));
+            frame->data[2][y * frame->linesize[2] + x] = (uint8_t) (y * 255 / (height / 2));
+        }
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    avcodec_send_frame(enc, frame);
+    avcodec_send_frame(enc, NULL);
+    if (avcodec_receive_packet(enc, packet) != 0) {
+        fprintf(stderr, "Could not encode the synthetic image\n");
+        exit(1);
+    }
+
+    image_t image = {.data = malloc(packet->size), .size = packet->size};
+    memcpy(image.data, packet->data, packet->size);
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    return image;
+}
+
+static image_t read_image(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    image_t image = {.size = (int) ftell(file)};
+    fseek(file, 0, SEEK_SET);
+    image.data = malloc(image.size);
+    if (fread(image.data, 1, image.size, file) != (size_t) image.size) {
+        perror(path);
+        exit(1);
+    }
+    fclose(file);
+    return image;
+}
+
+/**
+ * Decode the image at 1/2^lowres of its resolution and scale it to TN_SIZE
+ * @return the largest side of the decoded frame
+ */
+static int make_thumbnail(const image_t *image, int lowres) {
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+    AVCodecContext *decoder = avcodec_alloc_context3(codec);
+    decoder->thread_count = 1;
+    decoder->lowres = lowres;
+    avcodec_open2(decoder, codec, NULL);
+
+    AVPacket *packet = av_packet_alloc();
+    packet->data = image->data;
+    packet->size = image->size;
+    AVFrame *frame = av_frame_alloc();
+
+    if (avcodec_send_packet(decoder, packet) != 0 || avcodec_receive_frame(decoder, frame) != 0) {
+        fprintf(stderr, "Could not decode the image\n");
+        exit(1);
+    }
+
+    double ratio = (double) frame->width / frame->height;
+    int dstW = frame->width > frame->height ? TN_SIZE : (int) (TN_SIZE * ratio);
+    int dstH = frame->width > frame->height ? (int) (TN_SIZE / ratio) : TN_SIZE;
+
+    struct SwsContext *sws_ctx = sws_getContext(
+            frame->width, frame->height, frame->format,
+            dstW, dstH, AV_PIX_FMT_YUV420P,
+            lowres > 0 ? SWS_BICUBIC : SWS_LANCZOS, 0, 0, 0
+    );
+    uint8_t *dst_data[4];
+    int dst_linesize[4];
+    av_image_alloc(dst_data, dst_linesize, dstW, dstH, AV_PIX_FMT_YUV420P, 1);
+    sws_scale(sws_ctx, (const uint8_t *const *) frame->data, frame->linesize, 0, frame->height,
+              dst_data, dst_linesize);
+
+    int decoded_size = frame->width > frame->height ? frame->width : frame->height;
+
+    av_freep(&dst_data[0]);
+    sws_freeContext(sws_ctx);
+    av_frame_free(&frame);
+    packet->data = NULL;
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder);
+
+    return decoded_size;
+}
+
+// Same rule as get_thumbnail_lowres()
+static int get_lowres(const image_t *image) {
+    int max_dimension = make_thumbnail(image, 0);
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+
+    int lowres = 0;
+    while (lowres < codec->max_lowres && (max_dimension >> (lowres + 1)) >= TN_SIZE) {
+        lowres += 1;
+    }
+    return lowres;
+}
+
+int main(int argc, char **argv) {
+    int image_count = argc > 1 ? argc - 1 : 1;
+    image_t *images = malloc(sizeof(image_t) * image_count);
+    int *lowres = malloc(sizeof(int) * image_count);
+
+    for (int i = 0; i < image_count; i++) {
+        images[i] = argc > 1 ? read_image(argv[i + 1]) : encode_synthetic_jpeg(4000, 3000);
+        lowres[i] = get_lowres(&images[i]);
+        printf("Image %d: %d bytes, lowres %d\n", i, images[i].size, lowres[i]);
+    }
+
+    for (int reduced = 0; reduced <= 1; reduced++) {
+        double start = now();
+        for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+            for (int i = 0; i < image_count; i++) {
+                int decoded_size = make_thumbnail(&images[i], reduced ? lowres[i] : 0);
+                if (decoded_size < TN_SIZE) {
+                    fprintf(stderr, "Image %d was decoded to %dpx, less than %dpx\n", i, decoded_size, TN_SIZE);
+                    return 1;
+                }
+            }
+        }
+        double elapsed = now() - start;
+
+        printf("%-16s %6.1f images/s\n", reduced ? "with lowres" : "without lowres",
+               (double) ITERATIONS * image_count / elapsed);
+    }
+
+    return 0;
+}
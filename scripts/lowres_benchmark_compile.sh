@@ -0,0 +1,3 @@
+# Run from the root of the repository
+gcc -I/mnt/work/vcpkg/installed/x64-linux/include -O2 scripts/lowres_benchmark.c \
+  -L/mnt/work/vcpkg/installed/x64-linux/lib -lavcodec -lswscale -lavutil -lpthread -ldl -lm -o lowres_benchmark
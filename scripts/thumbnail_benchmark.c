@@ -0,0 +1,238 @@
+/*
+ * Times the lookups done by serve_thumbnail() for a page full of thumbnails.
+ *
+ * A synthetic index with THUMBNAIL_COUNT thumbnails is written to the given
+ * path, first with the thumbnails in the thumbnail_data table, then with the
+ * same thumbnails in a pack segment. Each page requests PAGE_SIZE thumbnails
+ * of random documents, the requests of a page are served one after the other
+ * like the web server does.
+ *
+ * Usage: thumbnail_benchmark [index path] [page count]
+ */
+#include "src/ctx.h"
+#include "src/database/database_schema.c"
+#include "src/database/database_thumbnail.c"
+#include "third-party/libscan/libscan/util.c"
+
+#define THUMBNAIL_COUNT 10000
+#define THUMBNAIL_SIZE (12 * 1024)
+#define PAGE_SIZE 100
+
+LogCtx_t LogCtx;
+
+void sist_log(const char *filepath, int level, char *str) {
+    fprintf(stderr, "%s: %s\n", filepath, str);
+}
+
+void sist_logf(const char *filepath, int level, char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s: ", filepath);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Same queries as database_read_thumbnail_hash() and database_read_thumbnail()
+static int read_thumbnail_hash(database_t *db, int doc_id, unsigned char *hash) {
+    sqlite3_bind_int(db->select_thumbnail_stmt, 1, doc_id);
+    sqlite3_bind_int(db->select_thumbnail_stmt, 2, 0);
+
+    int ret = sqlite3_step(db->select_thumbnail_stmt);
+    if (ret == SQLITE_ROW) {
+        memcpy(hash, sqlite3_column_blob(db->select_thumbnail_stmt, 0), THUMBNAIL_HASH_LENGTH);
+    }
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_stmt));
+
+    return ret == SQLITE_ROW;
+}
+
+static size_t read_thumbnail(database_t *db, const unsigned char *hash) {
+    sqlite3_bind_blob(db->select_thumbnail_data_stmt, 1, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+
+    size_t size = 0;
+    if (sqlite3_step(db->select_thumbnail_data_stmt) == SQLITE_ROW) {
+        size = sqlite3_column_bytes(db->select_thumbnail_data_stmt, 0);
+        void *data = malloc(size);
+        memcpy(data, sqlite3_column_blob(db->select_thumbnail_data_stmt, 0), size);
+        free(data);
+    }
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_data_stmt));
+
+    return size;
+}
+
+static database_t *open_index(const char *path, int create) {
+    database_t *db = calloc(1, sizeof(database_t));
+    strcpy(db->filename, path);
+    db->thumbnail_pack_fd = -1;
+    db->ipc_ctx = calloc(1, sizeof(database_ipc_ctx_t));
+    pthread_mutex_init(&db->ipc_ctx->index_db_mutex, NULL);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_open(db->filename, &db->db));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL));
+    if (create) {
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseSchema, NULL, NULL, NULL));
+    }
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT hash FROM thumbnail WHERE id=? AND num=? LIMIT 1;", -1,
+            &db->select_thumbnail_stmt, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT data FROM thumbnail_data WHERE hash=?;", -1,
+            &db->select_thumbnail_data_stmt, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT EXISTS (SELECT 1 FROM thumbnail_pack WHERE hash=?1)"
+                    " OR EXISTS (SELECT 1 FROM thumbnail_data WHERE hash=?1);", -1,
+            &db->thumbnail_exists_stmt, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO thumbnail_pack (hash, segment, offset, size) VALUES (?,?,?,?) ON CONFLICT DO NOTHING;",
+            -1, &db->write_thumbnail_pack_stmt, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT segment, offset, size FROM thumbnail_pack WHERE hash=?;", -1,
+            &db->select_thumbnail_pack_stmt, NULL));
+
+    return db;
+}
+
+static void close_index(database_t *db) {
+    database_thumbnail_pack_close(db);
+    sqlite3_finalize(db->select_thumbnail_stmt);
+    sqlite3_finalize(db->select_thumbnail_data_stmt);
+    sqlite3_finalize(db->thumbnail_exists_stmt);
+    sqlite3_finalize(db->write_thumbnail_pack_stmt);
+    sqlite3_finalize(db->select_thumbnail_pack_stmt);
+    sqlite3_close(db->db);
+    free(db->ipc_ctx);
+    free(db);
+}
+
+static void populate(database_t *db, int packed) {
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "BEGIN;", NULL, NULL, NULL));
+
+    sqlite3_stmt *thumbnail_stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO thumbnail (id, num, hash) VALUES (?, 0, ?);", -1, &thumbnail_stmt, NULL));
+    sqlite3_stmt *data_stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO thumbnail_data (hash, data) VALUES (?, ?);", -1, &data_stmt, NULL));
+
+    char *data = malloc(THUMBNAIL_SIZE);
+    unsigned char hash[THUMBNAIL_HASH_LENGTH];
+
+    srand(42);
+    for (int id = 1; id <= THUMBNAIL_COUNT; id++) {
+        for (int i = 0; i < THUMBNAIL_SIZE; i++) {
+            data[i] = (char) rand();
+        }
+        database_thumbnail_hash(data, THUMBNAIL_SIZE, hash);
+
+        sqlite3_bind_int(thumbnail_stmt, 1, id);
+        sqlite3_bind_blob(thumbnail_stmt, 2, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+        CRASH_IF_STMT_FAIL(sqlite3_step(thumbnail_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(thumbnail_stmt));
+
+        if (packed) {
+            database_thumbnail_pack_write(db, hash, data, THUMBNAIL_SIZE);
+        } else {
+            sqlite3_bind_blob(data_stmt, 1, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+            sqlite3_bind_blob(data_stmt, 2, data, THUMBNAIL_SIZE, SQLITE_STATIC);
+            CRASH_IF_STMT_FAIL(sqlite3_step(data_stmt));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(data_stmt));
+        }
+    }
+    free(data);
+    sqlite3_finalize(thumbnail_stmt);
+    sqlite3_finalize(data_stmt);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "COMMIT;", NULL, NULL, NULL));
+}
+
+/**
+ * Serve page_count pages, with recheck the index is checked for packs on
+ * every request, like before the check was throttled.
+ */
+static void serve_pages(database_t *db, int page_count, int recheck, const char *name) {
+    unsigned char hash[THUMBNAIL_HASH_LENGTH];
+    size_t bytes = 0;
+
+    srand(1);
+    double start = now();
+    for (int page = 0; page < page_count; page++) {
+        for (int i = 0; i < PAGE_SIZE; i++) {
+            if (!read_thumbnail_hash(db, 1 + rand() % THUMBNAIL_COUNT, hash)) {
+                fprintf(stderr, "Missing thumbnail\n");
+                exit(1);
+            }
+
+            if (recheck) {
+                db->thumbnail_pack_checked = 0;
+            }
+
+            size_t size = 0;
+            const void *packed_data = database_thumbnail_pack_read(db, hash, &size);
+            if (packed_data != NULL) {
+                // Copied once, like mg_send() does into the send buffer
+                void *data = malloc(size);
+                memcpy(data, packed_data, size);
+                free(data);
+            } else {
+                size = read_thumbnail(db, hash);
+            }
+
+            if (size != THUMBNAIL_SIZE) {
+                fprintf(stderr, "Wrong thumbnail size %zu\n", size);
+                exit(1);
+            }
+            bytes += size;
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%-28s %8.0f thumbnails/s, %6.1f pages/s, %7.1f MiB/s\n", name,
+           (double) page_count * PAGE_SIZE / elapsed, (double) page_count / elapsed,
+           (double) bytes / elapsed / (1024 * 1024));
+}
+
+static void remove_index(const char *path) {
+    char cmd[PATH_MAX * 2];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s' '%s-wal' '%s-shm' '%s.thumbnails'", path, path, path, path);
+    system(cmd);
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/thumbnail_benchmark.sist2";
+    int page_count = argc > 2 ? (int) strtol(argv[2], NULL, 10) : 200;
+
+    for (int packed = 0; packed <= 1; packed++) {
+        remove_index(path);
+
+        database_t *db = open_index(path, TRUE);
+        populate(db, packed);
+        close_index(db);
+
+        // Serve from a fresh connection, like the web server
+        db = open_index(path, FALSE);
+        db->has_thumbnail_pack = database_thumbnail_pack_exists(db);
+        db->thumbnail_pack_checked = time(NULL);
+
+        if (packed) {
+            serve_pages(db, page_count, FALSE, "pack");
+        } else {
+            // Once to warm up the page cache
+            serve_pages(db, page_count, FALSE, "table, throttled check");
+            serve_pages(db, page_count, TRUE, "table, check every request");
+            serve_pages(db, page_count, FALSE, "table, throttled check");
+        }
+        close_index(db);
+    }
+
+    remove_index(path);
+    return 0;
+}
@@ -0,0 +1,3 @@
+# Run from the root of the repository, after sist2 was built once (src/git_hash.h)
+gcc -I/mnt/work/vcpkg/installed/x64-linux/include -I. -Ithird-party/libscan -O2 scripts/thumbnail_benchmark.c \
+  -L/mnt/work/vcpkg/installed/x64-linux/lib -lsqlite3 -lcjson -lcrypto -lpthread -ldl -lm -o thumbnail_benchmark
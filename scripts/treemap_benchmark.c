@@ -0,0 +1,138 @@
+/*
+ * Times database_generate_stats() on a synthetic index.
+ *
+ * The index has a tree of directories with DIRECTORY_FANOUT subdirectories
+ * each and FILES_PER_DIRECTORY files per directory. The treemap must account
+ * for the size of every file, this is checked after the stats are generated.
+ *
+ * Usage: treemap_benchmark [file count] [threshold]
+ */
+#include "src/ctx.h"
+#include "src/database/database_schema.c"
+#include "src/database/database_stats.c"
+#include "third-party/libscan/libscan/util.c"
+
+#include <time.h>
+
+#define DIRECTORY_FANOUT 8
+#define FILES_PER_DIRECTORY 50
+
+LogCtx_t LogCtx;
+
+void sist_log(const char *filepath, int level, char *str) {
+    fprintf(stderr, "%s: %s\n", filepath, str);
+}
+
+void sist_logf(const char *filepath, int level, char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s: ", filepath);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static long query_long(database_t *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL));
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    long value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static int directory_parent(int id) {
+    return (id - 1) / DIRECTORY_FANOUT;
+}
+
+static void directory_path(int id, char *path) {
+    if (id == 0) {
+        *path = '\0';
+        return;
+    }
+
+    directory_path(directory_parent(id), path);
+    if (*path != '\0') {
+        strcat(path, "/");
+    }
+    sprintf(path + strlen(path), "dir%d", id);
+}
+
+static void populate(database_t *db, long file_count) {
+    int directory_count = (int) (file_count / FILES_PER_DIRECTORY);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "BEGIN; INSERT INTO version DEFAULT VALUES;", NULL, NULL, NULL));
+
+    sqlite3_stmt *dir_stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO directory (id, parent_id, name, path) VALUES (?, ?, ?, ?);", -1, &dir_stmt, NULL));
+
+    char name[32];
+    char path[PATH_MAX];
+    for (int id = 1; id <= directory_count; id++) {
+        snprintf(name, sizeof(name), "dir%d", id);
+        directory_path(id, path);
+        sqlite3_bind_int(dir_stmt, 1, id);
+        sqlite3_bind_int(dir_stmt, 2, directory_parent(id));
+        sqlite3_bind_text(dir_stmt, 3, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(dir_stmt, 4, path, -1, SQLITE_STATIC);
+        CRASH_IF_STMT_FAIL(sqlite3_step(dir_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(dir_stmt));
+    }
+    sqlite3_finalize(dir_stmt);
+
+    sqlite3_stmt *doc_stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO document (directory_id, filename, version, mtime, size, thumbnail_count)"
+                    " VALUES (?, ?, 1, 0, ?, 0);", -1, &doc_stmt, NULL));
+
+    srand(42);
+    for (long i = 0; i < file_count; i++) {
+        snprintf(name, sizeof(name), "file%ld", i);
+        sqlite3_bind_int(doc_stmt, 1, (int) (i % (directory_count + 1)));
+        sqlite3_bind_text(doc_stmt, 2, name, -1, SQLITE_STATIC);
+        // Mostly small files, with a few large ones
+        sqlite3_bind_int64(doc_stmt, 3, rand() % 100 == 0 ? rand() % 1000000000 : rand() % 100000);
+        CRASH_IF_STMT_FAIL(sqlite3_step(doc_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(doc_stmt));
+    }
+    sqlite3_finalize(doc_stmt);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "COMMIT;", NULL, NULL, NULL));
+}
+
+int main(int argc, char **argv) {
+    long file_count = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+    double threshold = argc > 2 ? strtod(argv[2], NULL) : 0.0005;
+
+    LogCtx.verbose = TRUE;
+    LogCtx.very_verbose = TRUE;
+
+    database_t *db = calloc(1, sizeof(database_t));
+    strcpy(db->filename, ":memory:");
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_open(db->filename, &db->db));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseSchema, NULL, NULL, NULL));
+
+    double start = now();
+    populate(db, file_count);
+    printf("Inserted %ld files in %.2fs\n", file_count, now() - start);
+
+    start = now();
+    database_generate_stats(db, threshold);
+    printf("Generated the treemap in %.2fs\n", now() - start);
+
+    long total_size = query_long(db, "SELECT SUM(size) FROM document;");
+    long treemap_size = query_long(db, "SELECT SUM(size) FROM stats_treemap;");
+    printf("%ld rows, %ld bytes of %ld\n",
+           query_long(db, "SELECT COUNT(*) FROM stats_treemap;"), treemap_size, total_size);
+
+    sqlite3_close(db->db);
+    free(db);
+    return treemap_size == total_size ? 0 : 1;
+}
@@ -8,6 +8,8 @@
 #define DEFAULT_QUALITY 50
 #define DEFAULT_THUMBNAIL_SIZE 552
 #define DEFAULT_THUMBNAIL_COUNT 1
+#define DEFAULT_THUMBNAIL_COMPRESSION 6
+#define DEFAULT_THUMBNAIL_DECODE_THREADS 1
 #define DEFAULT_REWRITE_URL ""
 
 #define DEFAULT_ES_URL "http://localhost:9200"
@@ -20,6 +22,9 @@
 #define DEFAULT_TREEMAP_THRESHOLD 0.0005
 
 #define DEFAULT_MAX_MEM_BUFFER 2000
+#define DEFAULT_ARCHIVE_BLOCK_SIZE 1024
+#define DEFAULT_EBOOK_STORE_SIZE 256
+#define DEFAULT_EBOOK_PAGE_THREADS 1
 
 const char *TESS_DATAPATHS[] = {
         "/usr/share/tessdata/",
@@ -127,6 +132,24 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
         return 1;
     }
 
+    if (args->tn_compression == OPTION_VALUE_UNSPECIFIED) {
+        args->tn_compression = DEFAULT_THUMBNAIL_COMPRESSION;
+    } else if (args->tn_compression == OPTION_VALUE_DISABLE) {
+        args->tn_compression = 0;
+    } else if (args->tn_compression < 0 || args->tn_compression > 6) {
+        fprintf(stderr, "Invalid value for --thumbnail-compression argument: %d. Must be within [0, 6].\n",
+                args->tn_compression);
+        return 1;
+    }
+
+    if (args->tn_decode_threads == OPTION_VALUE_UNSPECIFIED) {
+        args->tn_decode_threads = DEFAULT_THUMBNAIL_DECODE_THREADS;
+    } else if (args->tn_decode_threads < 1) {
+        fprintf(stderr, "Invalid value for --thumbnail-decode-threads argument: %d. Must be a positive number.\n",
+                args->tn_decode_threads);
+        return 1;
+    }
+
     if (args->content_size == OPTION_VALUE_UNSPECIFIED) {
         args->content_size = DEFAULT_CONTENT_SIZE;
     }
@@ -190,6 +213,34 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
         return 1;
     }
 
+    if (args->archive_block_size_kib == OPTION_VALUE_UNSPECIFIED) {
+        args->archive_block_size_kib = DEFAULT_ARCHIVE_BLOCK_SIZE;
+    } else if (args->archive_block_size_kib < 1) {
+        fprintf(stderr, "Invalid value for --archive-block-size argument: %d. Must be a positive number.\n",
+                args->archive_block_size_kib);
+        return 1;
+    }
+
+    if (args->tn_source == OPTION_VALUE_UNSPECIFIED || strcmp(args->tn_source, "auto") == 0) {
+        args->tn_source_mode = THUMBNAIL_SOURCE_AUTO;
+    } else if (strcmp(args->tn_source, "embedded") == 0) {
+        args->tn_source_mode = THUMBNAIL_SOURCE_EMBEDDED;
+    } else if (strcmp(args->tn_source, "decode") == 0) {
+        args->tn_source_mode = THUMBNAIL_SOURCE_DECODE;
+    } else {
+        fprintf(stderr, "Thumbnail source must be one of (embedded, decode, auto), got '%s'", args->tn_source);
+        return 1;
+    }
+
+    if (args->media_probe == OPTION_VALUE_UNSPECIFIED || strcmp(args->media_probe, "full") == 0) {
+        args->media_probe_mode = MEDIA_PROBE_FULL;
+    } else if (strcmp(args->media_probe, "fast") == 0) {
+        args->media_probe_mode = MEDIA_PROBE_FAST;
+    } else {
+        fprintf(stderr, "Media probe mode must be one of (fast, full), got '%s'", args->media_probe);
+        return 1;
+    }
+
     if (args->ocr_images && args->tesseract_lang == OPTION_VALUE_UNSPECIFIED) {
         fprintf(stderr, "You must specify --ocr-lang <LANG> to use --ocr-images");
         return 1;
@@ -274,6 +325,22 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
         args->max_memory_buffer_mib = DEFAULT_MAX_MEM_BUFFER;
     }
 
+    if (args->ebook_store_size_mib == OPTION_VALUE_UNSPECIFIED) {
+        args->ebook_store_size_mib = DEFAULT_EBOOK_STORE_SIZE;
+    } else if (args->ebook_store_size_mib < 0) {
+        fprintf(stderr, "Invalid value for --ebook-store-size argument: %d. Must be a positive number, or 0 for the MuPDF default.\n",
+                args->ebook_store_size_mib);
+        return 1;
+    }
+
+    if (args->ebook_page_threads == OPTION_VALUE_UNSPECIFIED) {
+        args->ebook_page_threads = DEFAULT_EBOOK_PAGE_THREADS;
+    } else if (args->ebook_page_threads < 1) {
+        fprintf(stderr, "Invalid value for --ebook-page-threads argument: %d. Must be a positive number.\n",
+                args->ebook_page_threads);
+        return 1;
+    }
+
     if (args->list_path != OPTION_VALUE_UNSPECIFIED) {
         if (strcmp(args->list_path, "-") == 0) {
             args->list_file = stdin;
@@ -290,6 +357,10 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
     LOG_DEBUGF("cli.c", "arg tn_quality=%f", args->tn_quality);
     LOG_DEBUGF("cli.c", "arg tn_size=%d", args->tn_size);
     LOG_DEBUGF("cli.c", "arg tn_count=%d", args->tn_count);
+    LOG_DEBUGF("cli.c", "arg tn_compression=%d", args->tn_compression);
+    LOG_DEBUGF("cli.c", "arg tn_source=%s", args->tn_source);
+    LOG_DEBUGF("cli.c", "arg tn_decode_threads=%d", args->tn_decode_threads);
+    LOG_DEBUGF("cli.c", "arg media_probe=%s", args->media_probe);
     LOG_DEBUGF("cli.c", "arg content_size=%d", args->content_size);
     LOG_DEBUGF("cli.c", "arg threads=%d", args->threads);
     LOG_DEBUGF("cli.c", "arg incremental=%d", args->incremental);
@@ -300,13 +371,18 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
     LOG_DEBUGF("cli.c", "arg path=%s", args->path);
     LOG_DEBUGF("cli.c", "arg archive=%s", args->archive);
     LOG_DEBUGF("cli.c", "arg archive_passphrase=%s", args->archive_passphrase);
+    LOG_DEBUGF("cli.c", "arg archive_block_size_kib=%d", args->archive_block_size_kib);
     LOG_DEBUGF("cli.c", "arg tesseract_lang=%s", args->tesseract_lang);
     LOG_DEBUGF("cli.c", "arg tesseract_path=%s", args->tesseract_path);
     LOG_DEBUGF("cli.c", "arg exclude=%s", args->exclude_regex);
     LOG_DEBUGF("cli.c", "arg fast=%d", args->fast);
     LOG_DEBUGF("cli.c", "arg fast_epub=%d", args->fast_epub);
+    LOG_DEBUGF("cli.c", "arg compress_content=%d", args->compress_content);
+    LOG_DEBUGF("cli.c", "arg thumbnail_pack=%d", args->thumbnail_pack);
     LOG_DEBUGF("cli.c", "arg treemap_threshold=%f", args->treemap_threshold);
     LOG_DEBUGF("cli.c", "arg max_memory_buffer_mib=%d", args->max_memory_buffer_mib);
+    LOG_DEBUGF("cli.c", "arg ebook_store_size_mib=%d", args->ebook_store_size_mib);
+    LOG_DEBUGF("cli.c", "arg ebook_page_threads=%d", args->ebook_page_threads);
     LOG_DEBUGF("cli.c", "arg list_path=%s", args->list_path);
 
     return 0;
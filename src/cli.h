@@ -4,6 +4,8 @@
 #include "sist.h"
 
 #include "libscan/arc/arc.h"
+#include "libscan/raw/raw.h"
+#include "libscan/media/media.h"
 
 #define OPTION_VALUE_DISABLE (-1)
 #define OPTION_VALUE_UNSPECIFIED (0)
@@ -23,6 +25,7 @@ typedef struct scan_args {
     char *archive;
     archive_mode_t archive_mode;
     char *archive_passphrase;
+    int archive_block_size_kib;
     char *tesseract_lang;
     const char *tesseract_path;
     int ocr_images;
@@ -32,11 +35,21 @@ typedef struct scan_args {
     const char* treemap_threshold_str;
     double treemap_threshold;
     int max_memory_buffer_mib;
+    int ebook_store_size_mib;
+    int ebook_page_threads;
     int read_subtitles;
     /** Number of thumbnails to generate */
     int tn_count;
+    int tn_compression;
+    char *tn_source;
+    thumbnail_source_t tn_source_mode;
+    int tn_decode_threads;
+    char *media_probe;
+    media_probe_t media_probe_mode;
     int fast_epub;
     int calculate_checksums;
+    int compress_content;
+    int thumbnail_pack;
     char *list_path;
     FILE *list_file;
 } scan_args_t;
@@ -31,6 +31,8 @@ typedef struct {
     int threads;
     int depth;
     int calculate_checksums;
+    int compress_content;
+    int thumbnail_pack;
 
     pcre *exclude;
     pcre_extra *exclude_extra;
@@ -15,6 +15,13 @@ database_t *database_create(const char *filename, database_type_t type) {
     strcpy(db->filename, filename);
     db->type = type;
     db->select_thumbnail_stmt = NULL;
+    db->thumbnail_pack_fd = -1;
+    db->thumbnail_pack_maps = NULL;
+    db->thumbnail_pack_map_count = 0;
+    db->has_thumbnail_pack = FALSE;
+    db->thumbnail_pack_checked = 0;
+    db->directory_cache_path[0] = '\0';
+    db->directory_cache_id = 0;
     db->db = NULL;
     db->tag_array = NULL;
 
@@ -84,6 +91,23 @@ void path_parent_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
     sqlite3_result_text(ctx, parent, stop, SQLITE_TRANSIENT);
 }
 
+void path_escape_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(ctx, "Invalid parameters", -1);
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    char escaped[PATH_MAX * 3];
+    str_escape(escaped, (const char *) sqlite3_value_text(argv[0]));
+
+    sqlite3_result_text(ctx, escaped, -1, SQLITE_TRANSIENT);
+}
+
 void random_func(sqlite3_context *ctx, int argc, UNUSED(sqlite3_value **argv)) {
 #ifdef SIST_DEBUG
     if (argc != 1 || sqlite3_value_type(argv[0]) != SQLITE_INTEGER) {
@@ -111,14 +135,105 @@ void save_current_job_info(sqlite3_context *ctx, int argc, sqlite3_value **argv)
 
     const char *current_job = (const char *) sqlite3_value_text(argv[0]);
 
-    char buf[PATH_MAX];
-    strcpy(buf, current_job);
-
     SET_CURRENT_JOB(ipc_ctx, current_job);
 
     sqlite3_result_text(ctx, "ok", -1, SQLITE_STATIC);
 }
 
+/**
+ * @return TRUE if the table exists but does not have the column
+ */
+static int database_is_missing_column(database_t *db, const char *table, const char *column) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT count(*), COALESCE(sum(name = ?2), 0) FROM pragma_table_info(?1)", -1, &stmt, NULL));
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    int missing = sqlite3_column_int(stmt, 0) > 0 && sqlite3_column_int(stmt, 1) == 0;
+    sqlite3_finalize(stmt);
+
+    return missing;
+}
+
+static int database_has_table(database_t *db, const char *table) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT count(*) FROM sqlite_master WHERE type='table' AND name=?", -1, &stmt, NULL));
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    int count = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    return count > 0;
+}
+
+static int database_has_index(database_t *db, const char *index) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT count(*) FROM sqlite_master WHERE type='index' AND name=?", -1, &stmt, NULL));
+    sqlite3_bind_text(stmt, 1, index, -1, SQLITE_STATIC);
+
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    int count = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    return count > 0;
+}
+
+static void database_migrate(database_t *db) {
+    if (db->type == INDEX_DATABASE && database_is_missing_column(db, "document", "name")) {
+        LOG_INFOF("database.c", "Migrating %s to typed document columns", db->filename);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseTypedColumnsMigration, NULL, NULL, NULL));
+    } else if (db->type == FTS_DATABASE && database_is_missing_column(db, "document_index", "title")) {
+        LOG_INFOF("database.c", "Migrating %s to typed document columns", db->filename);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, FtsDatabaseTypedColumnsMigration, NULL, NULL, NULL));
+    }
+
+    if (db->type == INDEX_DATABASE && database_is_missing_column(db, "thumbnail", "hash")) {
+        LOG_INFOF("database.c", "Migrating %s to content-addressed thumbnails", db->filename);
+        sqlite3_create_function(db->db, "thumbnail_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                thumbnail_hash_func, NULL, NULL);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseThumbnailHashMigration, NULL, NULL, NULL));
+    }
+
+    if (db->type == INDEX_DATABASE && database_is_missing_column(db, "document", "directory_id")) {
+        LOG_INFOF("database.c", "Migrating %s to the directory table", db->filename);
+        sqlite3_create_function(db->db, "path_parent", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                path_parent_func, NULL, NULL);
+        sqlite3_create_function(db->db, "path_escape", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                path_escape_func, NULL, NULL);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseDirectoryMigration, NULL, NULL, NULL));
+    }
+
+    if (db->type == INDEX_DATABASE && database_is_missing_column(db, "stats_mime_agg", "mime_id")) {
+        LOG_INFOF("database.c", "Migrating %s to incremental stats", db->filename);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseStatsMigration, NULL, NULL, NULL));
+    }
+
+    if (db->type == INDEX_DATABASE && database_is_missing_column(db, "thumbnail_pack", "hash")) {
+        LOG_INFOF("database.c", "Migrating the thumbnail packs of %s to content-addressed thumbnails",
+                  db->filename);
+        sqlite3_create_function(db->db, "thumbnail_pack_hash", 3, SQLITE_UTF8, db,
+                                thumbnail_pack_hash_func, NULL, NULL);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseThumbnailPackHashMigration, NULL, NULL, NULL));
+    }
+
+    if (db->type == INDEX_DATABASE && database_has_table(db, "document")
+        && !database_has_table(db, "thumbnail_pack")) {
+        LOG_INFOF("database.c", "Adding thumbnail pack tables to %s", db->filename);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseThumbnailPackMigration, NULL, NULL, NULL));
+    }
+
+    if (db->type == INDEX_DATABASE && database_has_table(db, "thumbnail")
+        && !database_has_index(db, "thumbnail_hash_idx")) {
+        LOG_INFOF("database.c", "Adding the thumbnail hash index to %s", db->filename);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseThumbnailOrphanMigration, NULL, NULL, NULL));
+    }
+}
+
 void database_initialize(database_t *db) {
     CRASH_IF_NOT_SQLITE_OK(sqlite3_open(db->filename, &db->db));
 
@@ -128,6 +243,8 @@ void database_initialize(database_t *db) {
     } else if (db->type == IPC_CONSUMER_DATABASE || db->type == IPC_PRODUCER_DATABASE) {
         CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IpcDatabaseSchema, NULL, NULL, NULL));
     } else if (db->type == FTS_DATABASE) {
+        // The schema is applied on top of existing search indices
+        database_migrate(db);
         CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, FtsDatabaseSchema, NULL, NULL, NULL));
     }
 
@@ -154,38 +271,101 @@ void database_open(database_t *db) {
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "PRAGMA ignore_check_constraints = ON;", NULL, NULL, NULL));
 #endif
 
+    if (db->type == INDEX_DATABASE || db->type == FTS_DATABASE) {
+        database_migrate(db);
+        database_content_register_functions(db);
+    }
+
     if (db->type == INDEX_DATABASE) {
         // Prepare statements;
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
                 db->db,
-                "SELECT data FROM thumbnail WHERE id=? AND num=? LIMIT 1;", -1,
+                "SELECT hash FROM thumbnail WHERE id=? AND num=? LIMIT 1;", -1,
                 &db->select_thumbnail_stmt, NULL));
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
                 db->db,
-                "UPDATE marked SET marked=1 WHERE id=(SELECT ROWID FROM document WHERE path=?) AND mtime=? RETURNING id",
+                "SELECT data FROM thumbnail_data WHERE hash=?;", -1,
+                &db->select_thumbnail_data_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "UPDATE marked SET marked=1"
+                " WHERE id=(SELECT ROWID FROM document WHERE directory_id=? AND filename=?) AND mtime=? RETURNING id",
                 -1,
                 &db->mark_document_stmt, NULL));
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
                 db->db,
-                "INSERT INTO document (path, parent, mime, mtime, size, thumbnail_count, json_data, version) "
-                "VALUES (?, (SELECT id FROM document WHERE path=?), ?, ?, ?, ?, ?, (SELECT max(id) FROM version)) "
-                "ON CONFLICT (path) DO UPDATE SET json_data=excluded.json_data "
+                "SELECT id FROM directory WHERE path=?;",
+                -1,
+                &db->select_directory_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "INSERT INTO directory (parent_id, name, path) VALUES (?,?,?) RETURNING id;",
+                -1,
+                &db->insert_directory_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "INSERT INTO document (directory_id, filename, parent, mime, mtime, size, thumbnail_count, name,"
+                " extension, width, height, duration, pages, title, author, checksum, json_data, version) "
+                "VALUES (?, ?, (SELECT id FROM document WHERE directory_id=? AND filename=?),"
+                " ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, (SELECT max(id) FROM version)) "
+                "ON CONFLICT (directory_id, filename) DO UPDATE SET name=excluded.name,"
+                " extension=excluded.extension, width=excluded.width, height=excluded.height,"
+                " duration=excluded.duration, pages=excluded.pages, title=excluded.title, author=excluded.author,"
+                " checksum=excluded.checksum, json_data=excluded.json_data "
                 "RETURNING id;",
                 -1,
                 &db->write_document_stmt, NULL));
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
                 db->db,
-                "INSERT INTO thumbnail (id, num, data) VALUES (?,?,?) ON CONFLICT DO UPDATE SET data=excluded.data;",
+                "INSERT INTO document_content (id, content) VALUES (?,?) "
+                "ON CONFLICT DO UPDATE SET content=excluded.content;",
+                -1,
+                &db->write_content_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "DELETE FROM document_content WHERE id=?;",
+                -1,
+                &db->delete_content_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "INSERT INTO thumbnail (id, num, hash) VALUES (?,?,?) ON CONFLICT DO UPDATE SET hash=excluded.hash;",
                 -1,
                 &db->write_thumbnail_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "INSERT INTO thumbnail_data (hash, data) VALUES (?,?) ON CONFLICT DO NOTHING;",
+                -1,
+                &db->write_thumbnail_data_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "SELECT EXISTS (SELECT 1 FROM thumbnail_pack WHERE hash=?1)"
+                " OR EXISTS (SELECT 1 FROM thumbnail_data WHERE hash=?1);",
+                -1,
+                &db->thumbnail_exists_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "INSERT INTO thumbnail_pack (hash, segment, offset, size) VALUES (?,?,?,?) ON CONFLICT DO NOTHING;",
+                -1,
+                &db->write_thumbnail_pack_stmt, NULL));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                db->db,
+                "SELECT segment, offset, size FROM thumbnail_pack WHERE hash=?;",
+                -1,
+                &db->select_thumbnail_pack_stmt, NULL));
+
+        db->has_thumbnail_pack = database_thumbnail_pack_exists(db);
+        db->thumbnail_pack_checked = time(NULL);
 
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                db->db, "SELECT json_set(json_data, "
+                db->db, "SELECT json_set(" DOCUMENT_JSON_SQL("content_text(c.content)") ","
                         "'$._id', CAST (doc.id AS TEXT),"
                         "'$.thumbnail', doc.thumbnail_count,"
                         "'$.mime', m.name,"
                         "'$.size', doc.size"
-                        ") FROM document doc LEFT JOIN mime m ON m.id=doc.mime WHERE doc.id=?", -1,
+                        ") FROM document doc"
+                        " INNER JOIN directory dir ON dir.id=doc.directory_id"
+                        " LEFT JOIN document_content c ON c.id=doc.id"
+                        " LEFT JOIN mime m ON m.id=doc.mime WHERE doc.id=?", -1,
                 &db->get_document, NULL));
 
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
@@ -273,8 +453,12 @@ void database_open(database_t *db) {
                 &db->fts_search_paths, NULL));
 
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                db->db, "SELECT json_data FROM document_index"
-                        " WHERE id=?", -1,
+                db->db, "SELECT CASE"
+                        " WHEN c.content IS NULL THEN doc.json_data"
+                        " ELSE json_set(doc.json_data, '$.content', content_text(c.content)) END"
+                        " FROM document_index doc"
+                        " LEFT JOIN document_content c ON c.id=doc.id"
+                        " WHERE doc.id=?", -1,
                 &db->fts_get_document, NULL));
 
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
@@ -381,6 +565,8 @@ void database_close(database_t *db, int optimize) {
         CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "PRAGMA optimize;", NULL, NULL, NULL));
     }
 
+    database_thumbnail_pack_close(db);
+
     if (db->db) {
         sqlite3_close(db->db);
     }
@@ -393,7 +579,7 @@ void database_close(database_t *db, int optimize) {
     db = NULL;
 }
 
-void *database_read_thumbnail(database_t *db, int doc_id, int num, size_t *return_value_len) {
+int database_read_thumbnail_hash(database_t *db, int doc_id, int num, unsigned char *hash) {
     sqlite3_bind_int(db->select_thumbnail_stmt, 1, doc_id);
     sqlite3_bind_int(db->select_thumbnail_stmt, 2, num);
 
@@ -401,20 +587,42 @@ void *database_read_thumbnail(database_t *db, int doc_id, int num, size_t *retur
 
     if (ret == SQLITE_DONE) {
         CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_stmt));
+        return FALSE;
+    }
+
+    CRASH_IF_STMT_FAIL(ret);
+
+    int found = sqlite3_column_bytes(db->select_thumbnail_stmt, 0) == THUMBNAIL_HASH_LENGTH;
+    if (found) {
+        memcpy(hash, sqlite3_column_blob(db->select_thumbnail_stmt, 0), THUMBNAIL_HASH_LENGTH);
+    }
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_stmt));
+
+    return found;
+}
+
+void *database_read_thumbnail(database_t *db, const unsigned char *hash, size_t *return_value_len) {
+    sqlite3_bind_blob(db->select_thumbnail_data_stmt, 1, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+
+    int ret = sqlite3_step(db->select_thumbnail_data_stmt);
+
+    if (ret == SQLITE_DONE) {
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_data_stmt));
         *return_value_len = 0;
         return NULL;
     }
 
     CRASH_IF_STMT_FAIL(ret);
 
-    const void *blob = sqlite3_column_blob(db->select_thumbnail_stmt, 0);
-    const int blob_size = sqlite3_column_bytes(db->select_thumbnail_stmt, 0);
+    const void *blob = sqlite3_column_blob(db->select_thumbnail_data_stmt, 0);
+    const int blob_size = sqlite3_column_bytes(db->select_thumbnail_data_stmt, 0);
 
     *return_value_len = blob_size;
     void *return_data = malloc(blob_size);
     memcpy(return_data, blob, blob_size);
 
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_data_stmt));
 
     return return_data;
 }
@@ -515,31 +723,33 @@ database_iterator_t *database_create_document_iterator(database_t *db) {
     CRASH_IF_NOT_SQLITE_OK(
             sqlite3_prepare_v2(
                     db->db,
-                    "WITH doc (id, j) AS ("
+                    "WITH docs (id, j) AS ("
                     "SELECT"
-                    " document.id,"
-                    " json_set(document.json_data,"
-                    "  '$._id', document.id,"
+                    " doc.id,"
+                    " json_set(" DOCUMENT_JSON_SQL("content_text(c.content)") ","
+                    "  '$._id', doc.id,"
                     "  '$.index', (SELECT id FROM descriptor),"
-                    "  '$.size', document.size,"
-                    "  '$.mtime', document.mtime,"
+                    "  '$.size', doc.size,"
+                    "  '$.mtime', doc.mtime,"
                     "  '$.mime', mim.name,"
-                    "  '$.thumbnail', document.thumbnail_count,"
+                    "  '$.thumbnail', doc.thumbnail_count,"
                     "  '$.tag', json_group_array(t.tag))"
-                    " FROM document"
-                    "  LEFT JOIN mime mim ON mim.id = document.mime"
-                    "  LEFT JOIN tag t ON t.id = document.id"
-                    " GROUP BY document.id)"
+                    " FROM document doc"
+                    "  INNER JOIN directory dir ON dir.id = doc.directory_id"
+                    "  LEFT JOIN document_content c ON c.id = doc.id"
+                    "  LEFT JOIN mime mim ON mim.id = doc.mime"
+                    "  LEFT JOIN tag t ON t.id = doc.id"
+                    " GROUP BY doc.id)"
                     "SELECT CASE"
                     " WHEN emb.embedding IS NULL THEN j"
                     " ELSE json_set(j,"
                     "  '$.emb', json_group_object(m.path, json(emb_to_json(emb.embedding))),"
                     "  '$.embedding', 1"
                     "     ) END"
-                    " FROM doc"
-                    " LEFT JOIN embedding emb ON doc.id = emb.id"
+                    " FROM docs"
+                    " LEFT JOIN embedding emb ON docs.id = emb.id"
                     " LEFT JOIN model m ON emb.model_id = m.id"
-                    " GROUP BY doc.id",
+                    " GROUP BY docs.id",
                     -1, &stmt, NULL));
 
     database_iterator_t *iter = malloc(sizeof(database_iterator_t));
@@ -612,6 +822,27 @@ cJSON *database_incremental_scan_end(database_t *db) {
             NULL, NULL, NULL
     ));
 
+    // Thumbnails that are no longer referenced by any document. Only the hashes of
+    // deleted or replaced thumbnail rows can be unreferenced (see thumbnail_orphan)
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "DELETE FROM thumbnail_data WHERE hash IN (SELECT hash FROM thumbnail_orphan)"
+            " AND NOT EXISTS (SELECT 1 FROM thumbnail t WHERE t.hash = thumbnail_data.hash);",
+            NULL, NULL, NULL
+    ));
+    int deleted_thumbnails = sqlite3_changes(db->db);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "DELETE FROM thumbnail_pack WHERE hash IN (SELECT hash FROM thumbnail_orphan)"
+            " AND NOT EXISTS (SELECT 1 FROM thumbnail t WHERE t.hash = thumbnail_pack.hash);",
+            NULL, NULL, NULL
+    ));
+    deleted_thumbnails += sqlite3_changes(db->db);
+    LOG_DEBUGF("database.c", "Deleted %d unreferenced thumbnails", deleted_thumbnails);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "DELETE FROM thumbnail_orphan;", NULL, NULL, NULL));
+
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
             "INSERT INTO delete_list (id) "
@@ -619,12 +850,31 @@ cJSON *database_incremental_scan_end(database_t *db) {
             NULL, NULL, NULL
     ));
 
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "DELETE FROM document_content WHERE id IN (SELECT id FROM marked WHERE marked=0);",
+            NULL, NULL, NULL
+    ));
+
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
             "DELETE FROM document WHERE ROWID IN (SELECT id FROM marked WHERE marked=0);",
             NULL, NULL, NULL
     ));
 
+    // Directories that no longer contain any document
+    db->directory_cache_path[0] = '\0';
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "WITH RECURSIVE used (id) AS ("
+            " SELECT DISTINCT directory_id FROM document"
+            " UNION"
+            " SELECT d.parent_id FROM directory d INNER JOIN used u ON d.id = u.id WHERE d.parent_id IS NOT NULL"
+            ")"
+            "DELETE FROM directory WHERE id != 0 AND id NOT IN (SELECT id FROM used);",
+            NULL, NULL, NULL
+    ));
+
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
             "DELETE FROM marked;",
@@ -632,11 +882,100 @@ cJSON *database_incremental_scan_end(database_t *db) {
     ));
 }
 
+/**
+ * Split a path relative to the root of the index into its
+ * directory and file name, escaped like they are stored.
+ */
+static void split_rel_path(const char *rel_path, char *dir, char *filename) {
+    const char *sep = strrchr(rel_path, '/');
+
+    if (sep == NULL) {
+        dir[0] = '\0';
+        str_escape(filename, rel_path);
+        return;
+    }
+
+    char dir_path[PATH_MAX * 3];
+    memcpy(dir_path, rel_path, sep - rel_path);
+    dir_path[sep - rel_path] = '\0';
+
+    str_escape(dir, dir_path);
+    str_escape(filename, sep + 1);
+}
+
+/**
+ * Must be called with the index lock held
+ * @param create insert the directory (and its parents) if it does not exist
+ * @return id of the directory, or -1 if it does not exist
+ */
+static int database_get_directory_id(database_t *db, const char *path, int create) {
+    if (*path == '\0') {
+        return 0;
+    }
+
+    if (strcmp(db->directory_cache_path, path) == 0) {
+        return db->directory_cache_id;
+    }
+
+    int id = -1;
+
+    sqlite3_bind_text(db->select_directory_stmt, 1, path, -1, SQLITE_STATIC);
+    int ret = sqlite3_step(db->select_directory_stmt);
+    if (ret == SQLITE_ROW) {
+        id = sqlite3_column_int(db->select_directory_stmt, 0);
+    } else if (ret != SQLITE_DONE) {
+        CRASH_IF_STMT_FAIL(ret);
+    }
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_directory_stmt));
+
+    if (id == -1 && create) {
+        int parent_id = 0;
+        const char *name = strrchr(path, '/');
+
+        if (name == NULL) {
+            name = path;
+        } else {
+            char parent[PATH_MAX * 3];
+            memcpy(parent, path, name - path);
+            parent[name - path] = '\0';
+
+            parent_id = database_get_directory_id(db, parent, TRUE);
+            name += 1;
+        }
+
+        sqlite3_bind_int(db->insert_directory_stmt, 1, parent_id);
+        sqlite3_bind_text(db->insert_directory_stmt, 2, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(db->insert_directory_stmt, 3, path, -1, SQLITE_STATIC);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->insert_directory_stmt));
+        id = sqlite3_column_int(db->insert_directory_stmt, 0);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->insert_directory_stmt));
+    }
+
+    if (id != -1) {
+        strcpy(db->directory_cache_path, path);
+        db->directory_cache_id = id;
+    }
+
+    return id;
+}
+
 int database_mark_document(database_t *db, const char *path, int mtime) {
-    sqlite3_bind_text(db->mark_document_stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int(db->mark_document_stmt, 2, mtime);
+    char dir[PATH_MAX * 3];
+    char filename[PATH_MAX * 3];
+    split_rel_path(path, dir, filename);
 
     pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
+
+    int directory_id = database_get_directory_id(db, dir, FALSE);
+    if (directory_id == -1) {
+        pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
+        return FALSE;
+    }
+
+    sqlite3_bind_int(db->mark_document_stmt, 1, directory_id);
+    sqlite3_bind_text(db->mark_document_stmt, 2, filename, -1, SQLITE_STATIC);
+    sqlite3_bind_int(db->mark_document_stmt, 3, mtime);
+
     int ret = sqlite3_step(db->mark_document_stmt);
 
     if (ret == SQLITE_ROW) {
@@ -655,42 +994,121 @@ int database_mark_document(database_t *db, const char *path, int mtime) {
     CRASH_IF_STMT_FAIL(ret);
 }
 
-int database_write_document(database_t *db, document_t *doc, const char *json_data) {
+static void bind_column_long(sqlite3_stmt *stmt, int index, long value) {
+    if (value == DOCUMENT_COLUMN_UNSET) {
+        sqlite3_bind_null(stmt, index);
+    } else {
+        sqlite3_bind_int64(stmt, index, value);
+    }
+}
+
+int database_write_document(database_t *db, document_t *doc, const document_columns_t *columns) {
 
-    const char *rel_path = doc->filepath + ScanCtx.index.desc.root_len;
-    const char *parent_rel_path = doc->parent[0] != '\0'
-                                  ? doc->parent + ScanCtx.index.desc.root_len
-                                  : NULL;
+    char dir[PATH_MAX * 3];
+    char filename[PATH_MAX * 3];
+    split_rel_path(doc->filepath + ScanCtx.index.desc.root_len, dir, filename);
 
-    // path, parent, mtime, size, json_data
-    sqlite3_bind_text(db->write_document_stmt, 1, rel_path, -1, SQLITE_STATIC);
-    sqlite3_bind_text(db->write_document_stmt, 2, parent_rel_path, -1, SQLITE_STATIC);
-    sqlite3_bind_int64(db->write_document_stmt, 3, doc->mime);
-    sqlite3_bind_int(db->write_document_stmt, 4, doc->mtime);
-    sqlite3_bind_int64(db->write_document_stmt, 5, (long) doc->size);
-    sqlite3_bind_int(db->write_document_stmt, 6, doc->thumbnail_count);
-    if (json_data) {
-        sqlite3_bind_text(db->write_document_stmt, 7, json_data, -1, SQLITE_STATIC);
+    char parent_dir[PATH_MAX * 3];
+    char parent_filename[PATH_MAX * 3];
+    int has_parent = doc->parent[0] != '\0';
+    if (has_parent) {
+        split_rel_path(doc->parent + ScanCtx.index.desc.root_len, parent_dir, parent_filename);
+    }
+
+    // filename, parent, mtime, size
+    sqlite3_bind_text(db->write_document_stmt, 2, filename, -1, SQLITE_STATIC);
+    if (has_parent) {
+        sqlite3_bind_text(db->write_document_stmt, 4, parent_filename, -1, SQLITE_STATIC);
     } else {
-        sqlite3_bind_null(db->write_document_stmt, 7);
+        sqlite3_bind_null(db->write_document_stmt, 3);
+        sqlite3_bind_null(db->write_document_stmt, 4);
+    }
+    sqlite3_bind_int64(db->write_document_stmt, 5, doc->mime);
+    sqlite3_bind_int(db->write_document_stmt, 6, doc->mtime);
+    sqlite3_bind_int64(db->write_document_stmt, 7, (long) doc->size);
+    sqlite3_bind_int(db->write_document_stmt, 8, doc->thumbnail_count);
+
+    // Typed metadata columns, NULL when the document has not been parsed yet
+    if (columns) {
+        sqlite3_bind_text(db->write_document_stmt, 9, columns->name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(db->write_document_stmt, 10, columns->extension, -1, SQLITE_STATIC);
+        bind_column_long(db->write_document_stmt, 11, columns->width);
+        bind_column_long(db->write_document_stmt, 12, columns->height);
+        bind_column_long(db->write_document_stmt, 13, columns->duration);
+        bind_column_long(db->write_document_stmt, 14, columns->pages);
+        sqlite3_bind_text(db->write_document_stmt, 15, columns->title, -1, SQLITE_STATIC);
+        sqlite3_bind_text(db->write_document_stmt, 16, columns->author, -1, SQLITE_STATIC);
+        sqlite3_bind_text(db->write_document_stmt, 17, columns->checksum, -1, SQLITE_STATIC);
+        sqlite3_bind_text(db->write_document_stmt, 18, columns->json_data, -1, SQLITE_STATIC);
+    } else {
+        for (int i = 9; i <= 18; i++) {
+            sqlite3_bind_null(db->write_document_stmt, i);
+        }
+    }
+
+    void *compressed_content = NULL;
+    size_t compressed_size = 0;
+    if (columns && columns->content && ScanCtx.compress_content) {
+        compressed_content = database_content_compress(db, columns->content, &compressed_size);
     }
 
     pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
+    sqlite3_bind_int(db->write_document_stmt, 1, database_get_directory_id(db, dir, TRUE));
+    if (has_parent) {
+        // The parent archive was written before its children, the directory exists
+        sqlite3_bind_int(db->write_document_stmt, 3, database_get_directory_id(db, parent_dir, FALSE));
+    }
     CRASH_IF_STMT_FAIL(sqlite3_step(db->write_document_stmt));
     int id = sqlite3_column_int(db->write_document_stmt, 0);
     CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_document_stmt));
+
+    if (compressed_content) {
+        sqlite3_bind_int(db->write_content_stmt, 1, id);
+        sqlite3_bind_blob(db->write_content_stmt, 2, compressed_content, (int) compressed_size, SQLITE_STATIC);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->write_content_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_content_stmt));
+
+        db->ipc_ctx->content_bytes += (long) strlen(columns->content);
+        db->ipc_ctx->content_compressed_bytes += (long) compressed_size;
+    } else if (columns && columns->content) {
+        sqlite3_bind_int(db->write_content_stmt, 1, id);
+        sqlite3_bind_text(db->write_content_stmt, 2, columns->content, -1, SQLITE_STATIC);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->write_content_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_content_stmt));
+    } else if (columns) {
+        // The document may have had content in a previous scan
+        sqlite3_bind_int(db->delete_content_stmt, 1, id);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->delete_content_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->delete_content_stmt));
+    }
     pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
 
+    free(compressed_content);
+
     return id;
 }
 
 
 void database_write_thumbnail(database_t *db, int doc_id, int num, void *data, size_t data_size) {
+    unsigned char hash[THUMBNAIL_HASH_LENGTH];
+    database_thumbnail_hash(data, data_size, hash);
+
+    if (ScanCtx.thumbnail_pack && !database_thumbnail_pack_write(db, hash, data, data_size)) {
+        return;
+    }
+
     sqlite3_bind_int(db->write_thumbnail_stmt, 1, doc_id);
     sqlite3_bind_int(db->write_thumbnail_stmt, 2, num);
-    sqlite3_bind_blob(db->write_thumbnail_stmt, 3, data, (int) data_size, SQLITE_STATIC);
+    sqlite3_bind_blob(db->write_thumbnail_stmt, 3, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
 
     pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
+    if (!ScanCtx.thumbnail_pack) {
+        // Identical thumbnails (album covers, duplicate files) are only stored once
+        sqlite3_bind_blob(db->write_thumbnail_data_stmt, 1, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+        sqlite3_bind_blob(db->write_thumbnail_data_stmt, 2, data, (int) data_size, SQLITE_STATIC);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->write_thumbnail_data_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_thumbnail_data_stmt));
+    }
     CRASH_IF_STMT_FAIL(sqlite3_step(db->write_thumbnail_stmt));
     CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_thumbnail_stmt));
     pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
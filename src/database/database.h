@@ -11,6 +11,27 @@ typedef struct index_descriptor index_descriptor_t;
 extern const char *IpcDatabaseSchema;
 extern const char *IndexDatabaseSchema;
 extern const char *FtsDatabaseSchema;
+extern const char *IndexDatabaseTypedColumnsMigration;
+extern const char *FtsDatabaseTypedColumnsMigration;
+extern const char *IndexDatabaseThumbnailPackMigration;
+extern const char *IndexDatabaseThumbnailHashMigration;
+extern const char *IndexDatabaseThumbnailPackHashMigration;
+extern const char *IndexDatabaseDirectoryMigration;
+extern const char *IndexDatabaseStatsMigration;
+extern const char *IndexDatabaseThumbnailOrphanMigration;
+
+/**
+ * JSON document rebuilt from the columns of the document table (aliased as doc)
+ * and of its directory (aliased as dir). NULL columns are left out.
+ */
+#define DOCUMENT_JSON_SQL(content) \
+        "json_patch(COALESCE(doc.json_data, '{}'), json_object(" \
+        "'name', doc.name, 'path', dir.path, 'extension', doc.extension," \
+        "'width', doc.width, 'height', doc.height, 'duration', doc.duration, 'pages', doc.pages," \
+        "'title', doc.title, 'author', doc.author, 'checksum', doc.checksum, 'content', " content "))"
+
+// Path of the document relative to the root of the index
+#define DOCUMENT_PATH_SQL "iif(dir.path = '', doc.filename, dir.path || '/' || doc.filename)"
 
 typedef enum {
     INDEX_DATABASE,
@@ -52,6 +73,30 @@ typedef struct {
     };
 } job_t;
 
+#define PARSE_STATS_SIZE 16
+
+typedef struct {
+    long count;
+    long time_us;
+    long thumbnail_count;
+    /** Allocations served by the per-job arenas */
+    long alloc_count;
+    long alloc_bytes;
+    /** Blocks the arenas had to allocate on the heap */
+    long heap_alloc_count;
+} parse_stats_t;
+
+#define MEDIA_STATS_SIZE 64
+
+// Only used to report the file a crashed worker was parsing
+#define CURRENT_JOB_SIZE 512
+
+typedef struct {
+    unsigned int mime;
+    long count;
+    long time_us;
+} media_stats_t;
+
 typedef struct {
     int job_count;
     int no_more_jobs;
@@ -61,16 +106,70 @@ typedef struct {
     pthread_mutex_t db_mutex;
     pthread_mutex_t index_db_mutex;
     pthread_cond_t has_work_cond;
-    char current_job[MAX_THREADS][PATH_MAX * 2];
+    char current_job[MAX_THREADS][CURRENT_JOB_SIZE];
+    parse_stats_t parse_stats[PARSE_STATS_SIZE];
+    /** Timing of media files, per mime type (open addressing on the mime id) */
+    media_stats_t media_stats[MEDIA_STATS_SIZE];
+
+    /** Content compression dictionary, shared by the workers once it is trained */
+    int content_dict_ready;
+    unsigned int content_dict_id;
+    long content_sample_count;
+    /** Protected by index_db_mutex */
+    long content_bytes;
+    long content_compressed_bytes;
 } database_ipc_ctx_t;
 
-#define SET_CURRENT_JOB(ctx, job) (strcpy((ctx)->current_job[ProcData.thread_id], job))
+/**
+ * Paths that do not fit are truncated from the start, the file name is kept
+ */
+static void set_current_job(char *current_job, const char *job) {
+    size_t len = strlen(job);
+
+    if (len < CURRENT_JOB_SIZE) {
+        memcpy(current_job, job, len + 1);
+        return;
+    }
+
+    memcpy(current_job, "...", 3);
+    memcpy(current_job + 3, job + len - (CURRENT_JOB_SIZE - 4), CURRENT_JOB_SIZE - 3);
+}
+
+#define SET_CURRENT_JOB(ctx, job) set_current_job((ctx)->current_job[ProcData.thread_id], job)
+
+#define DOCUMENT_COLUMN_UNSET (-1)
+
+/**
+ * Values of the typed columns of a document. Metadata that
+ * does not have its own column is serialized to json_data.
+ */
+typedef struct {
+    const char *name;
+    const char *extension;
+    const char *title;
+    const char *author;
+    const char *checksum;
+    const char *content;
+    long width;
+    long height;
+    long duration;
+    long pages;
+    const char *json_data;
+} document_columns_t;
 
 typedef struct {
     double date_min;
     double date_max;
 } database_summary_stats_t;
 
+#define THUMBNAIL_HASH_LENGTH SHA1_DIGEST_LENGTH
+
+typedef struct {
+    int segment;
+    void *map;
+    size_t size;
+} thumbnail_pack_map_t;
+
 typedef struct database {
     char filename[PATH_MAX];
     database_type_t type;
@@ -78,12 +177,17 @@ typedef struct database {
 
     // Prepared statements
     sqlite3_stmt *select_thumbnail_stmt;
-    sqlite3_stmt *treemap_merge_up_update_stmt;
-    sqlite3_stmt *treemap_merge_up_delete_stmt;
 
     sqlite3_stmt *mark_document_stmt;
+    sqlite3_stmt *select_directory_stmt;
+    sqlite3_stmt *insert_directory_stmt;
     sqlite3_stmt *write_document_stmt;
+    sqlite3_stmt *write_content_stmt;
+    sqlite3_stmt *delete_content_stmt;
     sqlite3_stmt *write_thumbnail_stmt;
+    sqlite3_stmt *write_thumbnail_data_stmt;
+    sqlite3_stmt *select_thumbnail_data_stmt;
+    sqlite3_stmt *thumbnail_exists_stmt;
     sqlite3_stmt *get_document;
     sqlite3_stmt *get_models;
     sqlite3_stmt *get_embedding;
@@ -107,6 +211,24 @@ typedef struct database {
     sqlite3_stmt *fts_write_tag_stmt;
     sqlite3_stmt *fts_model_size;
 
+    sqlite3_stmt *write_thumbnail_pack_stmt;
+    sqlite3_stmt *select_thumbnail_pack_stmt;
+
+    /** Thumbnail pack segment appended to by this process */
+    int thumbnail_pack_fd;
+    int thumbnail_pack_segment;
+    long thumbnail_pack_offset;
+    /** Segments mapped to serve thumbnails, a segment that grew has one entry per mapping */
+    thumbnail_pack_map_t *thumbnail_pack_maps;
+    int thumbnail_pack_map_count;
+    int has_thumbnail_pack;
+    /** When has_thumbnail_pack was last checked */
+    time_t thumbnail_pack_checked;
+
+    /** Last directory looked up, documents of the same directory are usually written together */
+    char directory_cache_path[PATH_MAX * 3];
+    int directory_cache_id;
+
     char **tag_array;
 
     database_ipc_ctx_t *ipc_ctx;
@@ -117,12 +239,6 @@ typedef struct {
     sqlite3_stmt *stmt;
 } database_iterator_t;
 
-typedef struct {
-    const char *path;
-    const char *parent;
-    long size;
-} treemap_row_t;
-
 
 database_t *database_create(const char *filename, database_type_t type);
 
@@ -136,18 +252,63 @@ void database_increment_version(database_t *db);
 
 void database_write_thumbnail(database_t *db, int doc_id, int num, void *data, size_t data_size);
 
-void *database_read_thumbnail(database_t *db, int doc_id, int num, size_t *return_value_len);
+/**
+ * @return FALSE if the document does not have this thumbnail
+ */
+int database_read_thumbnail_hash(database_t *db, int doc_id, int num, unsigned char *hash);
+
+void *database_read_thumbnail(database_t *db, const unsigned char *hash, size_t *return_value_len);
+
+void database_thumbnail_hash(const void *data, size_t data_size, unsigned char *hash);
+
+void thumbnail_hash_func(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+
+void thumbnail_pack_hash_func(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+
+/**
+ * @return FALSE if the thumbnail could not be stored
+ */
+int database_thumbnail_pack_write(database_t *db, const unsigned char *hash, void *data, size_t data_size);
+
+/**
+ * @return TRUE if at least one thumbnail of the index is in a pack
+ */
+int database_thumbnail_pack_exists(database_t *db);
+
+/**
+ * @return pointer to the thumbnail in the mapped pack segment, valid until
+ *         the database is closed, or NULL if it is not in a pack
+ */
+const void *database_thumbnail_pack_read(database_t *db, const unsigned char *hash, size_t *data_size);
+
+void database_thumbnail_pack_close(database_t *db);
 
 void database_write_index_descriptor(database_t *db, index_descriptor_t *desc);
 
 index_descriptor_t *database_read_index_descriptor(database_t *db);
 
-int database_write_document(database_t *db, document_t *doc, const char *json_data);
+int database_write_document(database_t *db, document_t *doc, const document_columns_t *columns);
 
 database_iterator_t *database_create_document_iterator(database_t *db);
 
 void emb_to_json_func(sqlite3_context *ctx, int argc, sqlite3_value **argv);
 
+/**
+ * Compress the content of a document with the dictionary of the index.
+ * @return the zstd frame, or NULL if the content is stored as text
+ *         because the dictionary is not trained yet
+ */
+void *database_content_compress(database_t *db, const char *content, size_t *compressed_size);
+
+/**
+ * Compress the documents that were used as samples to train the dictionary
+ */
+void database_content_compress_samples(database_t *db);
+
+void database_content_log_stats(database_ipc_ctx_t *ipc_ctx);
+
+void database_content_register_functions(database_t *db);
+
 cJSON *database_document_iter(database_iterator_t *);
 
 #define database_document_iter_foreach(element, iter) \
@@ -167,14 +328,6 @@ cJSON *database_incremental_scan_end(database_t *db);
 
 int database_mark_document(database_t *db, const char *id, int mtime);
 
-database_iterator_t *database_create_treemap_iterator(database_t *db, long threshold);
-
-treemap_row_t database_treemap_iter(database_iterator_t *iter);
-
-#define database_treemap_iter_foreach(element, iter) \
-    for (treemap_row_t element = database_treemap_iter(iter); (element).path != NULL; (element) = database_treemap_iter(iter))
-
-
 void database_generate_stats(database_t *db, double treemap_threshold);
 
 database_stat_type_d database_get_stat_type_by_mnemonic(const char *name);
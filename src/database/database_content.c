@@ -0,0 +1,449 @@
+#include "database.h"
+#include "src/ctx.h"
+#include "src/util.h"
+
+#include <zstd.h>
+#include <zdict.h>
+
+#define CONTENT_COMPRESSION_LEVEL 3
+#define CONTENT_DICT_SIZE (110 * 1024)
+// Documents stored as text before the dictionary is trained, they are used as samples
+#define CONTENT_DICT_SAMPLE_COUNT 2048
+#define CONTENT_DICT_MAX_SAMPLE_SIZE (64 * 1024)
+#define CONTENT_DICT_CACHE_SIZE 16
+
+static __thread ZSTD_CCtx *content_cctx = NULL;
+static __thread ZSTD_CDict *content_cdict = NULL;
+static __thread int content_compressor_ready = FALSE;
+static __thread int content_dict_checked = FALSE;
+
+typedef struct {
+    ZSTD_DCtx *dctx;
+    unsigned int dict_ids[CONTENT_DICT_CACHE_SIZE];
+    ZSTD_DDict *ddicts[CONTENT_DICT_CACHE_SIZE];
+
+    long count;
+    long compressed_bytes;
+    long bytes;
+    long time_us;
+} content_decompress_ctx_t;
+
+typedef struct {
+    dyn_buffer_t buf;
+    size_t *sizes;
+    unsigned int count;
+} content_samples_t;
+
+/**
+ * @return id of the dictionary of the index, 0 if it was not trained yet
+ */
+static unsigned int read_dictionary_id(database_t *db) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT id FROM content_dictionary LIMIT 1", -1, &stmt, NULL));
+
+    unsigned int dict_id = 0;
+    int ret = sqlite3_step(stmt);
+    CRASH_IF_STMT_FAIL(ret);
+    if (ret == SQLITE_ROW) {
+        dict_id = (unsigned int) sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    return dict_id;
+}
+
+/**
+ * @return the dictionary, or NULL if it does not exist. Free with free()
+ */
+static void *read_dictionary(sqlite3 *sqlite_db, unsigned int dict_id, size_t *dict_size) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(sqlite_db, "SELECT data FROM content_dictionary WHERE id=?", -1, &stmt, NULL) !=
+        SQLITE_OK) {
+        return NULL;
+    }
+    sqlite3_bind_int64(stmt, 1, dict_id);
+
+    void *dict = NULL;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        *dict_size = sqlite3_column_bytes(stmt, 0);
+        dict = malloc(*dict_size);
+        memcpy(dict, sqlite3_column_blob(stmt, 0), *dict_size);
+    }
+    sqlite3_finalize(stmt);
+
+    return dict;
+}
+
+static void write_dictionary(database_t *db, unsigned int dict_id, const void *dict, size_t dict_size) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO content_dictionary (id, data) VALUES (?,?) ON CONFLICT DO NOTHING", -1,
+            &stmt, NULL));
+    sqlite3_bind_int64(stmt, 1, dict_id);
+    sqlite3_bind_blob(stmt, 2, dict, (int) dict_size, SQLITE_STATIC);
+
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    sqlite3_finalize(stmt);
+}
+
+static content_samples_t read_samples(database_t *db) {
+    content_samples_t samples = {
+            .buf = dyn_buffer_create(),
+            .sizes = malloc(sizeof(size_t) * CONTENT_DICT_SAMPLE_COUNT),
+            .count = 0,
+    };
+
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT content FROM document_content WHERE typeof(content) = 'text' LIMIT ?", -1,
+            &stmt, NULL));
+    sqlite3_bind_int(stmt, 1, CONTENT_DICT_SAMPLE_COUNT);
+
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *content = (const char *) sqlite3_column_text(stmt, 0);
+        size_t size = MIN((size_t) sqlite3_column_bytes(stmt, 0), CONTENT_DICT_MAX_SAMPLE_SIZE);
+
+        dyn_buffer_write(&samples.buf, content, size);
+        samples.sizes[samples.count++] = size;
+    }
+    CRASH_IF_STMT_FAIL(ret);
+    sqlite3_finalize(stmt);
+
+    return samples;
+}
+
+static void samples_destroy(content_samples_t *samples) {
+    dyn_buffer_destroy(&samples->buf);
+    free(samples->sizes);
+}
+
+/**
+ * @return id of the new dictionary, 0 if the samples were not sufficient
+ */
+static unsigned int train_dictionary(content_samples_t *samples, void **dict, size_t *dict_size) {
+    if (samples->count == 0) {
+        return 0;
+    }
+
+    *dict = malloc(CONTENT_DICT_SIZE);
+    size_t ret = ZDICT_trainFromBuffer(*dict, CONTENT_DICT_SIZE, samples->buf.buf, samples->sizes, samples->count);
+
+    if (ZDICT_isError(ret)) {
+        LOG_WARNINGF("database_content.c", "Could not train content dictionary on %d documents: %s",
+                     samples->count, ZDICT_getErrorName(ret));
+        free(*dict);
+        *dict = NULL;
+        return 0;
+    }
+
+    *dict_size = ret;
+    LOG_INFOF("database_content.c", "Trained %.1f KiB content dictionary on %d documents (%.1f MiB)",
+              (double) ret / 1024, samples->count, (double) samples->buf.cur / (1024 * 1024));
+
+    return ZDICT_getDictID(*dict, *dict_size);
+}
+
+static void load_compressor(database_t *db, unsigned int dict_id) {
+    if (content_cctx == NULL) {
+        content_cctx = ZSTD_createCCtx();
+    }
+
+    if (content_cdict != NULL) {
+        ZSTD_freeCDict(content_cdict);
+        content_cdict = NULL;
+    }
+
+    if (dict_id != 0) {
+        size_t dict_size;
+        void *dict = read_dictionary(db->db, dict_id, &dict_size);
+        if (dict == NULL) {
+            LOG_FATALF("database_content.c", "Content dictionary %u does not exist", dict_id);
+        }
+
+        content_cdict = ZSTD_createCDict(dict, dict_size, CONTENT_COMPRESSION_LEVEL);
+        free(dict);
+    }
+
+    content_compressor_ready = TRUE;
+}
+
+static void *compress(const char *content, size_t len, size_t *compressed_size) {
+    size_t bound = ZSTD_compressBound(len);
+    void *buf = malloc(bound);
+
+    size_t ret = content_cdict != NULL
+                 ? ZSTD_compress_usingCDict(content_cctx, buf, bound, content, len, content_cdict)
+                 : ZSTD_compressCCtx(content_cctx, buf, bound, content, len, CONTENT_COMPRESSION_LEVEL);
+
+    if (ZSTD_isError(ret)) {
+        LOG_ERRORF("database_content.c", "Could not compress content: %s", ZSTD_getErrorName(ret));
+        free(buf);
+        return NULL;
+    }
+
+    *compressed_size = ret;
+    return buf;
+}
+
+/**
+ * Called by the worker that wrote the last sample document.
+ */
+static void train_worker_dictionary(database_t *db) {
+    database_ipc_ctx_t *ipc_ctx = db->ipc_ctx;
+
+    // Other workers must not write while the samples are read
+    pthread_mutex_lock(&ipc_ctx->index_db_mutex);
+    content_samples_t samples = read_samples(db);
+    pthread_mutex_unlock(&ipc_ctx->index_db_mutex);
+
+    void *dict = NULL;
+    size_t dict_size;
+    unsigned int dict_id = train_dictionary(&samples, &dict, &dict_size);
+    samples_destroy(&samples);
+
+    if (dict != NULL) {
+        pthread_mutex_lock(&ipc_ctx->index_db_mutex);
+        write_dictionary(db, dict_id, dict, dict_size);
+        pthread_mutex_unlock(&ipc_ctx->index_db_mutex);
+        free(dict);
+    }
+
+    pthread_mutex_lock(&ipc_ctx->mutex);
+    ipc_ctx->content_dict_id = dict_id;
+    ipc_ctx->content_dict_ready = TRUE;
+    pthread_mutex_unlock(&ipc_ctx->mutex);
+}
+
+void *database_content_compress(database_t *db, const char *content, size_t *compressed_size) {
+    database_ipc_ctx_t *ipc_ctx = db->ipc_ctx;
+
+    if (!content_compressor_ready) {
+        if (!content_dict_checked) {
+            // Incremental scan of an index that already has a dictionary
+            pthread_mutex_lock(&ipc_ctx->index_db_mutex);
+            unsigned int dict_id = read_dictionary_id(db);
+            pthread_mutex_unlock(&ipc_ctx->index_db_mutex);
+
+            pthread_mutex_lock(&ipc_ctx->mutex);
+            if (dict_id != 0 && !ipc_ctx->content_dict_ready) {
+                ipc_ctx->content_dict_id = dict_id;
+                ipc_ctx->content_dict_ready = TRUE;
+            }
+            pthread_mutex_unlock(&ipc_ctx->mutex);
+
+            content_dict_checked = TRUE;
+        }
+
+        pthread_mutex_lock(&ipc_ctx->mutex);
+        int ready = ipc_ctx->content_dict_ready;
+        int train = FALSE;
+        if (!ready) {
+            ipc_ctx->content_sample_count += 1;
+            train = ipc_ctx->content_sample_count == CONTENT_DICT_SAMPLE_COUNT;
+        }
+        pthread_mutex_unlock(&ipc_ctx->mutex);
+
+        if (train) {
+            // The document that completes the samples is compressed with the new dictionary
+            train_worker_dictionary(db);
+        } else if (!ready) {
+            return NULL;
+        }
+
+        load_compressor(db, ipc_ctx->content_dict_id);
+    }
+
+    return compress(content, strlen(content), compressed_size);
+}
+
+static void content_compress_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(ctx, "Invalid parameters", -1);
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    const char *content = (const char *) sqlite3_value_text(argv[0]);
+    size_t compressed_size;
+    void *compressed = compress(content, sqlite3_value_bytes(argv[0]), &compressed_size);
+
+    if (compressed == NULL) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    sqlite3_result_blob(ctx, compressed, (int) compressed_size, free);
+}
+
+void database_content_compress_samples(database_t *db) {
+    unsigned int dict_id = read_dictionary_id(db);
+
+    if (dict_id == 0) {
+        // The scan had fewer documents than CONTENT_DICT_SAMPLE_COUNT
+        content_samples_t samples = read_samples(db);
+
+        void *dict = NULL;
+        size_t dict_size;
+        dict_id = train_dictionary(&samples, &dict, &dict_size);
+        samples_destroy(&samples);
+
+        if (dict != NULL) {
+            write_dictionary(db, dict_id, dict, dict_size);
+            free(dict);
+        }
+    }
+
+    load_compressor(db, dict_id);
+
+    sqlite3_create_function(
+            db->db,
+            "content_compress",
+            1,
+            SQLITE_UTF8,
+            NULL,
+            content_compress_func,
+            NULL,
+            NULL
+    );
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "UPDATE document_content SET content = content_compress(content) WHERE typeof(content) = 'text'",
+            NULL, NULL, NULL));
+
+    LOG_DEBUGF("database_content.c", "Compressed content of %d sample documents", sqlite3_changes(db->db));
+}
+
+void database_content_log_stats(database_ipc_ctx_t *ipc_ctx) {
+    if (ipc_ctx->content_compressed_bytes == 0) {
+        return;
+    }
+
+    LOG_INFOF("database_content.c", "Content compressed from %.1f MiB to %.1f MiB (ratio %.2f)",
+              (double) ipc_ctx->content_bytes / (1024 * 1024),
+              (double) ipc_ctx->content_compressed_bytes / (1024 * 1024),
+              (double) ipc_ctx->content_bytes / (double) ipc_ctx->content_compressed_bytes);
+}
+
+static ZSTD_DDict *get_ddict(content_decompress_ctx_t *dc, sqlite3 *sqlite_db, unsigned int dict_id) {
+    int slot = (int) (dict_id % CONTENT_DICT_CACHE_SIZE);
+
+    if (dc->ddicts[slot] != NULL && dc->dict_ids[slot] == dict_id) {
+        return dc->ddicts[slot];
+    }
+
+    size_t dict_size;
+    void *dict = read_dictionary(sqlite_db, dict_id, &dict_size);
+    if (dict == NULL) {
+        return NULL;
+    }
+
+    if (dc->ddicts[slot] != NULL) {
+        ZSTD_freeDDict(dc->ddicts[slot]);
+    }
+    dc->ddicts[slot] = ZSTD_createDDict(dict, dict_size);
+    dc->dict_ids[slot] = dict_id;
+    free(dict);
+
+    return dc->ddicts[slot];
+}
+
+/**
+ * content_text(content): the content of a document, decompressed if it is a zstd frame.
+ */
+static void content_text_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (argc != 1) {
+        sqlite3_result_error(ctx, "Invalid parameters", -1);
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    content_decompress_ctx_t *dc = sqlite3_user_data(ctx);
+
+    TIMER_INIT();
+    TIMER_START();
+
+    const void *frame = sqlite3_value_blob(argv[0]);
+    size_t frame_size = sqlite3_value_bytes(argv[0]);
+
+    unsigned long long size = ZSTD_getFrameContentSize(frame, frame_size);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+        sqlite3_result_error(ctx, "Invalid content frame", -1);
+        return;
+    }
+
+    ZSTD_DDict *ddict = NULL;
+    unsigned int dict_id = ZSTD_getDictID_fromFrame(frame, frame_size);
+    if (dict_id != 0) {
+        ddict = get_ddict(dc, sqlite3_context_db_handle(ctx), dict_id);
+        if (ddict == NULL) {
+            sqlite3_result_error(ctx, "Missing content dictionary", -1);
+            return;
+        }
+    }
+
+    char *buf = malloc(MAX(size, 1));
+    size_t ret = ddict != NULL
+                 ? ZSTD_decompress_usingDDict(dc->dctx, buf, size, frame, frame_size, ddict)
+                 : ZSTD_decompressDCtx(dc->dctx, buf, size, frame, frame_size);
+
+    if (ZSTD_isError(ret)) {
+        free(buf);
+        sqlite3_result_error(ctx, ZSTD_getErrorName(ret), -1);
+        return;
+    }
+
+    long time_us;
+    TIMER_END(time_us);
+    dc->count += 1;
+    dc->compressed_bytes += (long) frame_size;
+    dc->bytes += (long) ret;
+    dc->time_us += time_us;
+
+    sqlite3_result_text(ctx, buf, (int) ret, free);
+}
+
+static void content_decompress_ctx_destroy(void *ptr) {
+    content_decompress_ctx_t *dc = ptr;
+
+    if (dc->count > 0) {
+        LOG_INFOF("database_content.c", "Decompressed content of %ld documents, %.1f MiB at %.1f MiB/s",
+                  dc->count, (double) dc->bytes / (1024 * 1024),
+                  ((double) dc->bytes / (1024 * 1024)) / MAX((double) dc->time_us / 1000000.0, 0.000001));
+    }
+
+    for (int i = 0; i < CONTENT_DICT_CACHE_SIZE; i++) {
+        if (dc->ddicts[i] != NULL) {
+            ZSTD_freeDDict(dc->ddicts[i]);
+        }
+    }
+    ZSTD_freeDCtx(dc->dctx);
+    free(dc);
+}
+
+void database_content_register_functions(database_t *db) {
+    content_decompress_ctx_t *dc = calloc(1, sizeof(content_decompress_ctx_t));
+    dc->dctx = ZSTD_createDCtx();
+
+    sqlite3_create_function_v2(
+            db->db,
+            "content_text",
+            1,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            dc,
+            content_text_func,
+            NULL,
+            NULL,
+            content_decompress_ctx_destroy
+    );
+}
@@ -23,18 +23,6 @@ void database_fts_attach(database_t *db, const char *fts_database_path) {
     sqlite3_finalize(stmt);
 }
 
-int database_fts_get_max_path_depth(database_t *db) {
-    sqlite3_stmt *stmt;
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-            db->db, "SELECT MAX(depth) FROM path_tmp", -1, &stmt, NULL));
-    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
-
-    int max_depth = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-
-    return max_depth;
-}
-
 void database_fts_index(database_t *db) {
 
     LOG_INFO("database_fts.c", "Creating content table");
@@ -43,23 +31,50 @@ void database_fts_index(database_t *db) {
             db->db,
             "WITH docs AS ("
             " SELECT "
-            "  ((SELECT id FROM descriptor) << 32) | document.id as id,"
+            "  ((SELECT id FROM descriptor) << 32) | doc.id as id,"
             "  (SELECT id FROM descriptor) as index_id,"
             "  size,"
-            "  document.json_data ->> 'name' as name,"
-            "  document.json_data ->> 'path' as path,"
+            "  COALESCE(doc.name, '') as name,"
+            "  dir.path,"
             "  mtime,"
             "  m.name as mime,"
             "  thumbnail_count,"
-            "  document.json_data"
-            " FROM document"
-            " LEFT JOIN mime m ON m.id=document.mime"
+            "  doc.title,"
+            "  " DOCUMENT_JSON_SQL("NULL") " as json_data"
+            " FROM document doc"
+            " INNER JOIN directory dir ON dir.id=doc.directory_id"
+            " LEFT JOIN mime m ON m.id=doc.mime"
             " )"
             " INSERT"
-            " INTO fts.document_index (id, index_id, size, name, path, mtime, mime, thumbnail_count, json_data)"
+            " INTO fts.document_index (id, index_id, size, name, path, mtime, mime, thumbnail_count, title, json_data)"
             " SELECT * FROM docs WHERE true"
             " on conflict (id) do update set "
-            "  size=excluded.size, mtime=excluded.mtime, mime=excluded.mime, json_data=excluded.json_data;",
+            "  size=excluded.size, mtime=excluded.mtime, mime=excluded.mime, title=excluded.title,"
+            "  json_data=excluded.json_data;",
+            NULL, NULL, NULL));
+
+    LOG_DEBUG("database_fts.c", "Copying content");
+
+    // Compressed content is copied as-is, the search index needs the dictionary to read it
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "INSERT INTO fts.content_dictionary (id, data)"
+            " SELECT id, data FROM content_dictionary WHERE true"
+            " ON CONFLICT DO NOTHING;",
+            NULL, NULL, NULL));
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "DELETE FROM fts.document_content"
+            " WHERE id >> 32 = (SELECT id FROM descriptor)"
+            "  AND (id & 0xFFFFFFFF) NOT IN (SELECT id FROM document_content);",
+            NULL, NULL, NULL));
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "INSERT INTO fts.document_content (id, content)"
+            " SELECT ((SELECT id FROM descriptor) << 32) | id, content FROM document_content WHERE true"
+            " ON CONFLICT (id) DO UPDATE SET content=excluded.content;",
             NULL, NULL, NULL));
 
     LOG_DEBUG("database_fts.c", "Copying embeddings");
@@ -86,6 +101,12 @@ void database_fts_index(database_t *db) {
             "  AND index_id = (SELECT id FROM descriptor);",
             NULL, NULL, NULL));
 
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "DELETE FROM fts.document_content"
+            " WHERE id NOT IN (SELECT id FROM fts.document_index);",
+            NULL, NULL, NULL));
+
     LOG_DEBUG("database_fts.c", "Generating summary stats");
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
@@ -109,49 +130,29 @@ void database_fts_index(database_t *db) {
 
     LOG_DEBUG("database_fts.c", "Generating path index");
 
+    // Documents of this index are counted in every directory above them
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
-            "CREATE TEMP TABLE path_tmp ("
-            " path TEXT,"
-            " index_id TEXT,"
-            " count INTEGER NOT NULL,"
-            " depth INTEGER NOT NULL,"
-            " children INTEGER NOT NULL DEFAULT(0),"
-            " total INTEGER AS (count + children),"
-            " PRIMARY KEY (path, index_id)"
-            ");", NULL, NULL, NULL));
-
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
-            db->db,
-            "INSERT INTO path_tmp (path, index_id, count, depth)"
-            " SELECT path, index_id, count(*), CASE WHEN length(json_data->>'path') == 0 THEN 0"
-            " ELSE 1 + length(json_data->>'path') - length(REPLACE(json_data->>'path', '/', ''))"
-            " END as depth FROM document_index WHERE depth > 0"
-            " GROUP BY path", NULL, NULL, NULL));
-
-    int max_depth = database_fts_get_max_path_depth(db);
-
-    for (int i = max_depth; i > 1; i--) {
-        sqlite3_stmt *stmt;
-
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                db->db,
-                "INSERT INTO path_tmp (path, index_id, children, depth, count)"
-                " SELECT path_parent(path) parent, index_id, (SELECT COALESCE(sum(count), 0) FROM path_tmp WHERE path "
-                " BETWEEN path_parent(p.path) || '/' AND path_parent(p.path) || '/𘚟' AND index_id = p.index_id) as cnt, depth-1, 0 "
-                " FROM path_tmp p WHERE depth=? GROUP BY parent"
-                " ON CONFLICT(path, index_id) DO UPDATE SET children=excluded.children",
-                -1, &stmt, NULL));
-        sqlite3_bind_int(stmt, 1, i);
-        CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
-
-        LOG_DEBUGF("database_fts.c", "Path index depth %d (%d)", i, sqlite3_changes(db->db));
-    }
-
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
-            db->db,
-            "DELETE FROM path_index;"
-            "INSERT INTO path_index (path, index_id, count, depth) SELECT path, index_id, total, depth FROM path_tmp",
+            "DELETE FROM fts.path_index WHERE index_id = (SELECT id FROM descriptor);"
+            ""
+            "WITH RECURSIVE"
+            " tree (id, depth) AS ("
+            "  SELECT id, 1 FROM directory WHERE parent_id = 0"
+            "  UNION ALL"
+            "  SELECT d.id, t.depth + 1 FROM directory d INNER JOIN tree t ON d.parent_id = t.id"
+            " ),"
+            " totals (id, count) AS ("
+            "  SELECT directory_id, count(*) FROM document WHERE directory_id != 0 GROUP BY directory_id"
+            "  UNION ALL"
+            "  SELECT d.parent_id, t.count FROM totals t INNER JOIN directory d ON d.id = t.id"
+            "  WHERE d.parent_id != 0"
+            " )"
+            "INSERT INTO fts.path_index (path, index_id, count, depth)"
+            " SELECT d.path, (SELECT id FROM descriptor), sum(t.count), tree.depth"
+            " FROM totals t"
+            "  INNER JOIN directory d ON d.id = t.id"
+            "  INNER JOIN tree ON tree.id = t.id"
+            " GROUP BY t.id;",
             NULL, NULL, NULL));
 
     LOG_DEBUG("database_fts.c", "Generating search index");
@@ -539,7 +540,7 @@ cJSON *database_fts_search(database_t *db, const char *query, const char *path,
 
     const char *json_object_sql;
     if (highlight && query_where != NULL) {
-        json_object_sql = "json_set(json_remove(doc.json_data, '$.content'),"
+        json_object_sql = "json_set(doc.json_data,"
                           "'$._id', CAST(doc.id AS TEXT),"
                           "'$.index', doc.index_id,"
                           "'$.thumbnail', doc.thumbnail_count,"
@@ -549,7 +550,7 @@ cJSON *database_fts_search(database_t *db, const char *query, const char *path,
                           "'$._highlight.name', snippet(search, 0, '<mark>', '</mark>', '', ?6),"
                           "'$._highlight.content', snippet(search, 1, '<mark>', '</mark>', '', ?6))";
     } else {
-        json_object_sql = "json_set(json_remove(doc.json_data, '$.content'),"
+        json_object_sql = "json_set(doc.json_data,"
                           "'$._id', CAST(doc.id AS TEXT),"
                           "'$.index', doc.index_id,"
                           "'$.thumbnail', doc.thumbnail_count,"
@@ -4,6 +4,180 @@
 #define STRICT ""
 #endif
 
+#define FTS_DOCUMENT_VIEW \
+        "CREATE VIEW IF NOT EXISTS document_view (id, name, content, title, path)" \
+        " AS" \
+        " SELECT doc.id, doc.name, content_text(c.content), doc.title, doc.path" \
+        " FROM document_index doc" \
+        " LEFT JOIN document_content c ON c.id = doc.id;"
+
+// Content is either TEXT or a zstd frame (BLOB), see content_text()
+#define FTS_DOCUMENT_CONTENT \
+        "CREATE TABLE IF NOT EXISTS document_content (" \
+        "   id INTEGER PRIMARY KEY," \
+        "   content ANY NOT NULL" \
+        ")"STRICT";" \
+        "" \
+        "CREATE TABLE IF NOT EXISTS content_dictionary (" \
+        "   id INTEGER PRIMARY KEY," \
+        "   data BLOB NOT NULL" \
+        ")"STRICT";"
+
+#define INDEX_DOCUMENT_CONTENT \
+        "CREATE TABLE document_content (" \
+        "   id INTEGER PRIMARY KEY REFERENCES document(id)," \
+        "   content ANY NOT NULL" \
+        ")"STRICT";" \
+        "" \
+        "CREATE TABLE content_dictionary (" \
+        "   id INTEGER PRIMARY KEY," \
+        "   data BLOB NOT NULL" \
+        ")"STRICT";"
+
+// Location of the thumbnails written to pack files (see database_thumbnail.c)
+#define THUMBNAIL_PACK_TABLE \
+        "CREATE TABLE thumbnail_pack (" \
+        "   hash BLOB PRIMARY KEY," \
+        "   segment INTEGER NOT NULL REFERENCES thumbnail_segment(id)," \
+        "   offset INTEGER NOT NULL," \
+        "   size INTEGER NOT NULL" \
+        ") WITHOUT ROWID;"
+
+#define THUMBNAIL_PACK_TABLES \
+        "CREATE TABLE thumbnail_segment (" \
+        "   id INTEGER PRIMARY KEY AUTOINCREMENT" \
+        ")"STRICT";" \
+        "" \
+        THUMBNAIL_PACK_TABLE
+
+// Thumbnails are stored once per distinct image, keyed by its SHA1 hash
+#define THUMBNAIL_TABLES \
+        "CREATE TABLE thumbnail (" \
+        "   id INTEGER REFERENCES document(id)," \
+        "   num INTEGER NOT NULL," \
+        "   hash BLOB NOT NULL," \
+        "   PRIMARY KEY(id, num)" \
+        ") WITHOUT ROWID;" \
+        "" \
+        "CREATE TABLE thumbnail_data (" \
+        "   hash BLOB PRIMARY KEY," \
+        "   data BLOB NOT NULL" \
+        ") WITHOUT ROWID;"
+
+/*
+ * Hashes that lost a reference since the last incremental scan, only those are
+ * checked for thumbnails that can be deleted at the end of the next one.
+ */
+#define THUMBNAIL_ORPHAN_TABLES \
+        "CREATE INDEX thumbnail_hash_idx ON thumbnail(hash);" \
+        "" \
+        "CREATE TABLE thumbnail_orphan (" \
+        "   hash BLOB PRIMARY KEY" \
+        ") WITHOUT ROWID;" \
+        "" \
+        "CREATE TRIGGER thumbnail_delete_trigger" \
+        " AFTER DELETE ON thumbnail" \
+        " BEGIN" \
+        "  INSERT INTO thumbnail_orphan (hash) VALUES (OLD.hash) ON CONFLICT DO NOTHING;" \
+        " END;" \
+        "" \
+        "CREATE TRIGGER thumbnail_update_trigger" \
+        " AFTER UPDATE OF hash ON thumbnail WHEN OLD.hash != NEW.hash" \
+        " BEGIN" \
+        "  INSERT INTO thumbnail_orphan (hash) VALUES (OLD.hash) ON CONFLICT DO NOTHING;" \
+        " END;"
+
+/*
+ * Directories of the documents, relative to the root of the index. The root
+ * directory has id 0. The path of the directory is kept so that the path of a
+ * document can be rebuilt with a single join.
+ */
+#define DIRECTORY_TABLE \
+        "CREATE TABLE directory (" \
+        "   id INTEGER PRIMARY KEY," \
+        "   parent_id INTEGER REFERENCES directory(id)," \
+        "   name TEXT NOT NULL," \
+        "   path TEXT NOT NULL" \
+        ")"STRICT";" \
+        "INSERT INTO directory (id, parent_id, name, path) VALUES (0, NULL, '', '');"
+
+#define DIRECTORY_PATH_INDEX \
+        "CREATE UNIQUE INDEX directory_path_idx ON directory(path);"
+
+#define DIRECTORY_PARENT_INDEX \
+        "CREATE UNIQUE INDEX directory_parent_idx ON directory(parent_id, name);"
+
+#define DIRECTORY_INDICES \
+        DIRECTORY_PARENT_INDEX \
+        DIRECTORY_PATH_INDEX
+
+#define STATS_SIZE_BUCKET "5000000"
+#define STATS_DATE_BUCKET "2629800" // ~30 days
+
+#define STATS_AGG_ADD(row) \
+        "  INSERT INTO stats_size_agg (bucket, count)" \
+        "  VALUES (" row ".size / " STATS_SIZE_BUCKET " * " STATS_SIZE_BUCKET ", 1)" \
+        "  ON CONFLICT DO UPDATE SET count = count + 1;" \
+        "  INSERT INTO stats_date_agg (bucket, count)" \
+        "  VALUES (" row ".mtime / " STATS_DATE_BUCKET " * " STATS_DATE_BUCKET ", 1)" \
+        "  ON CONFLICT DO UPDATE SET count = count + 1;" \
+        "  INSERT INTO stats_mime_agg (mime_id, size, count)" \
+        "  SELECT " row ".mime, " row ".size, 1 WHERE " row ".mime IS NOT NULL" \
+        "  ON CONFLICT DO UPDATE SET size = size + excluded.size, count = count + 1;"
+
+#define STATS_AGG_REMOVE(row) \
+        "  UPDATE stats_size_agg SET count = count - 1" \
+        "  WHERE bucket = " row ".size / " STATS_SIZE_BUCKET " * " STATS_SIZE_BUCKET ";" \
+        "  DELETE FROM stats_size_agg" \
+        "  WHERE bucket = " row ".size / " STATS_SIZE_BUCKET " * " STATS_SIZE_BUCKET " AND count = 0;" \
+        "  UPDATE stats_date_agg SET count = count - 1" \
+        "  WHERE bucket = " row ".mtime / " STATS_DATE_BUCKET " * " STATS_DATE_BUCKET ";" \
+        "  DELETE FROM stats_date_agg" \
+        "  WHERE bucket = " row ".mtime / " STATS_DATE_BUCKET " * " STATS_DATE_BUCKET " AND count = 0;" \
+        "  UPDATE stats_mime_agg SET size = size - " row ".size, count = count - 1 WHERE mime_id = " row ".mime;" \
+        "  DELETE FROM stats_mime_agg WHERE mime_id = " row ".mime AND count = 0;"
+
+/*
+ * The size, date and mime aggregates are kept up to date by triggers on the
+ * document table, so that the stats of an incremental scan cost as much as
+ * the documents it added, changed or deleted.
+ */
+#define STATS_AGG_TABLES \
+        "CREATE TABLE stats_size_agg (" \
+        "   bucket INTEGER PRIMARY KEY," \
+        "   count INTEGER NOT NULL" \
+        ")"STRICT";" \
+        "" \
+        "CREATE TABLE stats_date_agg (" \
+        "   bucket INTEGER PRIMARY KEY," \
+        "   count INTEGER NOT NULL" \
+        ")"STRICT";" \
+        "" \
+        "CREATE TABLE stats_mime_agg (" \
+        "   mime_id INTEGER PRIMARY KEY," \
+        "   size INTEGER NOT NULL," \
+        "   count INTEGER NOT NULL" \
+        ")"STRICT";" \
+        "" \
+        "CREATE TRIGGER stats_document_insert_trigger" \
+        " AFTER INSERT ON document" \
+        " BEGIN" \
+        STATS_AGG_ADD("NEW") \
+        " END;" \
+        "" \
+        "CREATE TRIGGER stats_document_delete_trigger" \
+        " AFTER DELETE ON document" \
+        " BEGIN" \
+        STATS_AGG_REMOVE("OLD") \
+        " END;" \
+        "" \
+        "CREATE TRIGGER stats_document_update_trigger" \
+        " AFTER UPDATE OF mime, mtime, size ON document" \
+        " BEGIN" \
+        STATS_AGG_REMOVE("OLD") \
+        STATS_AGG_ADD("NEW") \
+        " END;"
+
 const char *FtsDatabaseSchema =
         "CREATE TABLE IF NOT EXISTS document_index ("
         "   id INTEGER PRIMARY KEY,"
@@ -14,9 +188,12 @@ const char *FtsDatabaseSchema =
         "   mtime INTEGER NOT NULL,"
         "   mime TEXT,"
         "   thumbnail_count INTEGER NOT NULL,"
+        "   title TEXT,"
         "   json_data TEXT NOT NULL"
         ")"STRICT";"
         ""
+        FTS_DOCUMENT_CONTENT
+        ""
         "CREATE TABLE IF NOT EXISTS stats ("
         "   mtime_min INTEGER,"
         "   mtime_max INTEGER"
@@ -75,14 +252,7 @@ const char *FtsDatabaseSchema =
         "  WHERE id = OLD.id;"
         " END;"
         ""
-        "CREATE VIEW IF NOT EXISTS document_view (id, name, content, title, path)"
-        " AS"
-        " SELECT id,"
-        "  json_data->>'name',"
-        "  json_data->>'content',"
-        "  json_data->>'title',"
-        "  json_data->>'path'"
-        " FROM document_index;"
+        FTS_DOCUMENT_VIEW
         ""
         "CREATE VIRTUAL TABLE IF NOT EXISTS search USING fts5 ("
         "   name,"
@@ -112,12 +282,11 @@ const char *IpcDatabaseSchema =
         ")"STRICT";";
 
 const char *IndexDatabaseSchema =
-        "CREATE TABLE thumbnail ("
-        "   id INTEGER REFERENCES document(id),"
-        "   num INTEGER NOT NULL,"
-        "   data BLOB NOT NULL,"
-        "   PRIMARY KEY(id, num)"
-        ") WITHOUT ROWID;"
+        THUMBNAIL_TABLES
+        ""
+        THUMBNAIL_ORPHAN_TABLES
+        ""
+        THUMBNAIL_PACK_TABLES
         ""
         "CREATE TABLE version ("
         "   id INTEGER PRIMARY KEY AUTOINCREMENT,"
@@ -130,18 +299,36 @@ const char *IndexDatabaseSchema =
         ")"STRICT";"
         "CREATE UNIQUE INDEX mime_name_idx ON mime(name);"
         ""
+        DIRECTORY_TABLE
+        DIRECTORY_INDICES
+        ""
         "CREATE TABLE document ("
         "   id INTEGER PRIMARY KEY,"
         "   parent INTEGER REFERENCES document(id),"
         "   mime INTEGER REFERENCES mime(id),"
-        "   path TEXT NOT NULL,"
+        "   directory_id INTEGER NOT NULL REFERENCES directory(id),"
+        // File name with its extension, escaped like directory names
+        "   filename TEXT NOT NULL,"
         "   version INTEGER NOT NULL REFERENCES version(id),"
         "   mtime INTEGER NOT NULL,"
         "   size INTEGER NOT NULL,"
         "   thumbnail_count INTEGER NOT NULL,"
+        "   name TEXT,"
+        "   extension TEXT,"
+        "   width INTEGER,"
+        "   height INTEGER,"
+        "   duration INTEGER,"
+        "   pages INTEGER,"
+        "   title TEXT,"
+        "   author TEXT,"
+        "   checksum TEXT,"
+        // Metadata keys that do not have their own column
         "   json_data TEXT CHECK ( json_data IS NULL OR json_valid(json_data) )"
         ")"STRICT";"
-        "CREATE UNIQUE INDEX document_path_idx ON document(path);"
+        "CREATE UNIQUE INDEX document_path_idx ON document(directory_id, filename);"
+        ""
+        INDEX_DOCUMENT_CONTENT
+        ""
         "CREATE TABLE marked ("
         "   id INTEGER PRIMARY KEY,"
         "   marked INTEGER NOT NULL,"
@@ -176,21 +363,7 @@ const char *IndexDatabaseSchema =
         "   size INTEGER NOT NULL"
         ")"STRICT";"
         ""
-        "CREATE TABLE stats_size_agg ("
-        "   bucket INTEGER NOT NULL,"
-        "   count INTEGER NOT NULL"
-        ")"STRICT";"
-        ""
-        "CREATE TABLE stats_date_agg ("
-        "   bucket INTEGER NOT NULL,"
-        "   count INTEGER NOT NULL"
-        ")"STRICT";"
-        ""
-        "CREATE TABLE stats_mime_agg ("
-        "   mime TEXT NOT NULL,"
-        "   size INTEGER NOT NULL,"
-        "   count INTEGER NOT NULL"
-        ")"STRICT";"
+        STATS_AGG_TABLES
         ""
         "CREATE TABLE embedding ("
         "   id INTEGER REFERENCES document(id),"
@@ -210,3 +383,163 @@ const char *IndexDatabaseSchema =
         "   type TEXT NOT NULL CHECK ( type IN ('flat', 'nested') )"
         ")"STRICT";";
 
+
+/**
+ * Indices created before the typed columns stored everything in json_data
+ */
+const char *IndexDatabaseTypedColumnsMigration =
+        "BEGIN;"
+        "ALTER TABLE document ADD COLUMN name TEXT;"
+        "ALTER TABLE document ADD COLUMN dir_path TEXT;"
+        "ALTER TABLE document ADD COLUMN extension TEXT;"
+        "ALTER TABLE document ADD COLUMN width INTEGER;"
+        "ALTER TABLE document ADD COLUMN height INTEGER;"
+        "ALTER TABLE document ADD COLUMN duration INTEGER;"
+        "ALTER TABLE document ADD COLUMN pages INTEGER;"
+        "ALTER TABLE document ADD COLUMN title TEXT;"
+        "ALTER TABLE document ADD COLUMN author TEXT;"
+        "ALTER TABLE document ADD COLUMN checksum TEXT;"
+        ""
+        INDEX_DOCUMENT_CONTENT
+        ""
+        "INSERT INTO document_content (id, content)"
+        " SELECT id, json_data->>'content' FROM document WHERE json_data->>'content' IS NOT NULL;"
+        ""
+        "UPDATE document SET"
+        "  name = json_data->>'name',"
+        "  dir_path = json_data->>'path',"
+        "  extension = json_data->>'extension',"
+        "  width = CAST(json_data->>'width' AS INTEGER),"
+        "  height = CAST(json_data->>'height' AS INTEGER),"
+        "  duration = CAST(json_data->>'duration' AS INTEGER),"
+        "  pages = CAST(json_data->>'pages' AS INTEGER),"
+        "  title = json_data->>'title',"
+        "  author = json_data->>'author',"
+        "  checksum = json_data->>'checksum',"
+        "  json_data = NULLIF(json_remove(json_data, '$.name', '$.path', '$.extension', '$.width', '$.height',"
+        "   '$.duration', '$.pages', '$.title', '$.author', '$.checksum', '$.content'), '{}')"
+        " WHERE json_data IS NOT NULL;"
+        "COMMIT;";
+
+const char *FtsDatabaseTypedColumnsMigration =
+        "BEGIN;"
+        "ALTER TABLE document_index ADD COLUMN title TEXT;"
+        ""
+        FTS_DOCUMENT_CONTENT
+        ""
+        "INSERT INTO document_content (id, content)"
+        " SELECT id, json_data->>'content' FROM document_index WHERE json_data->>'content' IS NOT NULL;"
+        ""
+        "UPDATE document_index SET"
+        "  title = json_data->>'title',"
+        "  json_data = json_remove(json_data, '$.content');"
+        ""
+        "DROP VIEW IF EXISTS document_view;"
+        FTS_DOCUMENT_VIEW
+        "COMMIT;";
+
+const char *IndexDatabaseThumbnailPackMigration =
+        THUMBNAIL_PACK_TABLES;
+
+/*
+ * Pack rows used to be keyed by (id, num). The hash of each packed thumbnail
+ * is read back from its segment, thumbnail_pack_hash() is registered for the
+ * duration of the migration and returns NULL for data that cannot be read.
+ */
+const char *IndexDatabaseThumbnailPackHashMigration =
+        "BEGIN;"
+        "ALTER TABLE thumbnail_pack RENAME TO thumbnail_pack_legacy;"
+        ""
+        THUMBNAIL_PACK_TABLE
+        ""
+        "CREATE TEMP TABLE thumbnail_pack_legacy_hash AS"
+        " SELECT id, num, segment, offset, size, thumbnail_pack_hash(segment, offset, size) AS hash"
+        " FROM thumbnail_pack_legacy;"
+        ""
+        "INSERT INTO thumbnail (id, num, hash)"
+        " SELECT id, num, hash FROM thumbnail_pack_legacy_hash WHERE hash IS NOT NULL"
+        " ON CONFLICT DO UPDATE SET hash=excluded.hash;"
+        ""
+        "INSERT INTO thumbnail_pack (hash, segment, offset, size)"
+        " SELECT hash, segment, offset, size FROM thumbnail_pack_legacy_hash WHERE hash IS NOT NULL"
+        " ON CONFLICT DO NOTHING;"
+        ""
+        "DROP TABLE thumbnail_pack_legacy_hash;"
+        "DROP TABLE thumbnail_pack_legacy;"
+        "COMMIT;";
+
+// thumbnail_hash() is registered for the duration of the migration
+const char *IndexDatabaseThumbnailHashMigration =
+        "BEGIN;"
+        "ALTER TABLE thumbnail RENAME TO thumbnail_legacy;"
+        ""
+        THUMBNAIL_TABLES
+        ""
+        "INSERT INTO thumbnail (id, num, hash)"
+        " SELECT id, num, thumbnail_hash(data) FROM thumbnail_legacy;"
+        ""
+        "INSERT INTO thumbnail_data (hash, data)"
+        " SELECT thumbnail_hash(data), data FROM thumbnail_legacy WHERE TRUE ON CONFLICT DO NOTHING;"
+        ""
+        "DROP TABLE thumbnail_legacy;"
+        "COMMIT;";
+
+// path_escape() and path_parent() are registered for the duration of the migration
+const char *IndexDatabaseDirectoryMigration =
+        "BEGIN;"
+        DIRECTORY_TABLE
+        ""
+        "INSERT INTO directory (parent_id, name, path)"
+        " WITH RECURSIVE dirs (path) AS ("
+        "  SELECT DISTINCT path_parent(path) FROM document WHERE path_parent(path) IS NOT NULL"
+        "  UNION"
+        "  SELECT path_parent(path) FROM dirs WHERE path_parent(path) IS NOT NULL"
+        " )"
+        " SELECT 0, '', path_escape(path) FROM dirs;"
+        ""
+        // The parent of each directory is looked up by path
+        DIRECTORY_PATH_INDEX
+        ""
+        "UPDATE directory SET"
+        "  parent_id = COALESCE((SELECT p.id FROM directory p WHERE p.path = path_parent(directory.path)), 0),"
+        "  name = substr(path, COALESCE(length(path_parent(path)) + 2, 1))"
+        " WHERE id != 0;"
+        ""
+        // (parent_id, name) is only unique once the parents are set
+        DIRECTORY_PARENT_INDEX
+        ""
+        "ALTER TABLE document ADD COLUMN directory_id INTEGER NOT NULL DEFAULT 0 REFERENCES directory(id);"
+        "ALTER TABLE document ADD COLUMN filename TEXT NOT NULL DEFAULT '';"
+        ""
+        "UPDATE document SET"
+        "  directory_id = COALESCE((SELECT d.id FROM directory d WHERE d.path = path_escape(path_parent(path))), 0),"
+        "  filename = path_escape(substr(path, COALESCE(length(path_parent(path)) + 2, 1)));"
+        ""
+        "DROP INDEX document_path_idx;"
+        "ALTER TABLE document DROP COLUMN path;"
+        "ALTER TABLE document DROP COLUMN dir_path;"
+        "CREATE UNIQUE INDEX document_path_idx ON document(directory_id, filename);"
+        "COMMIT;";
+
+// Unreferenced thumbnails used to be found by scanning the whole thumbnail table
+const char *IndexDatabaseThumbnailOrphanMigration =
+        "BEGIN;"
+        THUMBNAIL_ORPHAN_TABLES
+        "COMMIT;";
+
+// The aggregates used to be rebuilt from the whole document table after each scan
+const char *IndexDatabaseStatsMigration =
+        "BEGIN;"
+        "DROP TABLE stats_size_agg;"
+        "DROP TABLE stats_date_agg;"
+        "DROP TABLE stats_mime_agg;"
+        ""
+        STATS_AGG_TABLES
+        ""
+        "INSERT INTO stats_size_agg (bucket, count)"
+        " SELECT size / " STATS_SIZE_BUCKET " * " STATS_SIZE_BUCKET " AS b, count(*) FROM document GROUP BY b;"
+        "INSERT INTO stats_date_agg (bucket, count)"
+        " SELECT mtime / " STATS_DATE_BUCKET " * " STATS_DATE_BUCKET " AS b, count(*) FROM document GROUP BY b;"
+        "INSERT INTO stats_mime_agg (mime_id, size, count)"
+        " SELECT mime, sum(size), count(*) FROM document WHERE mime IS NOT NULL GROUP BY mime;"
+        "COMMIT;";
@@ -2,159 +2,251 @@
 #include "src/sist.h"
 #include "src/ctx.h"
 
-#define TREEMAP_MINIMUM_MERGES_TO_CONTINUE (100)
-#define SIZE_BUCKET (long)(5 * 1000 * 1000)
-#define DATE_BUCKET (long)(2629800) // ~30 days
-
-
-database_iterator_t *database_create_treemap_iterator(database_t *db, long threshold) {
+typedef struct treemap_file {
+    const char *name;
+    long size;
+    struct treemap_file *next;
+} treemap_file_t;
+
+typedef struct treemap_node {
+    const char *name;
+    int parent_id;
+    struct treemap_node *first_child;
+    struct treemap_node *next_sibling;
+    /** Files that are not merged into the directory */
+    treemap_file_t *files;
+    /** Size of the files and subdirectories merged into the directory */
+    long size;
+} treemap_node_t;
+
+typedef struct {
+    database_t *db;
+    scan_arena_t arena;
+    /** Nodes by directory id */
+    treemap_node_t **nodes;
+    int node_count;
+    int directory_count;
+    long threshold;
+    sqlite3_stmt *insert_stmt;
+    char path[PATH_MAX * 3];
+    long row_count;
+} treemap_t;
+
+static char *treemap_strdup(treemap_t *tm, const char *str, int len) {
+    char *copy = scan_arena_alloc(&tm->arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
 
+/**
+ * Build the directory tree from the directory table. Parents can have a
+ * larger id than their children, so they are linked once all nodes exist.
+ */
+static void treemap_load_directories(database_t *db, treemap_t *tm) {
     sqlite3_stmt *stmt;
 
-    sqlite3_prepare_v2(db->db,
-                       "SELECT path, path_parent(path), size FROM tm"
-                       " WHERE path_parent(path) IN (SELECT path FROM tm)"
-                       " AND size<?",
-                       -1, &stmt, NULL);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, "SELECT max(id) FROM directory;", -1, &stmt, NULL));
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    tm->node_count = sqlite3_column_int(stmt, 0) + 1;
+    sqlite3_finalize(stmt);
+
+    tm->nodes = calloc(tm->node_count, sizeof(treemap_node_t *));
+    tm->directory_count = 0;
 
-    sqlite3_bind_int64(stmt, 1, threshold);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT id, coalesce(parent_id, -1), name FROM directory;", -1, &stmt, NULL));
 
-    database_iterator_t *iter = malloc(sizeof(database_iterator_t));
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        treemap_node_t *node = scan_arena_alloc(&tm->arena, sizeof(treemap_node_t));
+        node->name = treemap_strdup(tm, (const char *) sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2));
+        node->parent_id = sqlite3_column_int(stmt, 1);
+        node->first_child = NULL;
+        node->next_sibling = NULL;
+        node->files = NULL;
+        node->size = 0;
+
+        tm->nodes[sqlite3_column_int(stmt, 0)] = node;
+        tm->directory_count += 1;
+    }
+    CRASH_IF_STMT_FAIL(ret);
+    sqlite3_finalize(stmt);
 
-    iter->stmt = stmt;
-    iter->db = db;
+    for (int i = 1; i < tm->node_count; i++) {
+        treemap_node_t *node = tm->nodes[i];
+        if (node == NULL) {
+            continue;
+        }
 
-    return iter;
+        treemap_node_t *parent = node->parent_id >= 0 ? tm->nodes[node->parent_id] : NULL;
+        if (parent == NULL) {
+            LOG_WARNINGF("database_stats.c", "Directory %d has no parent, skipping", i);
+            continue;
+        }
+        node->next_sibling = parent->first_child;
+        parent->first_child = node;
+    }
 }
 
-treemap_row_t database_treemap_iter(database_iterator_t *iter) {
+/**
+ * Files smaller than the threshold are merged into their directory, the
+ * others are kept with their own path. Files at the root of the index are
+ * always kept.
+ */
+static void treemap_load_documents(database_t *db, treemap_t *tm) {
+    sqlite3_stmt *stmt;
 
-    if (iter->stmt == NULL) {
-        LOG_FATAL("database.c", "FIXME: database_treemap_iter() called after iteration stopped");
-    }
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT directory_id, size, filename FROM document WHERE parent IS NULL;", -1, &stmt, NULL));
 
-    int ret = sqlite3_step(iter->stmt);
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int directory_id = sqlite3_column_int(stmt, 0);
+        treemap_node_t *node = directory_id < tm->node_count ? tm->nodes[directory_id] : NULL;
+        if (node == NULL) {
+            continue;
+        }
+        long size = sqlite3_column_int64(stmt, 1);
 
-    if (ret == SQLITE_ROW) {
-        treemap_row_t row = {
-                .path = (const char *) sqlite3_column_text(iter->stmt, 0),
-                .parent = (const char *) sqlite3_column_text(iter->stmt, 1),
-                .size = sqlite3_column_int64(iter->stmt, 2)
-        };
+        if (size < tm->threshold && node != tm->nodes[0]) {
+            node->size += size;
+            continue;
+        }
 
-        return row;
+        treemap_file_t *file = scan_arena_alloc(&tm->arena, sizeof(treemap_file_t));
+        file->name = treemap_strdup(tm, (const char *) sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2));
+        file->size = size;
+        file->next = node->files;
+        node->files = file;
     }
+    CRASH_IF_STMT_FAIL(ret);
+    sqlite3_finalize(stmt);
+}
+
+static void treemap_insert(treemap_t *tm, size_t path_len, long size) {
+    database_t *db = tm->db;
+
+    sqlite3_bind_text(tm->insert_stmt, 1, tm->path, (int) path_len, SQLITE_STATIC);
+    sqlite3_bind_int64(tm->insert_stmt, 2, size);
+    CRASH_IF_STMT_FAIL(sqlite3_step(tm->insert_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(tm->insert_stmt));
 
-    if (ret != SQLITE_DONE) {
-        LOG_FATALF("database.c", "FIXME: doc iter returned %s", sqlite3_errmsg(iter->db->db));
+    tm->row_count += 1;
+}
+
+/**
+ * @return length of the path with the name appended, or 0 if it does not fit
+ */
+static size_t treemap_append_path(treemap_t *tm, size_t path_len, const char *name) {
+    size_t name_len = strlen(name);
+
+    if (path_len + name_len + 2 > sizeof(tm->path)) {
+        return 0;
     }
 
-    sqlite3_finalize(iter->stmt);
-    iter->stmt = NULL;
+    if (path_len != 0) {
+        tm->path[path_len++] = '/';
+    }
+    memcpy(tm->path + path_len, name, name_len);
 
-    return (treemap_row_t) {NULL, NULL, 0};
+    return path_len + name_len;
 }
 
-void database_generate_stats(database_t *db, double treemap_threshold) {
+/**
+ * @return size of the files and directories below the node
+ */
+static long treemap_subtree_size(treemap_node_t *node) {
+    long size = node->size;
 
-    LOG_INFO("database.c", "Generating stats");
+    for (treemap_file_t *file = node->files; file != NULL; file = file->next) {
+        size += file->size;
+    }
+    for (treemap_node_t *child = node->first_child; child != NULL; child = child->next_sibling) {
+        size += treemap_subtree_size(child);
+    }
 
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "DELETE FROM stats_size_agg;", NULL, NULL, NULL));
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "DELETE FROM stats_date_agg;", NULL, NULL, NULL));
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "DELETE FROM stats_mime_agg;", NULL, NULL, NULL));
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "DELETE FROM stats_treemap;", NULL, NULL, NULL));
+    return size;
+}
 
-    CRASH_IF_NOT_SQLITE_OK(
-            sqlite3_exec(db->db, "CREATE TEMP TABLE tm(path TEXT PRIMARY KEY, size INT);", NULL, NULL, NULL));
+/**
+ * Post-order traversal of the tree, tm->path holds the path of the node.
+ * Directories smaller than the threshold are merged into their parent,
+ * directories at the root of the index are always kept. Entries whose path
+ * is too long are merged into the node, whatever their size.
+ *
+ * @return size of the node once its small children are merged into it
+ */
+static long treemap_visit(treemap_t *tm, treemap_node_t *node, size_t path_len) {
+    int is_root = node == tm->nodes[0];
+
+    for (treemap_file_t *file = node->files; file != NULL; file = file->next) {
+        size_t file_path_len = treemap_append_path(tm, path_len, file->name);
+        if (file_path_len == 0) {
+            node->size += file->size;
+            continue;
+        }
+        treemap_insert(tm, file_path_len, file->size);
+    }
 
-    sqlite3_prepare_v2(db->db, "UPDATE tm SET size=size+? WHERE path=?;", -1, &db->treemap_merge_up_update_stmt, NULL);
-    sqlite3_prepare_v2(db->db, "DELETE FROM tm WHERE path = ?;", -1, &db->treemap_merge_up_delete_stmt, NULL);
+    for (treemap_node_t *child = node->first_child; child != NULL; child = child->next_sibling) {
+        size_t child_path_len = treemap_append_path(tm, path_len, child->name);
+        if (child_path_len == 0) {
+            node->size += treemap_subtree_size(child);
+            continue;
+        }
 
-    // size aggregation
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(db->db, "INSERT INTO stats_size_agg"
-                               " SELECT"
-                               "  cast(size / ?1 as int) * ?1 as bucket,"
-                               "  count(*) as count"
-                               " FROM document"
-                               " GROUP BY bucket", -1, &stmt, NULL);
-    sqlite3_bind_int(stmt, 1, SIZE_BUCKET);
-    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+        long child_size = treemap_visit(tm, child, child_path_len);
 
-    sqlite3_finalize(stmt);
+        if (is_root || child_size >= tm->threshold) {
+            if (child_size > 0) {
+                treemap_insert(tm, child_path_len, child_size);
+            }
+        } else {
+            node->size += child_size;
+        }
+    }
 
-    // date aggregation
-    sqlite3_prepare_v2(db->db, "INSERT INTO stats_date_agg"
-                               " SELECT"
-                               "  cast(mtime / ?1 as int) * ?1 as bucket,"
-                               "  count(*) as count"
-                               " FROM document"
-                               " GROUP BY bucket", -1, &stmt, NULL);
-    sqlite3_bind_int(stmt, 1, DATE_BUCKET);
-    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    return node->size;
+}
 
-    sqlite3_finalize(stmt);
+void database_generate_stats(database_t *db, double treemap_threshold) {
 
-    // mime aggregation
-    sqlite3_prepare_v2(db->db, "INSERT INTO stats_mime_agg"
-                               " SELECT"
-                               "  m.name as bucket,"
-                               "  sum(size),"
-                               "  count(*)"
-                               " FROM document INNER JOIN mime m ON m.id=document.mime"
-                               " WHERE bucket IS NOT NULL"
-                               " GROUP BY bucket", -1, &stmt, NULL);
-    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    LOG_INFO("database.c", "Generating stats");
 
-    sqlite3_finalize(stmt);
+    // The size, date and mime aggregates are maintained by triggers on the document table
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "DELETE FROM stats_treemap;", NULL, NULL, NULL));
 
     // Treemap
+    sqlite3_stmt *stmt;
     sqlite3_prepare_v2(db->db, "SELECT SUM(size) FROM document;", -1, &stmt, NULL);
     CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
     long total_size = sqlite3_column_int64(stmt, 0);
-    long threshold = (long) ((double) total_size * treemap_threshold);
     sqlite3_finalize(stmt);
 
-    // flat map
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db,
-                                        "INSERT INTO tm (path, size) SELECT path, sum(size)"
-                                        " FROM document WHERE parent IS NULL GROUP BY path;",
-                                        NULL, NULL, NULL));
+    treemap_t *tm = malloc(sizeof(treemap_t));
+    tm->db = db;
+    scan_arena_init(&tm->arena);
+    tm->threshold = (long) ((double) total_size * treemap_threshold);
+    tm->row_count = 0;
 
-    // Merge up
-    int merged_rows = 0;
-    do {
-        if (merged_rows) {
-            LOG_INFOF("database.c", "Treemap merge iteration (%d rows changed)", merged_rows);
-        }
-        merged_rows = 0;
-
-        sqlite3_prepare_v2(db->db,
-                           "INSERT INTO tm (path, size) SELECT path_parent(path) as parent, 0 "
-                           " FROM tm WHERE parent not IN (SELECT path FROM tm) AND size<?"
-                           " ON CONFLICT DO NOTHING;", -1, &stmt, NULL);
-        sqlite3_bind_int64(stmt, 1, threshold);
-        CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
-
-        database_iterator_t *iter = database_create_treemap_iterator(db, threshold);
-        database_treemap_iter_foreach(row, iter) {
-            sqlite3_bind_int64(db->treemap_merge_up_update_stmt, 1, row.size);
-            sqlite3_bind_text(db->treemap_merge_up_update_stmt, 2, row.parent, -1, SQLITE_STATIC);
-            CRASH_IF_STMT_FAIL(sqlite3_step(db->treemap_merge_up_update_stmt));
-            CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->treemap_merge_up_update_stmt));
-
-            sqlite3_bind_text(db->treemap_merge_up_delete_stmt, 1, row.path, -1, SQLITE_STATIC);
-            CRASH_IF_STMT_FAIL(sqlite3_step(db->treemap_merge_up_delete_stmt));
-            CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->treemap_merge_up_delete_stmt));
-
-            merged_rows += 1;
-        }
-        free(iter);
-    } while (merged_rows > TREEMAP_MINIMUM_MERGES_TO_CONTINUE);
+    treemap_load_directories(db, tm);
+    treemap_load_documents(db, tm);
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO stats_treemap (path, size) VALUES (?, ?);", -1, &tm->insert_stmt, NULL));
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "BEGIN;", NULL, NULL, NULL));
+    treemap_visit(tm, tm->nodes[0], 0);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "COMMIT;", NULL, NULL, NULL));
+
+    LOG_DEBUGF("database_stats.c", "Treemap: %d directories, %ld rows (%ldkB of memory)",
+               tm->directory_count, tm->row_count, tm->arena.alloc_bytes / 1024);
 
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db,
-                                        "INSERT INTO stats_treemap (path, size) SELECT path,size FROM tm;",
-                                        NULL, NULL, NULL));
+    sqlite3_finalize(tm->insert_stmt);
+    scan_arena_reset(&tm->arena);
+    free(tm->nodes);
+    free(tm);
 
     LOG_INFO("database.c", "Done!");
 }
@@ -198,7 +290,8 @@ cJSON *database_get_stats(database_t *db, database_stat_type_d type) {
             break;
         case DATABASE_STAT_MIME_AGG:
             CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                    db->db, "SELECT mime,size,count FROM stats_mime_agg", -1, &stmt, NULL
+                    db->db, "SELECT m.name, a.size, a.count FROM stats_mime_agg a"
+                            " INNER JOIN mime m ON m.id = a.mime_id WHERE m.name IS NOT NULL", -1, &stmt, NULL
             ));
             break;
         case DATABASE_STAT_INVALID:
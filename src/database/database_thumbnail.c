@@ -0,0 +1,309 @@
+#include "database.h"
+#include "src/ctx.h"
+#include "src/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// A worker starts a new segment once its current one reaches this size
+#define THUMBNAIL_PACK_SEGMENT_SIZE (1024L * 1024 * 1024)
+// Seconds between two checks for packs in an index that had none
+#define THUMBNAIL_PACK_CHECK_INTERVAL 30
+
+/*
+ * Thumbnails can be appended to pack files next to the index instead of being
+ * stored in the thumbnail_data table. Each worker appends to its own segment, so
+ * writing the data does not hold the index lock, and the web server serves
+ * them straight from a read-only mapping of the segment.
+ */
+
+void database_thumbnail_hash(const void *data, size_t data_size, unsigned char *hash) {
+    EVP_Digest(data, data_size, hash, NULL, EVP_sha1(), NULL);
+}
+
+void thumbnail_hash_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (argc != 1 || sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_error(ctx, "Invalid parameters", -1);
+        return;
+    }
+
+    unsigned char hash[THUMBNAIL_HASH_LENGTH];
+    database_thumbnail_hash(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), hash);
+
+    sqlite3_result_blob(ctx, hash, THUMBNAIL_HASH_LENGTH, SQLITE_TRANSIENT);
+}
+
+static void get_segment_path(database_t *db, int segment, char *path) {
+    snprintf(path, PATH_MAX, "%s.thumbnails/%d.pack", db->filename, segment);
+}
+
+/**
+ * thumbnail_pack_hash(segment, offset, size): hash of a thumbnail read back from
+ * its pack segment, used to migrate packs written before thumbnails were
+ * content-addressed. The database is the user data of the function.
+ */
+void thumbnail_pack_hash_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    if (argc != 3) {
+        sqlite3_result_error(ctx, "Invalid parameters", -1);
+        return;
+    }
+
+    database_t *db = sqlite3_user_data(ctx);
+    int segment = sqlite3_value_int(argv[0]);
+    off_t offset = (off_t) sqlite3_value_int64(argv[1]);
+    size_t size = (size_t) sqlite3_value_int64(argv[2]);
+
+    char path[PATH_MAX];
+    get_segment_path(db, segment, path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOG_WARNINGF("database_thumbnail.c", "Could not open %s: %s", path, strerror(errno));
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    char *data = malloc(size);
+    ssize_t ret = pread(fd, data, size, offset);
+    close(fd);
+
+    if (ret != (ssize_t) size) {
+        LOG_WARNINGF("database_thumbnail.c", "Thumbnail pack %s is truncated, dropping thumbnail at offset %ld",
+                     path, (long) offset);
+        free(data);
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    unsigned char hash[THUMBNAIL_HASH_LENGTH];
+    database_thumbnail_hash(data, size, hash);
+    free(data);
+
+    sqlite3_result_blob(ctx, hash, THUMBNAIL_HASH_LENGTH, SQLITE_TRANSIENT);
+}
+
+static int open_segment(database_t *db) {
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s.thumbnails", db->filename);
+    if (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+        LOG_ERRORF("database_thumbnail.c", "Could not create directory %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO thumbnail_segment DEFAULT VALUES RETURNING id;", -1, &stmt, NULL));
+
+    pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    int segment = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
+
+    get_segment_path(db, segment, path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        LOG_ERRORF("database_thumbnail.c", "Could not open %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    LOG_DEBUGF("database_thumbnail.c", "Writing thumbnails to %s", path);
+
+    db->thumbnail_pack_fd = fd;
+    db->thumbnail_pack_segment = segment;
+    db->thumbnail_pack_offset = 0;
+
+    return TRUE;
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t ret = write(fd, data, size);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FALSE;
+        }
+        data += ret;
+        size -= ret;
+    }
+
+    return TRUE;
+}
+
+static int thumbnail_exists(database_t *db, const unsigned char *hash) {
+    sqlite3_bind_blob(db->thumbnail_exists_stmt, 1, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+
+    pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->thumbnail_exists_stmt));
+    int exists = sqlite3_column_int(db->thumbnail_exists_stmt, 0);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->thumbnail_exists_stmt));
+    pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
+
+    return exists;
+}
+
+int database_thumbnail_pack_write(database_t *db, const unsigned char *hash, void *data, size_t data_size) {
+
+    // Two workers can still append the same thumbnail, only one of the copies is referenced
+    if (thumbnail_exists(db, hash)) {
+        return TRUE;
+    }
+
+    if (db->thumbnail_pack_fd != -1 && db->thumbnail_pack_offset + (long) data_size > THUMBNAIL_PACK_SEGMENT_SIZE) {
+        close(db->thumbnail_pack_fd);
+        db->thumbnail_pack_fd = -1;
+    }
+
+    if (db->thumbnail_pack_fd == -1 && !open_segment(db)) {
+        return FALSE;
+    }
+
+    long offset = db->thumbnail_pack_offset;
+    if (!write_all(db->thumbnail_pack_fd, data, data_size)) {
+        LOG_ERRORF("database_thumbnail.c", "Could not write to thumbnail pack %d: %s",
+                   db->thumbnail_pack_segment, strerror(errno));
+        // The end of the segment is unknown, start a new one
+        close(db->thumbnail_pack_fd);
+        db->thumbnail_pack_fd = -1;
+        return FALSE;
+    }
+    db->thumbnail_pack_offset += (long) data_size;
+
+    sqlite3_bind_blob(db->write_thumbnail_pack_stmt, 1, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+    sqlite3_bind_int(db->write_thumbnail_pack_stmt, 2, db->thumbnail_pack_segment);
+    sqlite3_bind_int64(db->write_thumbnail_pack_stmt, 3, offset);
+    sqlite3_bind_int64(db->write_thumbnail_pack_stmt, 4, (sqlite3_int64) data_size);
+
+    pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->write_thumbnail_pack_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_thumbnail_pack_stmt));
+    pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
+
+    return TRUE;
+}
+
+/**
+ * Map the segment, or map it again if it grew past the end of the
+ * current mapping (index written to while it is being served). Older
+ * mappings of the segment are kept until the database is closed, since
+ * pointers into them may still be in use.
+ */
+static thumbnail_pack_map_t *get_segment_map(database_t *db, int segment, size_t min_size) {
+
+    // The most recent mapping of a segment is the largest
+    for (int i = db->thumbnail_pack_map_count - 1; i >= 0; i--) {
+        if (db->thumbnail_pack_maps[i].segment == segment) {
+            if (db->thumbnail_pack_maps[i].size >= min_size) {
+                return &db->thumbnail_pack_maps[i];
+            }
+            break;
+        }
+    }
+
+    char path[PATH_MAX];
+    get_segment_path(db, segment, path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOG_ERRORF("database_thumbnail.c", "Could not open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < min_size) {
+        LOG_ERRORF("database_thumbnail.c", "Thumbnail pack %s is truncated", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_ERRORF("database_thumbnail.c", "Could not mmap %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    madvise(data, info.st_size, MADV_RANDOM);
+
+    db->thumbnail_pack_maps = realloc(
+            db->thumbnail_pack_maps, sizeof(thumbnail_pack_map_t) * (db->thumbnail_pack_map_count + 1));
+    thumbnail_pack_map_t *map = &db->thumbnail_pack_maps[db->thumbnail_pack_map_count++];
+
+    map->segment = segment;
+    map->map = data;
+    map->size = info.st_size;
+
+    return map;
+}
+
+int database_thumbnail_pack_exists(database_t *db) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "SELECT EXISTS (SELECT 1 FROM thumbnail_pack);", -1, &stmt, NULL));
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    int exists = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    return exists;
+}
+
+const void *database_thumbnail_pack_read(database_t *db, const unsigned char *hash, size_t *data_size) {
+
+    // The index can get its first packed thumbnail while it is being served
+    if (!db->has_thumbnail_pack) {
+        time_t now = time(NULL);
+        if (now - db->thumbnail_pack_checked < THUMBNAIL_PACK_CHECK_INTERVAL) {
+            return NULL;
+        }
+
+        db->has_thumbnail_pack = database_thumbnail_pack_exists(db);
+        db->thumbnail_pack_checked = now;
+        if (!db->has_thumbnail_pack) {
+            return NULL;
+        }
+    }
+
+    sqlite3_bind_blob(db->select_thumbnail_pack_stmt, 1, hash, THUMBNAIL_HASH_LENGTH, SQLITE_STATIC);
+
+    int ret = sqlite3_step(db->select_thumbnail_pack_stmt);
+    if (ret == SQLITE_DONE) {
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_pack_stmt));
+        return NULL;
+    }
+    CRASH_IF_STMT_FAIL(ret);
+
+    int segment = sqlite3_column_int(db->select_thumbnail_pack_stmt, 0);
+    size_t offset = sqlite3_column_int64(db->select_thumbnail_pack_stmt, 1);
+    size_t size = sqlite3_column_int64(db->select_thumbnail_pack_stmt, 2);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->select_thumbnail_pack_stmt));
+
+    thumbnail_pack_map_t *map = get_segment_map(db, segment, offset + size);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    *data_size = size;
+    return (char *) map->map + offset;
+}
+
+void database_thumbnail_pack_close(database_t *db) {
+    if (db->thumbnail_pack_fd != -1) {
+        close(db->thumbnail_pack_fd);
+        db->thumbnail_pack_fd = -1;
+    }
+
+    for (int i = 0; i < db->thumbnail_pack_map_count; i++) {
+        munmap(db->thumbnail_pack_maps[i].map, db->thumbnail_pack_maps[i].size);
+    }
+    free(db->thumbnail_pack_maps);
+    db->thumbnail_pack_maps = NULL;
+    db->thumbnail_pack_map_count = 0;
+}
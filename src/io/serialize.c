@@ -1,6 +1,7 @@
 #include "src/ctx.h"
 #include "serialize.h"
 #include "src/parsing/mime.h"
+#include "libscan/json/json_writer.h"
 
 
 char *get_meta_key_text(enum metakey meta_key) {
@@ -79,17 +80,22 @@ char *get_meta_key_text(enum metakey meta_key) {
     }
 }
 
-typedef struct {
-    meta_line_t *meta_head;
-    meta_line_t *meta_tail;
-} linked_list_t;
-
+// Reused by all the documents of the worker
+static __thread json_writer_t json_writer;
 
 void write_document(document_t *doc) {
-    linked_list_t thumbnails_to_write = {.meta_head = NULL, .meta_tail = NULL};
+    if (json_writer.buf.buf == NULL) {
+        json_writer = json_writer_create();
+    }
+    json_writer_t *json = &json_writer;
+    json_writer_begin(json);
 
-    cJSON *json = cJSON_CreateObject();
-    int buffer_size_guess = 8192;
+    document_columns_t columns = {
+            .width = DOCUMENT_COLUMN_UNSET,
+            .height = DOCUMENT_COLUMN_UNSET,
+            .duration = DOCUMENT_COLUMN_UNSET,
+            .pages = DOCUMENT_COLUMN_UNSET,
+    };
 
     // Ignore root directory in the file path
     doc->ext = (short) (doc->ext - ScanCtx.index.desc.root_len);
@@ -97,7 +103,7 @@ void write_document(document_t *doc) {
     char filepath[PATH_MAX * 3];
     strcpy(filepath, doc->filepath + ScanCtx.index.desc.root_len);
 
-    cJSON_AddStringToObject(json, "extension", filepath + doc->ext);
+    columns.extension = filepath + doc->ext;
 
     // Remove extension
     if (*(filepath + doc->ext - 1) == '.') {
@@ -106,19 +112,9 @@ void write_document(document_t *doc) {
         *(filepath + doc->ext) = '\0';
     }
 
-    char filepath_escaped[PATH_MAX * 3];
-    str_escape(filepath_escaped, filepath + doc->base);
-
-    cJSON_AddStringToObject(json, "name", filepath_escaped);
-
-    if (doc->base > 0) {
-        *(filepath + doc->base - 1) = '\0';
-
-        str_escape(filepath_escaped, filepath);
-        cJSON_AddStringToObject(json, "path", filepath_escaped);
-    } else {
-        cJSON_AddStringToObject(json, "path", "");
-    }
+    char name_escaped[PATH_MAX * 3];
+    str_escape(name_escaped, filepath + doc->base);
+    columns.name = name_escaped;
 
     // Metadata
     meta_line_t *meta = doc->meta_head;
@@ -126,17 +122,35 @@ void write_document(document_t *doc) {
 
         switch (meta->key) {
             case MetaPages:
+                columns.pages = meta->long_val;
+                break;
             case MetaWidth:
+                columns.width = meta->long_val;
+                break;
             case MetaHeight:
+                columns.height = meta->long_val;
+                break;
             case MetaMediaDuration:
+                columns.duration = meta->long_val;
+                break;
+            case MetaContent:
+                columns.content = meta->str_val;
+                break;
+            case MetaTitle:
+                columns.title = meta->str_val;
+                break;
+            case MetaAuthor:
+                columns.author = meta->str_val;
+                break;
+            case MetaChecksum:
+                columns.checksum = meta->str_val;
+                break;
             case MetaMediaBitrate: {
-                cJSON_AddNumberToObject(json, get_meta_key_text(meta->key), (double) meta->long_val);
-                buffer_size_guess += 20;
+                json_writer_add_number(json, get_meta_key_text(meta->key), (double) meta->long_val);
                 break;
             }
             case MetaMediaAudioCodec:
             case MetaMediaVideoCodec:
-            case MetaContent:
             case MetaArtist:
             case MetaAlbum:
             case MetaAlbumArtist:
@@ -152,7 +166,6 @@ void write_document(document_t *doc) {
             case MetaExifIsoSpeedRatings:
             case MetaExifDateTime:
             case MetaExifModel:
-            case MetaAuthor:
             case MetaModifiedBy:
             case MetaExifGpsLongitudeDMS:
             case MetaExifGpsLongitudeDec:
@@ -160,43 +173,43 @@ void write_document(document_t *doc) {
             case MetaExifGpsLatitudeDMS:
             case MetaExifGpsLatitudeDec:
             case MetaExifGpsLatitudeRef:
-            case MetaChecksum:
-            case MetaMediaComment:
-            case MetaTitle: {
-                cJSON_AddStringToObject(json, get_meta_key_text(meta->key), meta->str_val);
-                buffer_size_guess += (int) strlen(meta->str_val);
+            case MetaMediaComment: {
+                json_writer_add_string(json, get_meta_key_text(meta->key), meta->str_val);
                 break;
             }
             case MetaThumbnail: {
-                // Keep a list of thumbnails to write after we know what the sid is
-                APPEND_THUMBNAIL(&thumbnails_to_write, meta->str_val, meta->size);
+                // Written after we know what the sid is
                 break;
             }
             default:
             LOG_FATALF("serialize.c", "Invalid meta key: %x %s", meta->key, get_meta_key_text(meta->key));
         }
 
-        meta_line_t *tmp = meta;
         meta = meta->next;
-        free(tmp);
     }
 
-    char *json_str = cJSON_PrintBuffered(json, buffer_size_guess, FALSE);
-    cJSON_Delete(json);
+    // Most documents only have metadata with their own column
+    char *json_str = json_writer_end(json);
+    columns.json_data = json->field_count > 0 ? json_str : NULL;
 
-    int doc_id = database_write_document(ProcData.index_db, doc, json_str);
-    free(doc);
-    free(json_str);
+    int doc_id = database_write_document(ProcData.index_db, doc, &columns);
 
     // Write thumbnails
-    meta = thumbnails_to_write.meta_head;
+    meta = doc->meta_head;
     int index_num = 0;
     while (meta != NULL) {
-        database_write_thumbnail(ProcData.index_db, doc_id, index_num, meta->str_val, meta->size);
+        if (meta->key == MetaThumbnail) {
+            database_write_thumbnail(ProcData.index_db, doc_id, index_num, meta->str_val, meta->size);
+            index_num += 1;
+        }
 
         meta_line_t *tmp = meta;
         meta = meta->next;
-        free(tmp);
-        index_num += 1;
+        meta_line_free(doc, tmp);
+    }
+
+    // Documents backed by an arena are released by the caller
+    if (doc->arena == NULL) {
+        free(doc);
     }
 }
\ No newline at end of file
@@ -122,12 +122,15 @@ void logf_callback(const char *filepath, int level, char *format, ...) {
 void initialize_scan_context(scan_args_t *args) {
 
     ScanCtx.calculate_checksums = args->calculate_checksums;
+    ScanCtx.compress_content = args->compress_content;
+    ScanCtx.thumbnail_pack = args->thumbnail_pack;
 
     // Archive
     ScanCtx.arc_ctx.mode = args->archive_mode;
     ScanCtx.arc_ctx.log = log_callback;
     ScanCtx.arc_ctx.logf = logf_callback;
     ScanCtx.arc_ctx.parse = (parse_callback_t) parse;
+    ScanCtx.arc_ctx.block_size = (size_t) args->archive_block_size_kib * 1024;
     if (args->archive_passphrase != NULL) {
         strcpy(ScanCtx.arc_ctx.passphrase, args->archive_passphrase);
     } else {
@@ -140,6 +143,9 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.comic_ctx.enable_tn = args->tn_count > 0;
     ScanCtx.comic_ctx.tn_size = args->tn_size;
     ScanCtx.comic_ctx.tn_qscale = args->tn_quality;
+    ScanCtx.comic_ctx.tn_compression = args->tn_compression;
+    // The cover is capped by --mem-buffer when it is set lower than the default cap
+    ScanCtx.comic_ctx.max_cover_size = MIN(COMIC_MAX_COVER_SIZE, (long) args->max_memory_buffer_mib * 1024 * 1024);
     ScanCtx.comic_ctx.cbr_mime = mime_get_mime_by_string("application/x-cbr");
     ScanCtx.comic_ctx.cbz_mime = mime_get_mime_by_string("application/x-cbz");
 
@@ -155,6 +161,9 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.ebook_ctx.logf = logf_callback;
     ScanCtx.ebook_ctx.fast_epub_parse = args->fast_epub;
     ScanCtx.ebook_ctx.tn_qscale = args->tn_quality;
+    ScanCtx.ebook_ctx.tn_compression = args->tn_compression;
+    ScanCtx.ebook_ctx.store_size = (size_t) args->ebook_store_size_mib * 1024 * 1024;
+    ScanCtx.ebook_ctx.page_threads = args->ebook_page_threads;
 
     // Font
     ScanCtx.font_ctx.enable_tn = args->tn_count > 0;
@@ -163,13 +172,16 @@ void initialize_scan_context(scan_args_t *args) {
 
     // Media
     ScanCtx.media_ctx.tn_qscale = args->tn_quality;
+    ScanCtx.media_ctx.tn_compression = args->tn_compression;
     ScanCtx.media_ctx.tn_size = args->tn_size;
     ScanCtx.media_ctx.tn_count = args->tn_count;
+    ScanCtx.media_ctx.tn_decode_threads = args->tn_decode_threads;
     ScanCtx.media_ctx.log = log_callback;
     ScanCtx.media_ctx.logf = logf_callback;
     ScanCtx.media_ctx.max_media_buffer = (long) args->max_memory_buffer_mib * 1024 * 1024;
     ScanCtx.media_ctx.read_subtitles = args->read_subtitles;
-    ScanCtx.media_ctx.read_subtitles = args->tn_count;
+    ScanCtx.media_ctx.content_size = args->content_size;
+    ScanCtx.media_ctx.probe_mode = args->media_probe_mode;
 
     if (args->ocr_images) {
         ScanCtx.media_ctx.tesseract_lang = args->tesseract_lang;
@@ -190,6 +202,7 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.mobi_ctx.enable_tn = args->tn_count > 0;
     ScanCtx.mobi_ctx.tn_size = args->tn_size;
     ScanCtx.mobi_ctx.tn_qscale = args->tn_quality;
+    ScanCtx.mobi_ctx.tn_compression = args->tn_compression;
 
     // TEXT
     ScanCtx.text_ctx.content_size = args->content_size;
@@ -214,6 +227,8 @@ void initialize_scan_context(scan_args_t *args) {
 
     // Raw
     ScanCtx.raw_ctx.tn_qscale = args->tn_quality;
+    ScanCtx.raw_ctx.tn_compression = args->tn_compression;
+    ScanCtx.raw_ctx.tn_source = args->tn_source_mode;
     ScanCtx.raw_ctx.enable_tn = args->tn_count > 0;
     ScanCtx.raw_ctx.tn_size = args->tn_size;
     ScanCtx.raw_ctx.log = log_callback;
@@ -265,11 +280,17 @@ void sist2_scan(scan_args_t *args) {
     }
 
     tpool_wait(ScanCtx.pool);
+    parse_log_stats(ProcData.ipc_db->ipc_ctx);
+    database_content_log_stats(ProcData.ipc_db->ipc_ctx);
     tpool_destroy(ScanCtx.pool);
 
     database_t *db = database_create(args->output, INDEX_DATABASE);
     database_open(db);
 
+    if (args->compress_content) {
+        database_content_compress_samples(db);
+    }
+
     if (args->incremental != FALSE) {
         database_incremental_scan_end(db);
     }
@@ -474,6 +495,17 @@ int main(int argc, const char *argv[]) {
             OPT_INTEGER(0, "thumbnail-count", &scan_args->tn_count,
                         "Number of thumbnails to generate. Set a value > 1 to create video previews, set to 0 to disable thumbnails. DEFAULT: 1",
                         set_to_negative_if_value_is_zero, (intptr_t) &scan_args->tn_count),
+            OPT_INTEGER(0, "thumbnail-compression", &scan_args->tn_compression,
+                        "Thumbnail compression effort, on a scale of 0 to 6. Lower is faster, higher "
+                        "gives smaller files. DEFAULT: 6",
+                        set_to_negative_if_value_is_zero, (intptr_t) &scan_args->tn_compression),
+            OPT_STRING(0, "thumbnail-source", &scan_args->tn_source,
+                       "Thumbnail source of RAW images (embedded|decode|auto). embedded: use the preview image "
+                       "stored in the file, decode: decode the full image, auto: use the preview image if it is "
+                       "at least --thumbnail-size. DEFAULT: auto"),
+            OPT_INTEGER(0, "thumbnail-decode-threads", &scan_args->tn_decode_threads,
+                        "Number of threads decoding the video thumbnails of a file, in addition to --threads. "
+                        "DEFAULT: 1"),
             OPT_INTEGER(0, "content-size", &scan_args->content_size,
                         "Number of bytes to be extracted from text documents. Set to 0 to disable. DEFAULT: 32768",
                         set_to_negative_if_value_is_zero, (intptr_t) &scan_args->content_size),
@@ -491,6 +523,8 @@ int main(int argc, const char *argv[]) {
                                                           "shallow: don't scan archives inside archives. DEFAULT: recurse"),
             OPT_STRING(0, "archive-passphrase", &scan_args->archive_passphrase,
                        "Passphrase for encrypted archive files"),
+            OPT_INTEGER(0, "archive-block-size", &scan_args->archive_block_size_kib,
+                        "Size of the blocks read from archive files on disk, in KiB. DEFAULT: 1024"),
 
             OPT_STRING(0, "ocr-lang", &scan_args->tesseract_lang,
                        "Tesseract language (use 'tesseract --list-langs' to see "
@@ -504,10 +538,23 @@ int main(int argc, const char *argv[]) {
             OPT_INTEGER(0, "mem-buffer", &scan_args->max_memory_buffer_mib,
                         "Maximum memory buffer size per thread in MiB for files inside archives "
                         "(see USAGE.md). DEFAULT: 2000"),
+            OPT_INTEGER(0, "ebook-store-size", &scan_args->ebook_store_size_mib,
+                        "Size of the MuPDF resource cache (fonts, glyphs, images) shared by the ebooks "
+                        "parsed by a thread, in MiB, 0 for the MuPDF default. DEFAULT: 256"),
+            OPT_INTEGER(0, "ebook-page-threads", &scan_args->ebook_page_threads,
+                        "Number of threads extracting the text of a single large PDF/ebook, "
+                        "in addition to --threads. DEFAULT: 1"),
             OPT_BOOLEAN(0, "read-subtitles", &scan_args->read_subtitles, "Read subtitles from media files."),
+            OPT_STRING(0, "media-probe", &scan_args->media_probe,
+                       "Stream analysis of media files (fast|full). fast: read a small part of the file first and "
+                       "only read more if some stream parameters are missing. DEFAULT: full"),
             OPT_BOOLEAN(0, "fast-epub", &scan_args->fast_epub,
                         "Faster but less accurate EPUB parsing (no thumbnails, metadata)."),
             OPT_BOOLEAN(0, "checksums", &scan_args->calculate_checksums, "Calculate file checksums when scanning."),
+            OPT_BOOLEAN(0, "compress-content", &scan_args->compress_content,
+                        "Compress the text content of documents with zstd, using a dictionary trained during the scan."),
+            OPT_BOOLEAN(0, "thumbnail-pack", &scan_args->thumbnail_pack,
+                        "Append thumbnails to pack files next to the index instead of storing them in the index."),
             OPT_STRING(0, "list-file", &scan_args->list_path, "Specify a list of newline-delimited paths to be scanned"
                                                               " instead of normal directory traversal. Use '-' to read"
                                                               " from stdin."),
@@ -30,6 +30,11 @@ typedef enum {
     FILETYPE_NDJSON,
 } file_type_t;
 
+static const char *FileTypeNames[] = {
+        "other", "raw", "media", "ebook", "markup", "text", "font", "archive",
+        "ooxml", "comic", "mobi", "msdoc", "json", "ndjson",
+};
+
 file_type_t get_file_type(unsigned int mime, size_t size, const char *filepath) {
 
     int major_mime = MAJOR_MIME(mime);
@@ -67,6 +72,8 @@ file_type_t get_file_type(unsigned int mime, size_t size, const char *filepath)
     } else if (is_ndjson(&ScanCtx.json_ctx, mime)) {
         return FILETYPE_NDJSON;
     }
+
+    return FILETYPE_DONT_PARSE;
 }
 
 #define GET_MIME_ERROR_FATAL (-1)
@@ -132,6 +139,81 @@ int get_mime(parse_job_t *job) {
     return mime;
 }
 
+static void media_stats_add(database_ipc_ctx_t *ipc_ctx, unsigned int mime, long time_us) {
+    for (int i = 0; i < MEDIA_STATS_SIZE; i++) {
+        media_stats_t *stats = &ipc_ctx->media_stats[(mime + i) % MEDIA_STATS_SIZE];
+
+        if (stats->mime == 0) {
+            stats->mime = mime;
+        }
+        if (stats->mime == mime) {
+            stats->count += 1;
+            stats->time_us += time_us;
+            return;
+        }
+    }
+    // Table is full: not tracked
+}
+
+static void parse_stats_add(file_type_t file_type, unsigned int mime, long time_us, int thumbnail_count,
+                            scan_arena_t *arena) {
+    database_ipc_ctx_t *ipc_ctx = ProcData.ipc_db->ipc_ctx;
+
+    pthread_mutex_lock(&ipc_ctx->mutex);
+    ipc_ctx->parse_stats[file_type].count += 1;
+    ipc_ctx->parse_stats[file_type].time_us += time_us;
+    ipc_ctx->parse_stats[file_type].thumbnail_count += thumbnail_count;
+    ipc_ctx->parse_stats[file_type].alloc_count += arena->alloc_count;
+    ipc_ctx->parse_stats[file_type].alloc_bytes += arena->alloc_bytes;
+    ipc_ctx->parse_stats[file_type].heap_alloc_count += arena->block_count;
+
+    if (file_type == FILETYPE_MEDIA && mime != 0) {
+        media_stats_add(ipc_ctx, mime, time_us);
+    }
+    pthread_mutex_unlock(&ipc_ctx->mutex);
+}
+
+/**
+ * Log the number of files and the average parse time for each file type.
+ * Note that the time of an archive includes the time spent on its children.
+ */
+void parse_log_stats(database_ipc_ctx_t *ipc_ctx) {
+    for (int i = 0; i < sizeof(FileTypeNames) / sizeof(FileTypeNames[0]); i++) {
+        parse_stats_t *stats = &ipc_ctx->parse_stats[i];
+        if (stats->count == 0) {
+            continue;
+        }
+
+        LOG_INFOF("parse.c", "%-8s %10ld files, %10.3f ms/file, total %.1f s",
+                  FileTypeNames[i], stats->count,
+                  (double) stats->time_us / (double) stats->count / 1000.0,
+                  (double) stats->time_us / 1000000.0);
+
+        if (stats->thumbnail_count > 0) {
+            LOG_INFOF("parse.c", "%-8s %10ld thumbnails, %10.1f thumbnails/s per thread",
+                      FileTypeNames[i], stats->thumbnail_count,
+                      (double) stats->thumbnail_count / ((double) stats->time_us / 1000000.0));
+        }
+
+        LOG_INFOF("parse.c", "%-8s %10.1f allocations/file, %10.1f KiB/file, %ld heap allocations",
+                  FileTypeNames[i], (double) stats->alloc_count / (double) stats->count,
+                  (double) stats->alloc_bytes / (double) stats->count / 1024.0,
+                  stats->heap_alloc_count);
+    }
+
+    for (int i = 0; i < MEDIA_STATS_SIZE; i++) {
+        media_stats_t *stats = &ipc_ctx->media_stats[i];
+        if (stats->count == 0) {
+            continue;
+        }
+
+        LOG_INFOF("parse.c", "%-24s %10ld files, %10.3f ms/file, total %.1f s",
+                  mime_get_mime_text(stats->mime), stats->count,
+                  (double) stats->time_us / (double) stats->count / 1000.0,
+                  (double) stats->time_us / 1000000.0);
+    }
+}
+
 void parse(parse_job_t *job) {
 
     if (job->vfile.is_fs_file) {
@@ -146,9 +228,11 @@ void parse(parse_job_t *job) {
         SET_CURRENT_JOB(ProcData.ipc_db->ipc_ctx, job->filepath);
     }
 
-    document_t *doc = malloc(sizeof(document_t));
+    scan_arena_init(&job->arena);
+    document_t *doc = scan_arena_alloc(&job->arena, sizeof(document_t));
+    doc->arena = &job->arena;
 
-    strcpy(doc->filepath, job->filepath);
+    doc->filepath = job->filepath;
     doc->ext = job->ext;
     doc->base = job->base;
     doc->meta_head = NULL;
@@ -157,22 +241,27 @@ void parse(parse_job_t *job) {
     doc->mtime = MAX(job->vfile.mtime, 0);
     doc->mime = get_mime(job);
     doc->thumbnail_count = 0;
-    strcpy(doc->parent, job->parent);
+    doc->parent = job->parent;
 
     if (doc->mime == GET_MIME_ERROR_FATAL) {
         CLOSE_FILE(job->vfile)
-        free(doc);
+        scan_arena_reset(&job->arena);
         return;
     }
 
     int document_exists = database_mark_document(ProcData.index_db, doc->filepath + ScanCtx.index.desc.root_len, doc->mtime);
     if (document_exists) {
         CLOSE_FILE(job->vfile)
-        free(doc);
+        scan_arena_reset(&job->arena);
         return;
     }
 
-    switch (get_file_type(doc->mime, doc->size, doc->filepath)) {
+    TIMER_INIT();
+    TIMER_START();
+
+    file_type_t file_type = get_file_type(doc->mime, doc->size, doc->filepath);
+
+    switch (file_type) {
         case FILETYPE_RAW:
             parse_raw(&ScanCtx.raw_ctx, &job->vfile, doc);
             break;
@@ -223,11 +312,19 @@ void parse(parse_job_t *job) {
 
     CLOSE_FILE(job->vfile)
 
+    long parse_time_us;
+    TIMER_END(parse_time_us);
+
     if (job->vfile.has_checksum) {
         char sha1_digest_str[SHA1_STR_LENGTH];
         buf2hex((unsigned char *) job->vfile.sha1_digest, SHA1_DIGEST_LENGTH, (char *) sha1_digest_str);
         APPEND_STR_META(doc, MetaChecksum, (const char *) sha1_digest_str);
     }
 
+    unsigned int mime = doc->mime;
+    int thumbnail_count = doc->thumbnail_count;
     write_document(doc);
+
+    parse_stats_add(file_type, mime, parse_time_us, thumbnail_count, &job->arena);
+    scan_arena_reset(&job->arena);
 }
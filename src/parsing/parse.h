@@ -7,4 +7,6 @@
 
 void parse(parse_job_t *arg);
 
+void parse_log_stats(database_ipc_ctx_t *ipc_ctx);
+
 #endif
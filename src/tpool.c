@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include "parsing/parse.h"
 
 #define BLANK_STR "                                         "
@@ -192,9 +193,13 @@ static void *tpool_worker(void *arg) {
 
         } else {
             int status;
-            waitpid(pid, &status, 0);
+            struct rusage usage;
+            wait4(pid, &status, 0, &usage);
 
             LOG_DEBUGF("tpool.c", "Child process terminated with status code %d", WEXITSTATUS(status));
+            // ru_maxrss is in KiB
+            LOG_INFOF("tpool.c", "Worker %d peak memory usage: %.1f MiB",
+                      ((start_thread_arg_t *) arg)->thread_id, (double) usage.ru_maxrss / 1024.0);
 
             pthread_mutex_lock(&(pool->shm->ipc_ctx.mutex));
             pool->shm->ipc_ctx.completed_job_count += 1;
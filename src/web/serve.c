@@ -147,7 +147,7 @@ void serve_chunk_vendors_css(struct mg_connection *nc, UNUSED(struct mg_http_mes
     web_serve_asset_chunk_vendors_css(nc);
 }
 
-void serve_thumbnail(struct mg_connection *nc, UNUSED(struct mg_http_message *hm), int index_id,
+void serve_thumbnail(struct mg_connection *nc, struct mg_http_message *hm, int index_id,
                      int doc_id, int arg_num) {
 
     database_t *db = web_get_database(index_id);
@@ -157,16 +157,47 @@ void serve_thumbnail(struct mg_connection *nc, UNUSED(struct mg_http_message *hm
         return;
     }
 
+    unsigned char hash[THUMBNAIL_HASH_LENGTH];
+    if (!database_read_thumbnail_hash(db, doc_id, arg_num, hash)) {
+        HTTP_REPLY_NOT_FOUND
+        return;
+    }
+
+    // Documents with the same thumbnail share the ETag, the browser only downloads it once
+    char etag[THUMBNAIL_HASH_LENGTH * 2 + 3];
+    etag[0] = '"';
+    buf2hex(hash, THUMBNAIL_HASH_LENGTH, etag + 1);
+    strcat(etag, "\"");
+
+    char headers[128];
+
+    struct mg_str *if_none_match = mg_http_get_header(hm, "If-None-Match");
+    if (if_none_match != NULL && mg_strcmp(*if_none_match, mg_str(etag)) == 0) {
+        snprintf(headers, sizeof(headers), HTTP_SERVER_HEADER "ETag: %s\r\n", etag);
+        mg_http_reply(nc, 304, headers, "");
+        return;
+    }
+
+    snprintf(headers, sizeof(headers),
+             "Content-Type: image/jpeg\r\n"
+             "Cache-Control: max-age=31536000\r\n"
+             "ETag: %s", etag);
+
     size_t data_len = 0;
 
-    void *data = database_read_thumbnail(db, doc_id, arg_num, &data_len);
+    // Thumbnails in a pack are sent from the mapped segment without an intermediate copy
+    const void *packed_data = database_thumbnail_pack_read(db, hash, &data_len);
+    if (packed_data != NULL) {
+        web_send_headers(nc, 200, data_len, headers);
+        mg_send(nc, packed_data, data_len);
+        nc->is_resp = 0;
+        return;
+    }
+
+    void *data = database_read_thumbnail(db, hash, &data_len);
 
     if (data_len != 0) {
-        web_send_headers(
-                nc, 200, data_len,
-                "Content-Type: image/jpeg\r\n"
-                "Cache-Control: max-age=31536000"
-        );
+        web_send_headers(nc, 200, data_len, headers);
         mg_send(nc, data, data_len);
         nc->is_resp = 0;
         free(data);
@@ -113,7 +113,8 @@ int arc_open(scan_arc_ctx_t *ctx, vfile_t *f, struct archive **a, arc_data_t *ar
             archive_read_add_passphrase(*a, ctx->passphrase);
         }
 
-        return archive_read_open_filename(*a, f->filepath, ARC_BUF_SIZE);
+        size_t block_size = ctx->block_size == 0 ? ARC_DEFAULT_BLOCK_SIZE : ctx->block_size;
+        return archive_read_open_filename(*a, f->filepath, block_size);
     } else if (allow_recurse) {
         *a = archive_read_new();
         archive_read_support_filter_all(*a);
@@ -169,7 +170,7 @@ scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre
         }
         dyn_buffer_write_char(&buf, '\0');
 
-        meta_line_t *meta_list = malloc(sizeof(meta_line_t) + buf.cur);
+        meta_line_t *meta_list = meta_line_alloc(doc, sizeof(meta_line_t) + buf.cur);
         meta_list->key = MetaContent;
         strcpy(meta_list->str_val, buf.buf);
         APPEND_META(doc, meta_list);
@@ -178,6 +179,8 @@ scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre
     } else {
 
         parse_job_t *sub_job = malloc(sizeof(parse_job_t));
+        sub_job->filepath = NULL;
+        size_t filepath_size = 0;
 
         sub_job->vfile.close = arc_close;
         sub_job->vfile.read = arc_read;
@@ -191,7 +194,7 @@ scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre
         sub_job->vfile.logf = ctx->logf;
         sub_job->vfile.has_checksum = FALSE;
         sub_job->vfile.calculate_checksum = f->calculate_checksum;
-        strcpy(sub_job->parent, doc->filepath);
+        sub_job->parent = doc->filepath;
 
         while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
             struct stat entry_stat = *archive_entry_stat(entry);
@@ -201,15 +204,17 @@ scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre
             if (S_ISREG(entry_stat.st_mode)) {
 
                 const char *utf8_name = archive_entry_pathname_utf8(entry);
+                const char *entry_name = utf8_name == NULL ? archive_entry_pathname(entry) : utf8_name;
 
-                if (utf8_name == NULL) {
-                    snprintf(sub_job->filepath, sizeof(sub_job->filepath), "%s#/%s", f->filepath,
-                             archive_entry_pathname(entry));
-                    strcpy(sub_job->vfile.filepath, sub_job->filepath);
-                } else {
-                    snprintf(sub_job->filepath, sizeof(sub_job->filepath), "%s#/%s", f->filepath, utf8_name);
-                    strcpy(sub_job->vfile.filepath, sub_job->filepath);
+                // The buffer is reused by all the entries of the archive
+                size_t filepath_len = MIN(strlen(f->filepath) + 2 + strlen(entry_name), SCAN_PATH_MAX);
+                if (filepath_len + 1 > filepath_size) {
+                    filepath_size = filepath_len + 1;
+                    sub_job->filepath = realloc(sub_job->filepath, filepath_size);
                 }
+                snprintf(sub_job->filepath, filepath_len + 1, "%s#/%s", f->filepath, entry_name);
+                sub_job->vfile.filepath = sub_job->filepath;
+
                 sub_job->base = (int) (strrchr(sub_job->filepath, '/') - sub_job->filepath) + 1;
 
                 double decompressed_size_ratio = (double) sub_job->vfile.st_size / (double) f->st_size;
@@ -250,6 +255,7 @@ scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre
             }
         }
 
+        free(sub_job->filepath);
         free(sub_job);
     }
 
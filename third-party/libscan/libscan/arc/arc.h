@@ -21,9 +21,12 @@ typedef struct {
     log_callback_t log;
     logf_callback_t logf;
     char passphrase[4096];
+    /** Size of the blocks handed to libarchive for archives on disk, 0 for the default */
+    size_t block_size;
 } scan_arc_ctx_t;
 
 #define ARC_BUF_SIZE 8192
+#define ARC_DEFAULT_BLOCK_SIZE (1024 * 1024)
 
 typedef struct {
     vfile_t *f;
@@ -7,15 +7,146 @@
 
 static scan_arc_ctx_t arc_ctx = (scan_arc_ctx_t) {.passphrase = {0,}};
 
-void parse_comic(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc) {
+#define COVER_FOUND 0
+#define COVER_NOT_FOUND 1
+#define COVER_NO_RANDOM_ACCESS 2
+
+static const char *get_entry_path(struct archive_entry *entry) {
+    const char *utf8_name = archive_entry_pathname_utf8(entry);
+    return utf8_name == NULL ? archive_entry_pathname(entry) : utf8_name;
+}
+
+static int is_cover_candidate(scan_comic_ctx_t *ctx, struct archive_entry *entry) {
+    if (!S_ISREG(archive_entry_stat(entry)->st_mode)) {
+        return FALSE;
+    }
+
+    const char *p = strrchr(get_entry_path(entry), '.');
+    if (p == NULL || (strcmp(p, ".png") != 0 && strcmp(p, ".jpg") != 0 && strcmp(p, ".jpeg") != 0)) {
+        return FALSE;
+    }
+
+    long max_cover_size = ctx->max_cover_size > 0 ? ctx->max_cover_size : COMIC_MAX_COVER_SIZE;
+    if (archive_entry_size_is_set(entry) && archive_entry_size(entry) > max_cover_size) {
+        CTX_LOG_DEBUGF(get_entry_path(entry), "Skipping comic page larger than %ldB", max_cover_size);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Zip and 7z archives have a central directory, the entries can be listed
+ * without decompressing them.
+ */
+static int has_random_access(struct archive *a) {
+    int format = archive_format(a) & ARCHIVE_FORMAT_BASE_MASK;
+    return format == ARCHIVE_FORMAT_ZIP || format == ARCHIVE_FORMAT_7ZIP;
+}
+
+static int archive_read_packet(void *opaque, uint8_t *buf, int buf_size) {
+    struct archive *a = opaque;
+
+    la_ssize_t ret = archive_read_data(a, buf, buf_size);
+    if (ret == 0) {
+        return AVERROR_EOF;
+    }
+    if (ret < 0) {
+        return AVERROR(EIO);
+    }
+    return (int) ret;
+}
+
+/**
+ * Decode the current archive entry straight from the archive stream.
+ */
+static int store_cover(scan_comic_ctx_t *ctx, struct archive *a, struct archive_entry *entry, document_t *doc) {
+    scan_media_ctx_t media_ctx = {
+            .tn_count = ctx->enable_tn ? 1 : 0,
+            .tn_size = ctx->tn_size,
+            .tn_qscale = ctx->tn_qscale,
+            .tn_compression = ctx->tn_compression,
+            .tesseract_lang = NULL,
+            .tesseract_path = NULL,
+            .read_subtitles = FALSE,
+            .max_media_buffer = 0,
+            .log = ctx->log,
+            .logf = ctx->logf,
+    };
+
+    return store_image_thumbnail_stream(&media_ctx, a, archive_read_packet, doc, get_entry_path(entry));
+}
+
+/**
+ * Find the first image in sorted name order by listing the archive entries.
+ * @param cover set to the path of the cover when COVER_FOUND is returned
+ */
+static int find_cover_path(scan_comic_ctx_t *ctx, vfile_t *f, char *cover) {
     struct archive *a = NULL;
     struct archive_entry *entry = NULL;
     arc_data_t arc_data;
 
-    if (!ctx->enable_tn) {
-        return;
+    int ret = arc_open(&arc_ctx, f, &a, &arc_data, FALSE);
+    if (ret != ARCHIVE_OK) {
+        CTX_LOG_ERRORF(f->filepath, "(cbr.c) [%d] %s", ret, archive_error_string(a));
+        archive_read_free(a);
+        return COVER_NOT_FOUND;
+    }
+
+    int found = FALSE;
+
+    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+        if (!has_random_access(a)) {
+            archive_read_free(a);
+            return COVER_NO_RANDOM_ACCESS;
+        }
+
+        if (is_cover_candidate(ctx, entry)) {
+            const char *path = get_entry_path(entry);
+            if (!found || strverscmp(path, cover) < 0) {
+                strncpy(cover, path, PATH_MAX);
+                cover[PATH_MAX - 1] = '\0';
+                found = TRUE;
+            }
+        }
+    }
+
+    archive_read_free(a);
+    return found ? COVER_FOUND : COVER_NOT_FOUND;
+}
+
+static int parse_comic_sorted(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc, const char *cover) {
+    struct archive *a = NULL;
+    struct archive_entry *entry = NULL;
+    arc_data_t arc_data;
+
+    int ret = arc_open(&arc_ctx, f, &a, &arc_data, FALSE);
+    if (ret != ARCHIVE_OK) {
+        CTX_LOG_ERRORF(f->filepath, "(cbr.c) [%d] %s", ret, archive_error_string(a));
+        archive_read_free(a);
+        return FALSE;
     }
 
+    int stored = FALSE;
+    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+        if (strcmp(get_entry_path(entry), cover) == 0) {
+            stored = store_cover(ctx, a, entry, doc);
+            break;
+        }
+    }
+
+    archive_read_free(a);
+    return stored;
+}
+
+/**
+ * Use the first image that can be decoded, in archive order.
+ */
+static void parse_comic_stream(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc) {
+    struct archive *a = NULL;
+    struct archive_entry *entry = NULL;
+    arc_data_t arc_data;
+
     int ret = arc_open(&arc_ctx, f, &a, &arc_data, TRUE);
     if (ret != ARCHIVE_OK) {
         CTX_LOG_ERRORF(f->filepath, "(cbr.c) [%d] %s", ret, archive_error_string(a));
@@ -24,47 +155,32 @@ void parse_comic(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc) {
     }
 
     while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-        struct stat info = *archive_entry_stat(entry);
-        if (S_ISREG(info.st_mode)) {
-            const char *utf8_name = archive_entry_pathname_utf8(entry);
-            const char *file_path = utf8_name == NULL ? archive_entry_pathname(entry) : utf8_name;
-
-            char *p = strrchr(file_path, '.');
-            if (p != NULL && (strcmp(p, ".png") == 0 || strcmp(p, ".jpg") == 0 || strcmp(p, ".jpeg") == 0)) {
-                size_t entry_size = archive_entry_size(entry);
-                void *buf = malloc(entry_size);
-                size_t read = archive_read_data(a, buf, entry_size);
-
-                if (read != entry_size) {
-                    const char *err_str = archive_error_string(a);
-                    if (err_str) {
-                        CTX_LOG_ERRORF("comic.c", "Error while reading entry: %s", err_str);
-                    }
-                    free(buf);
-                    break;
-                }
-
-                scan_media_ctx_t media_ctx = {
-                        .tn_count = ctx->enable_tn ? 1 : 0,
-                        .tn_size = ctx->tn_size,
-                        .tn_qscale = ctx->tn_qscale,
-                        .tesseract_lang = NULL,
-                        .tesseract_path = NULL,
-                        .read_subtitles = FALSE,
-                        .max_media_buffer = 0,
-                        .log = ctx->log,
-                        .logf = ctx->logf,
-                };
-
-                ret = store_image_thumbnail(&media_ctx, buf, entry_size, doc, file_path);
-                free(buf);
-
-                if (ret == TRUE) {
-                    break;
-                }
-            }
+        if (is_cover_candidate(ctx, entry) && store_cover(ctx, a, entry, doc) == TRUE) {
+            break;
         }
     }
 
     archive_read_free(a);
 }
+
+void parse_comic(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc) {
+
+    if (!ctx->enable_tn) {
+        return;
+    }
+
+    // Files inside archives cannot be opened twice
+    if (f->is_fs_file) {
+        char cover[PATH_MAX];
+        int ret = find_cover_path(ctx, f, cover);
+
+        if (ret == COVER_FOUND && parse_comic_sorted(ctx, f, doc, cover) == TRUE) {
+            return;
+        }
+        if (ret == COVER_NOT_FOUND) {
+            return;
+        }
+    }
+
+    parse_comic_stream(ctx, f, doc);
+}
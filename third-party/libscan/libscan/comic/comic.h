@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include "../ebook/ebook.h"
 
+#define COMIC_MAX_COVER_SIZE (1024 * 1024 * 15)
+
 typedef struct {
     log_callback_t log;
     logf_callback_t logf;
@@ -11,6 +13,9 @@ typedef struct {
     int enable_tn;
     int tn_size;
     int tn_qscale;
+    int tn_compression;
+    /** Larger pages are not considered for the cover, 0 for COMIC_MAX_COVER_SIZE */
+    long max_cover_size;
 
     unsigned int cbr_mime;
     unsigned int cbz_mime;
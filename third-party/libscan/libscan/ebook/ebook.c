@@ -6,29 +6,30 @@
 #include "../arc/arc.h"
 #include "../ocr/ocr.h"
 
-#if EBOOK_LOCKS
 #include <pthread.h>
-pthread_mutex_t Mutex;
-#endif
 
 __thread scan_ebook_ctx_t thread_ctx;
 
-static void my_fz_lock(UNUSED(void *user), int lock) {
-#if EBOOK_LOCKS
-    if (lock == FZ_LOCK_FREETYPE) {
-        pthread_mutex_lock(&Mutex);
-    }
-#endif
-}
+/**
+ * Long-lived context of the current worker. Each document is opened in a clone
+ * of this context, so the resource store, the font & colorspace contexts and
+ * the document handlers are shared between documents.
+ */
+static __thread fz_context *base_fzctx = NULL;
 
-static void my_fz_unlock(UNUSED(void *user), int lock) {
-#if EBOOK_LOCKS
-    if (lock == FZ_LOCK_FREETYPE) {
-        pthread_mutex_unlock(&Mutex);
-    }
-#endif
+// RGB24 -> YUV420p converter of the cover thumbnails, reused across documents
+static __thread struct SwsContext *cover_sws_ctx = NULL;
+
+#define EBOOK_PAGE_BATCH_SIZE 8
+#define EBOOK_PARALLEL_MIN_PAGES (EBOOK_PAGE_BATCH_SIZE * 4)
+
+static void my_fz_lock(void *user, int lock) {
+    pthread_mutex_lock(&((pthread_mutex_t *) user)[lock]);
 }
 
+static void my_fz_unlock(void *user, int lock) {
+    pthread_mutex_unlock(&((pthread_mutex_t *) user)[lock]);
+}
 
 int pixmap_is_blank(const fz_pixmap *pixmap) {
     int pixmap_size = pixmap->n * pixmap->w * pixmap->h;
@@ -121,7 +122,8 @@ int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_d
     // RGB24 -> YUV420p
     AVFrame *scaled_frame = av_frame_alloc();
 
-    struct SwsContext *sws_ctx = sws_getContext(
+    cover_sws_ctx = sws_getCachedContext(
+            cover_sws_ctx,
             pixmap->w, pixmap->h, AV_PIX_FMT_RGB24,
             pixmap->w, pixmap->h, AV_PIX_FMT_YUV420P,
             SIST_SWS_ALGO, 0, 0, 0
@@ -139,7 +141,7 @@ int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_d
     const uint8_t *in_data[1] = {samples,};
     int in_line_size[1] = {(int) pixmap->stride};
 
-    sws_scale(sws_ctx,
+    sws_scale(cover_sws_ctx,
               in_data, in_line_size,
               0, pixmap->h,
               scaled_frame->data, scaled_frame->linesize
@@ -149,25 +151,18 @@ int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_d
     scaled_frame->height = pixmap->h;
     scaled_frame->format = AV_PIX_FMT_YUV420P;
 
-    sws_freeContext(sws_ctx);
-
-    // YUV420p -> JPEG/WEBP
-    AVCodecContext *thumbnail_encoder = alloc_webp_encoder(pixmap->w, pixmap->h, ctx->tn_qscale);
-    avcodec_send_frame(thumbnail_encoder, scaled_frame);
-    avcodec_send_frame(thumbnail_encoder, NULL); // Send EOF
-
-    AVPacket thumbnail_packet;
-    av_init_packet(&thumbnail_packet);
-    avcodec_receive_packet(thumbnail_encoder, &thumbnail_packet);
+    // YUV420p -> WEBP
+    AVPacket *thumbnail_packet = encode_webp_thumbnail(scaled_frame, ctx->tn_qscale, ctx->tn_compression);
 
-    doc->thumbnail_count = 1;
-    APPEND_THUMBNAIL(doc, (char *) thumbnail_packet.data, thumbnail_packet.size);
+    if (thumbnail_packet != NULL) {
+        doc->thumbnail_count = 1;
+        APPEND_THUMBNAIL(doc, (char *) thumbnail_packet->data, thumbnail_packet->size);
+        av_packet_free(&thumbnail_packet);
+    }
 
     free(samples);
-    av_packet_unref(&thumbnail_packet);
     av_free(*scaled_frame->data);
     av_frame_free(&scaled_frame);
-    avcodec_free_context(&thumbnail_encoder);
 
     fz_drop_pixmap(fzctx, pixmap);
     fz_drop_page(fzctx, cover);
@@ -203,24 +198,50 @@ void fz_warn_callback(void *user, const char *message) {
     CTX_LOG_DEBUGF(doc->filepath, "FZ: %s", message);
 }
 
-static void init_fzctx(fz_context *fzctx, document_t *doc) {
-    fz_register_document_handlers(fzctx);
+static fz_context *get_base_fzctx(scan_ebook_ctx_t *ctx) {
+    if (base_fzctx != NULL) {
+        return base_fzctx;
+    }
+
+    // Cloned contexts require working locks
+    pthread_mutex_t *mutexes = malloc(sizeof(pthread_mutex_t) * FZ_LOCK_MAX);
+    for (int i = 0; i < FZ_LOCK_MAX; i++) {
+        pthread_mutex_init(&mutexes[i], NULL);
+    }
 
-#if EBOOK_LOCKS
-    static int mu_is_initialized = FALSE;
-    if (!mu_is_initialized) {
-        pthread_mutex_init(&Mutex, NULL);
-        mu_is_initialized = TRUE;
+    fz_locks_context locks = {
+            .user = mutexes,
+            .lock = my_fz_lock,
+            .unlock = my_fz_unlock,
+    };
+
+    base_fzctx = fz_new_context(NULL, &locks, ctx->store_size > 0 ? ctx->store_size : FZ_STORE_DEFAULT);
+    if (base_fzctx == NULL) {
+        free(mutexes);
+        return NULL;
+    }
+
+    fz_register_document_handlers(base_fzctx);
+
+    return base_fzctx;
+}
+
+static fz_context *new_fzctx(fz_context *base, document_t *doc) {
+    if (base == NULL) {
+        return NULL;
+    }
+
+    fz_context *fzctx = fz_clone_context(base);
+    if (fzctx == NULL) {
+        return NULL;
     }
-#endif
 
     fzctx->warn.print_user = doc;
     fzctx->warn.print = fz_warn_callback;
     fzctx->error.print_user = doc;
     fzctx->error.print = fz_err_callback;
 
-    fzctx->locks.lock = my_fz_lock;
-    fzctx->locks.unlock = my_fz_unlock;
+    return fzctx;
 }
 
 static int read_stext_block(fz_stext_block *block, text_buffer_t *tex) {
@@ -287,13 +308,309 @@ fz_device *new_stext_dev(fz_context *fzctx, fz_stext_page *stext) {
     return stext_dev;
 }
 
+/**
+ * Append the text of a page to tex, with OCR if the page has no text.
+ * @return 0 on success, MuPDF error code otherwise
+ */
+static int read_page_text(scan_ebook_ctx_t *ctx, fz_context *fzctx, fz_document *fzdoc, document_t *doc,
+                          int current_page, text_buffer_t *tex) {
+    fz_page *page = NULL;
+    int err = load_page(fzctx, fzdoc, current_page, &page);
+
+    if (err != 0) {
+        CTX_LOG_WARNINGF(doc->filepath, "fz_load_page() returned error code [%d] %s", err, fzctx->error.message);
+        fz_drop_page(fzctx, page);
+        return err;
+    }
+    fz_rect page_mediabox = fz_bound_page(fzctx, page);
+
+    fz_stext_page *stext = fz_new_stext_page(fzctx, page_mediabox);
+    fz_device *stext_dev = new_stext_dev(fzctx, stext);
+
+    fz_var(err);
+    fz_try(fzctx)fz_run_page(fzctx, page, stext_dev, fz_identity, NULL);
+    fz_always(fzctx) {
+            fz_close_device(fzctx, stext_dev);
+            fz_drop_device(fzctx, stext_dev);
+        } fz_catch(fzctx) err = fzctx->error.errcode;
+
+    if (err != 0) {
+        CTX_LOG_WARNINGF(doc->filepath, "fz_run_page() returned error code [%d] %s", err, fzctx->error.message);
+        fz_drop_page(fzctx, page);
+        fz_drop_stext_page(fzctx, stext);
+        return err;
+    }
+
+    int num_blocks_read = read_stext(tex, stext);
+
+    fz_drop_stext_page(fzctx, stext);
+
+    if (tex->dyn_buffer.cur >= ctx->content_size) {
+        fz_drop_page(fzctx, page);
+        return 0;
+    }
+
+    // If OCR is enabled and no text is found on the page
+    if (ctx->tesseract_lang != NULL && num_blocks_read == 0) {
+        stext = fz_new_stext_page(fzctx, page_mediabox);
+        stext_dev = new_stext_dev(fzctx, stext);
+
+        fz_device *ocr_dev = fz_new_ocr_device(fzctx, stext_dev, fz_identity,
+                                               page_mediabox, TRUE,
+                                               ctx->tesseract_lang,
+                                               ctx->tesseract_path,
+                                               NULL, NULL);
+
+        fz_var(err);
+        fz_try(fzctx)fz_run_page(fzctx, page, ocr_dev, fz_identity, NULL);
+        fz_always(fzctx) {
+                fz_close_device(fzctx, ocr_dev);
+                fz_drop_device(fzctx, ocr_dev);
+            } fz_catch(fzctx) err = fzctx->error.errcode;
+
+        if (err != 0) {
+            CTX_LOG_WARNINGF(doc->filepath, "fz_run_page() returned error code [%d] %s", err, fzctx->error.message);
+            fz_close_device(fzctx, stext_dev);
+            fz_drop_device(fzctx, stext_dev);
+            fz_drop_page(fzctx, page);
+            fz_drop_stext_page(fzctx, stext);
+            return err;
+        }
+
+        fz_close_device(fzctx, stext_dev);
+        fz_drop_device(fzctx, stext_dev);
+
+        read_stext(tex, stext);
+        fz_drop_stext_page(fzctx, stext);
+    }
+
+    fz_drop_page(fzctx, page);
+    return 0;
+}
+
+static void append_content_meta(document_t *doc, text_buffer_t *tex) {
+    text_buffer_terminate_string(tex);
+
+    meta_line_t *meta_content = meta_line_alloc(doc, sizeof(meta_line_t) + tex->dyn_buffer.cur);
+    meta_content->key = MetaContent;
+    memcpy(meta_content->str_val, tex->dyn_buffer.buf, tex->dyn_buffer.cur);
+    APPEND_META(doc, meta_content);
+}
+
+static void read_text(scan_ebook_ctx_t *ctx, fz_context *fzctx, fz_document *fzdoc, document_t *doc, int page_count) {
+    text_buffer_t tex = text_buffer_create(ctx->content_size);
+
+    for (int current_page = 0; current_page < page_count; current_page++) {
+        if (read_page_text(ctx, fzctx, fzdoc, doc, current_page, &tex) != 0) {
+            text_buffer_destroy(&tex);
+            return;
+        }
+
+        if (tex.dyn_buffer.cur >= ctx->content_size) {
+            break;
+        }
+    }
+
+    append_content_meta(doc, &tex);
+    text_buffer_destroy(&tex);
+}
+
+/**
+ * Shared state of the threads extracting the text of a single document.
+ * Pages are handed out in small batches, in order, so that the text can be
+ * concatenated in page order and extraction can stop as soon as the
+ * completed batches at the start of the document hold content_size bytes.
+ * Extraction stops at the first page that cannot be read, the text of the
+ * pages before it is kept.
+ */
+typedef struct {
+    scan_ebook_ctx_t *ctx;
+    fz_context *base_fzctx;
+    document_t *doc;
+    void *buf;
+    size_t buf_len;
+    const char *mime_str;
+
+    int page_count;
+    int batch_count;
+    text_buffer_t *batches;
+    int *batch_done;
+
+    pthread_mutex_t mutex;
+    int next_batch;
+    int completed_prefix;
+    long completed_prefix_size;
+    /** First batch with a page that could not be read, batch_count if none */
+    int failed_batch;
+    int stop;
+    /** Set when a thread could not open the document */
+    int err;
+} page_pool_t;
+
+static void page_pool_complete_batch(page_pool_t *pool, int batch, int err) {
+    pthread_mutex_lock(&pool->mutex);
+
+    pool->batch_done[batch] = TRUE;
+    if (err != 0) {
+        // Batches are handed out in order, all the batches before this one are already being read
+        pool->failed_batch = MIN(pool->failed_batch, batch);
+        pool->stop = TRUE;
+    }
+
+    // The failed batch holds the text of the pages before the error
+    while (pool->completed_prefix <= pool->failed_batch && pool->completed_prefix < pool->batch_count
+           && pool->batch_done[pool->completed_prefix]) {
+        pool->completed_prefix_size += (long) pool->batches[pool->completed_prefix].dyn_buffer.cur;
+        pool->completed_prefix += 1;
+    }
+    if (pool->completed_prefix_size >= pool->ctx->content_size) {
+        pool->stop = TRUE;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Stop the other threads when a thread could not open the document
+ */
+static void page_pool_fail(page_pool_t *pool, int err) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->err = err;
+    pool->stop = TRUE;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *page_pool_worker(void *arg) {
+    page_pool_t *pool = arg;
+
+    // Used by the MuPDF error callbacks
+    thread_ctx = *pool->ctx;
+
+    fz_context *fzctx = new_fzctx(pool->base_fzctx, pool->doc);
+    if (fzctx == NULL) {
+        page_pool_fail(pool, -1);
+        return NULL;
+    }
+
+    // Documents cannot be shared between threads, each thread opens its own
+    int err = 0;
+    fz_document *fzdoc = NULL;
+    fz_stream *stream = NULL;
+    fz_var(fzdoc);
+    fz_var(stream);
+    fz_var(err);
+
+    fz_try(fzctx) {
+                stream = fz_open_memory(fzctx, pool->buf, pool->buf_len);
+                fzdoc = fz_open_document_with_stream(fzctx, pool->mime_str, stream);
+            } fz_catch(fzctx)err = fzctx->error.errcode;
+
+    if (err != 0) {
+        page_pool_fail(pool, err);
+    }
+
+    while (err == 0) {
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->stop || pool->next_batch == pool->batch_count) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        int batch = pool->next_batch++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        text_buffer_t *tex = &pool->batches[batch];
+        *tex = text_buffer_create(pool->ctx->content_size);
+
+        int first_page = batch * EBOOK_PAGE_BATCH_SIZE;
+        int last_page = MIN(first_page + EBOOK_PAGE_BATCH_SIZE, pool->page_count);
+
+        int batch_err = 0;
+        for (int current_page = first_page; current_page < last_page; current_page++) {
+            batch_err = read_page_text(pool->ctx, fzctx, fzdoc, pool->doc, current_page, tex);
+            if (batch_err != 0 || tex->dyn_buffer.cur >= pool->ctx->content_size) {
+                break;
+            }
+        }
+
+        page_pool_complete_batch(pool, batch, batch_err);
+    }
+
+    fz_drop_stream(fzctx, stream);
+    fz_drop_document(fzctx, fzdoc);
+    fz_drop_context(fzctx);
+
+    return NULL;
+}
+
+/**
+ * @return the error of a thread that could not open the document, nothing is
+ *         appended to the document in that case
+ */
+static int read_text_parallel(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len,
+                              const char *mime_str, document_t *doc, int page_count) {
+
+    page_pool_t pool = {
+            .ctx = ctx,
+            .base_fzctx = get_base_fzctx(ctx),
+            .doc = doc,
+            .buf = buf,
+            .buf_len = buf_len,
+            .mime_str = mime_str,
+            .page_count = page_count,
+            .batch_count = (page_count + EBOOK_PAGE_BATCH_SIZE - 1) / EBOOK_PAGE_BATCH_SIZE,
+    };
+    pool.failed_batch = pool.batch_count;
+    pool.batches = calloc(pool.batch_count, sizeof(text_buffer_t));
+    pool.batch_done = calloc(pool.batch_count, sizeof(int));
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    int thread_count = MIN(ctx->page_threads, pool.batch_count);
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, page_pool_worker, &pool);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (pool.err == 0 && pool.completed_prefix > 0) {
+        text_buffer_t tex = text_buffer_create(ctx->content_size);
+
+        for (int i = 0; i < pool.completed_prefix; i++) {
+            if (text_buffer_append_string(&tex, pool.batches[i].dyn_buffer.buf,
+                                          pool.batches[i].dyn_buffer.cur) == TEXT_BUF_FULL) {
+                break;
+            }
+        }
+
+        append_content_meta(doc, &tex);
+        text_buffer_destroy(&tex);
+    }
+
+    for (int i = 0; i < pool.batch_count; i++) {
+        if (pool.batches[i].dyn_buffer.buf != NULL) {
+            text_buffer_destroy(&pool.batches[i]);
+        }
+    }
+    free(pool.batches);
+    free(pool.batch_done);
+    free(threads);
+    pthread_mutex_destroy(&pool.mutex);
+
+    return pool.err;
+}
+
 void
 parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mime_str, document_t *doc, int tn_only) {
 
-    fz_context *fzctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
     thread_ctx = *ctx;
 
-    init_fzctx(fzctx, doc);
+    fz_context *fzctx = new_fzctx(get_base_fzctx(ctx), doc);
+    if (fzctx == NULL) {
+        CTX_LOG_ERROR(doc->filepath, "Could not create MuPDF context");
+        return;
+    }
 
     int err = 0;
 
@@ -364,102 +681,18 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
 
 
     if (ctx->content_size > 0) {
-        text_buffer_t tex = text_buffer_create(ctx->content_size);
-
-        for (int current_page = 0; current_page < page_count; current_page++) {
-            fz_page *page = NULL;
-            err = load_page(fzctx, fzdoc, current_page, &page);
-
-            if (err != 0) {
-                CTX_LOG_WARNINGF(doc->filepath,
-                                 "fz_load_page() returned error code [%d] %s", err, fzctx->error.message);
-                text_buffer_destroy(&tex);
-                fz_drop_page(fzctx, page);
-                fz_drop_stream(fzctx, stream);
-                fz_drop_document(fzctx, fzdoc);
-                fz_drop_context(fzctx);
-                return;
-            }
-            fz_rect page_mediabox = fz_bound_page(fzctx, page);
-
-            fz_stext_page *stext = fz_new_stext_page(fzctx, page_mediabox);
-            fz_device *stext_dev = new_stext_dev(fzctx, stext);
-
-            fz_var(err);
-            fz_try(fzctx)fz_run_page(fzctx, page, stext_dev, fz_identity, NULL);
-            fz_always(fzctx) {
-                    fz_close_device(fzctx, stext_dev);
-                    fz_drop_device(fzctx, stext_dev);
-                } fz_catch(fzctx) err = fzctx->error.errcode;
-
-            if (err != 0) {
-                CTX_LOG_WARNINGF(doc->filepath, "fz_run_page() returned error code [%d] %s", err, fzctx->error.message);
-                text_buffer_destroy(&tex);
-                fz_drop_page(fzctx, page);
-                fz_drop_stext_page(fzctx, stext);
-                fz_drop_stream(fzctx, stream);
-                fz_drop_document(fzctx, fzdoc);
-                fz_drop_context(fzctx);
-                return;
-            }
-
-            int num_blocks_read = read_stext(&tex, stext);
-
-            fz_drop_stext_page(fzctx, stext);
-
-            if (tex.dyn_buffer.cur >= ctx->content_size) {
-                fz_drop_page(fzctx, page);
-                break;
+        int text_err = -1;
+        if (ctx->page_threads > 1 && page_count >= EBOOK_PARALLEL_MIN_PAGES) {
+            text_err = read_text_parallel(ctx, buf, buf_len, mime_str, doc, page_count);
+            if (text_err != 0) {
+                CTX_LOG_WARNINGF(doc->filepath, "Parallel text extraction failed (%d), using a single thread",
+                                 text_err);
             }
-
-            // If OCR is enabled and no text is found on the page
-            if (ctx->tesseract_lang != NULL && num_blocks_read == 0) {
-                stext = fz_new_stext_page(fzctx, page_mediabox);
-                stext_dev = new_stext_dev(fzctx, stext);
-
-                fz_device *ocr_dev = fz_new_ocr_device(fzctx, stext_dev, fz_identity,
-                                                       page_mediabox, TRUE,
-                                                       ctx->tesseract_lang,
-                                                       ctx->tesseract_path,
-                                                       NULL, NULL);
-
-                fz_var(err);
-                fz_try(fzctx)fz_run_page(fzctx, page, ocr_dev, fz_identity, NULL);
-                fz_always(fzctx) {
-                        fz_close_device(fzctx, ocr_dev);
-                        fz_drop_device(fzctx, ocr_dev);
-                    } fz_catch(fzctx) err = fzctx->error.errcode;
-
-                if (err != 0) {
-                    CTX_LOG_WARNINGF(doc->filepath, "fz_run_page() returned error code [%d] %s", err, fzctx->error.message);
-                    fz_close_device(fzctx, stext_dev);
-                    fz_drop_device(fzctx, stext_dev);
-                    text_buffer_destroy(&tex);
-                    fz_drop_page(fzctx, page);
-                    fz_drop_stext_page(fzctx, stext);
-                    fz_drop_stream(fzctx, stream);
-                    fz_drop_document(fzctx, fzdoc);
-                    fz_drop_context(fzctx);
-                    return;
-                }
-
-                fz_close_device(fzctx, stext_dev);
-                fz_drop_device(fzctx, stext_dev);
-
-                read_stext(&tex, stext);
-                fz_drop_stext_page(fzctx, stext);
-            }
-
-            fz_drop_page(fzctx, page);
         }
-        text_buffer_terminate_string(&tex);
-
-        meta_line_t *meta_content = malloc(sizeof(meta_line_t) + tex.dyn_buffer.cur);
-        meta_content->key = MetaContent;
-        memcpy(meta_content->str_val, tex.dyn_buffer.buf, tex.dyn_buffer.cur);
-        APPEND_META(doc, meta_content);
 
-        text_buffer_destroy(&tex);
+        if (text_err != 0) {
+            read_text(ctx, fzctx, fzdoc, doc, page_count);
+        }
     }
 
     fz_drop_stream(fzctx, stream);
@@ -521,7 +754,7 @@ void parse_epub_fast(scan_ebook_ctx_t *ctx, vfile_t *f, document_t *doc) {
 
     text_buffer_terminate_string(&content_buffer);
 
-    meta_line_t *meta_content = malloc(sizeof(meta_line_t) + content_buffer.dyn_buffer.cur);
+    meta_line_t *meta_content = meta_line_alloc(doc, sizeof(meta_line_t) + content_buffer.dyn_buffer.cur);
     meta_content->key = MetaContent;
     memcpy(meta_content->str_val, content_buffer.dyn_buffer.buf, content_buffer.dyn_buffer.cur);
     APPEND_META(doc, meta_content);
@@ -14,6 +14,11 @@ typedef struct {
     logf_callback_t logf;
     int fast_epub_parse;
     int tn_qscale;
+    int tn_compression;
+    /** Size of the MuPDF resource store shared by all documents of a worker, 0 for default */
+    size_t store_size;
+    /** Number of threads extracting the text of large documents, <= 1 to disable */
+    int page_threads;
 } scan_ebook_ctx_t;
 
 void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, document_t *doc);
@@ -171,7 +171,7 @@ void parse_font(scan_font_ctx_t *ctx, vfile_t *f, document_t *doc) {
         snprintf(font_name, sizeof(font_name), "%s %s", face->family_name, face->style_name);
     }
 
-    meta_line_t *meta_name = malloc(sizeof(meta_line_t) + strlen(font_name));
+    meta_line_t *meta_name = meta_line_alloc(doc, sizeof(meta_line_t) + strlen(font_name));
     meta_name->key = MetaFontName;
     strcpy(meta_name->str_val, font_name);
     APPEND_META(doc, meta_name);
@@ -1,119 +1,294 @@
 #include "json.h"
-#include "cjson/cJSON.h"
 
 
-#define JSON_MAX_FILE_SIZE (1024 * 1024 * 50)
+#define JSON_CHUNK_SIZE (1024 * 64)
+#define JSON_MAX_DEPTH 1000
+// Longest sequence that must be visible at once (surrogate pair escape)
+#define JSON_LOOKAHEAD 12
 
-int json_extract_text(cJSON *json, text_buffer_t *tex) {
-    if (cJSON_IsObject(json)) {
-        for (cJSON *child = json->child; child != NULL; child = child->next) {
-            if (json_extract_text(child, tex)) {
-                return TRUE;
-            }
-        }
-    } else if (cJSON_IsArray(json)) {
-        cJSON *child;
-        cJSON_ArrayForEach(child, json) {
-            if (json_extract_text(child, tex)) {
-                return TRUE;
-            }
-        }
-    } else if (cJSON_IsString(json)) {
-        if (text_buffer_append_string0(tex, json->valuestring) == TEXT_BUF_FULL) {
-            return TRUE;
-        }
-        if (text_buffer_append_char(tex, ' ') == TEXT_BUF_FULL) {
-            return TRUE;
+#define JSON_ERR_DEPTH (-2)
+
+/**
+ * Streaming tokenizer that only keeps track of what is needed to tell
+ * string values apart from object keys.
+ */
+typedef struct {
+    int in_string;
+    int in_key;
+    int expect_key;
+    int depth;
+    unsigned char object_stack[JSON_MAX_DEPTH / 8 + 1];
+} json_tokenizer_t;
+
+static int json_stack_push(json_tokenizer_t *t, int is_object) {
+    if (t->depth == JSON_MAX_DEPTH) {
+        return JSON_ERR_DEPTH;
+    }
+
+    if (is_object) {
+        t->object_stack[t->depth / 8] |= (1 << (t->depth % 8));
+    } else {
+        t->object_stack[t->depth / 8] &= ~(1 << (t->depth % 8));
+    }
+    t->depth += 1;
+
+    return 0;
+}
+
+static int json_stack_top_is_object(json_tokenizer_t *t) {
+    if (t->depth == 0) {
+        return FALSE;
+    }
+    return (t->object_stack[(t->depth - 1) / 8] >> ((t->depth - 1) % 8)) & 1;
+}
+
+static int json_parse_hex4(const char *str, int *out) {
+    int value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = str[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            value |= (c | 0x20) - 'a' + 10;
+        } else {
+            return FALSE;
         }
     }
 
-    return FALSE;
+    *out = value;
+    return TRUE;
 }
 
-scan_code_t parse_json(scan_json_ctx_t *ctx, vfile_t *f, document_t *doc) {
+/**
+ * Decode the escape sequence at ptr (which points to the backslash)
+ * @param c set to the decoded code point, or 0 if the sequence is invalid
+ * @return pointer to the first byte after the escape sequence
+ */
+static const char *json_decode_escape(const char *ptr, const char *end, int *c) {
+    *c = 0;
 
-    if (f->st_size > JSON_MAX_FILE_SIZE) {
-        CTX_LOG_WARNINGF("json.c", "File larger than maximum allowed [%s]", f->filepath);
-        return SCAN_ERR_SKIP;
+    if (end - ptr < 2) {
+        return end;
     }
 
-    size_t buf_len;
-    char *buf = read_all(f, &buf_len);
+    switch (ptr[1]) {
+        case '"':
+        case '\\':
+        case '/':
+            *c = ptr[1];
+            return ptr + 2;
+        case 'b':
+            *c = '\b';
+            return ptr + 2;
+        case 'f':
+            *c = '\f';
+            return ptr + 2;
+        case 'n':
+            *c = '\n';
+            return ptr + 2;
+        case 'r':
+            *c = '\r';
+            return ptr + 2;
+        case 't':
+            *c = '\t';
+            return ptr + 2;
+        case 'u':
+            break;
+        default:
+            return ptr + 2;
+    }
 
-    if (buf == NULL) {
-        return SCAN_ERR_READ;
+    int code_point;
+    if (end - ptr < 6 || !json_parse_hex4(ptr + 2, &code_point)) {
+        return MIN(ptr + 2, end);
     }
 
-    buf_len += 1;
-    buf = realloc(buf, buf_len);
-    *(buf + buf_len - 1) = '\0';
+    if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+        return ptr + 6;
+    }
 
-    cJSON *json = cJSON_ParseWithOpts(buf, NULL, TRUE);
-    text_buffer_t tex = text_buffer_create(ctx->content_size);
+    if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+        int low;
+        if (end - ptr < 12 || ptr[6] != '\\' || ptr[7] != 'u' || !json_parse_hex4(ptr + 8, &low)
+            || low < 0xDC00 || low > 0xDFFF) {
+            return ptr + 6;
+        }
 
-    json_extract_text(json, &tex);
-    text_buffer_terminate_string(&tex);
+        *c = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+        return ptr + 12;
+    }
 
-    APPEND_STR_META(doc, MetaContent, tex.dyn_buffer.buf);
+    *c = code_point;
+    return ptr + 6;
+}
 
-    cJSON_Delete(json);
-    free(buf);
-    text_buffer_destroy(&tex);
+/**
+ * Append the string values of a chunk of JSON to tex. Object keys are skipped.
+ *
+ * The tokenizer state is kept across calls. Bytes that could not be interpreted
+ * yet (a partial escape or UTF-8 sequence at the end of the chunk) are not
+ * consumed and must be passed again at the start of the next chunk.
+ *
+ * @return number of bytes consumed, TEXT_BUF_FULL or JSON_ERR_DEPTH
+ */
+static long json_extract_text_chunk(json_tokenizer_t *t, text_buffer_t *tex, const char *chunk, size_t len, int eof) {
 
-    return SCAN_OK;
+    const char *ptr = chunk;
+    const char *end = chunk + len;
+
+    while (ptr < end) {
+        if (t->in_string) {
+            const char *quote = memchr(ptr, '"', end - ptr);
+            const char *run_end = quote == NULL ? end : quote;
+            const char *backslash = memchr(ptr, '\\', run_end - ptr);
+            if (backslash != NULL) {
+                run_end = backslash;
+            }
+
+            if (run_end == end && !eof) {
+                if (end - ptr < JSON_LOOKAHEAD) {
+                    break;
+                }
+                run_end -= utf8_incomplete_suffix(ptr, end - ptr);
+            }
+
+            if (run_end != ptr) {
+                if (!t->in_key && text_buffer_append_string(tex, ptr, run_end - ptr) == TEXT_BUF_FULL) {
+                    return TEXT_BUF_FULL;
+                }
+                ptr = run_end;
+            }
+
+            if (ptr == end || (*ptr != '"' && *ptr != '\\')) {
+                // Incomplete UTF-8 sequence
+                break;
+            }
+
+            if (*ptr == '"') {
+                t->in_string = FALSE;
+                ptr += 1;
+
+                if (!t->in_key && text_buffer_append_char(tex, ' ') == TEXT_BUF_FULL) {
+                    return TEXT_BUF_FULL;
+                }
+                continue;
+            }
+
+            if (end - ptr < JSON_LOOKAHEAD && !eof) {
+                break;
+            }
+
+            int c;
+            ptr = json_decode_escape(ptr, end, &c);
+            if (!t->in_key && c != 0 && text_buffer_append_char(tex, c) == TEXT_BUF_FULL) {
+                return TEXT_BUF_FULL;
+            }
+            continue;
+        }
+
+        switch (*ptr) {
+            case '"':
+                t->in_string = TRUE;
+                t->in_key = t->expect_key;
+                break;
+            case '{':
+                if (json_stack_push(t, TRUE) == JSON_ERR_DEPTH) {
+                    return JSON_ERR_DEPTH;
+                }
+                t->expect_key = TRUE;
+                break;
+            case '[':
+                if (json_stack_push(t, FALSE) == JSON_ERR_DEPTH) {
+                    return JSON_ERR_DEPTH;
+                }
+                t->expect_key = FALSE;
+                break;
+            case '}':
+            case ']':
+                if (t->depth > 0) {
+                    t->depth -= 1;
+                }
+                t->expect_key = FALSE;
+                break;
+            case ':':
+                t->expect_key = FALSE;
+                break;
+            case ',':
+                t->expect_key = json_stack_top_is_object(t);
+                break;
+            default:
+                break;
+        }
+        ptr += 1;
+    }
+
+    return eof ? (long) len : ptr - chunk;
 }
 
-#define JSON_BUF_SIZE (1024 * 1024 * 5)
+/**
+ * Single pass over the file, works for both JSON and NDJSON (a sequence of
+ * top-level values is tokenized the same way as a single one).
+ */
+static scan_code_t parse_json_stream(scan_json_ctx_t *ctx, vfile_t *f, document_t *doc) {
 
-scan_code_t parse_ndjson(scan_json_ctx_t *ctx, vfile_t *f, document_t *doc) {
+    if (ctx->content_size <= 0) {
+        return SCAN_OK;
+    }
 
-    char *buf = calloc(JSON_BUF_SIZE + 1, sizeof(char));
-    *(buf + JSON_BUF_SIZE) = '\0';
+    char *buf = malloc(JSON_CHUNK_SIZE);
+    size_t buf_len = 0;
+    size_t total_read = 0;
 
     text_buffer_t tex = text_buffer_create(ctx->content_size);
-
-    size_t ret;
-    int eof = FALSE;
-    const char *parse_end = buf;
-    size_t to_read;
-    char *ptr = buf;
+    json_tokenizer_t tokenizer = {0};
 
     while (TRUE) {
-        cJSON *json;
+        size_t to_read = MIN(JSON_CHUNK_SIZE - buf_len, f->st_size - total_read);
 
-        if (!eof) {
-            to_read = parse_end == buf ? JSON_BUF_SIZE : parse_end - buf;
-            ret = f->read(f, ptr, to_read);
-            if (ret != to_read) {
-                eof = TRUE;
+        int ret = 0;
+        if (to_read > 0) {
+            ret = f->read(f, buf + buf_len, to_read);
+            if (ret < 0) {
+                CTX_LOG_ERRORF(doc->filepath, "read() returned error code: [%d]", ret);
+                free(buf);
+                text_buffer_destroy(&tex);
+                return SCAN_ERR_READ;
             }
         }
 
-        json = cJSON_ParseWithOpts(buf, &parse_end, FALSE);
+        total_read += ret;
+        buf_len += ret;
+        int eof = ret == 0;
 
-        if (parse_end == buf + JSON_BUF_SIZE) {
-            CTX_LOG_ERRORF("json.c", "Line too large for buffer [%s]", doc->filepath);
-            cJSON_Delete(json);
+        long consumed = json_extract_text_chunk(&tokenizer, &tex, buf, buf_len, eof);
+        if (consumed == JSON_ERR_DEPTH) {
+            CTX_LOG_WARNINGF(doc->filepath, "JSON nesting deeper than %d levels", JSON_MAX_DEPTH);
             break;
         }
-
-        if (parse_end == buf) {
-            cJSON_Delete(json);
+        if (consumed == TEXT_BUF_FULL || eof) {
             break;
         }
 
-        json_extract_text(json, &tex);
-
-        cJSON_Delete(json);
-
-        memmove(buf, parse_end, (buf + JSON_BUF_SIZE - parse_end));
-        ptr = buf + JSON_BUF_SIZE - parse_end + buf;
+        // Keep the unconsumed tail for the next chunk
+        buf_len -= consumed;
+        memmove(buf, buf + consumed, buf_len);
     }
-
     text_buffer_terminate_string(&tex);
 
     APPEND_STR_META(doc, MetaContent, tex.dyn_buffer.buf);
 
     free(buf);
     text_buffer_destroy(&tex);
+
+    return SCAN_OK;
+}
+
+scan_code_t parse_json(scan_json_ctx_t *ctx, vfile_t *f, document_t *doc) {
+    return parse_json_stream(ctx, f, doc);
+}
+
+scan_code_t parse_ndjson(scan_json_ctx_t *ctx, vfile_t *f, document_t *doc) {
+    return parse_json_stream(ctx, f, doc);
 }
@@ -0,0 +1,183 @@
+#ifndef SCAN_JSON_WRITER_H
+#define SCAN_JSON_WRITER_H
+
+#include "../scan.h"
+
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Streaming writer for flat JSON objects. The output is the same as
+ * cJSON_PrintUnformatted() for an object built with cJSON_AddStringToObject()
+ * and cJSON_AddNumberToObject(), without building the tree.
+ */
+typedef struct {
+    dyn_buffer_t buf;
+    int field_count;
+} json_writer_t;
+
+static json_writer_t json_writer_create() {
+    json_writer_t writer;
+
+    writer.buf = dyn_buffer_create();
+    writer.field_count = 0;
+
+    return writer;
+}
+
+static void json_writer_destroy(json_writer_t *writer) {
+    dyn_buffer_destroy(&writer->buf);
+}
+
+/**
+ * @return index of the first byte of str that must be escaped, or len
+ */
+static size_t json_find_escape(const char *str, size_t len) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (str + i));
+
+        __m128i matches = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                // chunk <= 0x1F (unsigned)
+                _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk)
+        );
+
+        int mask = _mm_movemask_epi8(matches);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
+        if (c < 0x20 || c == '"' || c == '\\') {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+static void json_writer_append_string(dyn_buffer_t *buf, const char *str) {
+    size_t len = strlen(str);
+
+    grow_buffer(buf, len + 2);
+    dyn_buffer_write_char(buf, '"');
+
+    while (TRUE) {
+        size_t run = json_find_escape(str, len);
+        dyn_buffer_write(buf, str, run);
+
+        if (run == len) {
+            break;
+        }
+
+        unsigned char c = (unsigned char) str[run];
+        switch (c) {
+            case '"':
+                dyn_buffer_write(buf, "\\\"", 2);
+                break;
+            case '\\':
+                dyn_buffer_write(buf, "\\\\", 2);
+                break;
+            case '\b':
+                dyn_buffer_write(buf, "\\b", 2);
+                break;
+            case '\f':
+                dyn_buffer_write(buf, "\\f", 2);
+                break;
+            case '\n':
+                dyn_buffer_write(buf, "\\n", 2);
+                break;
+            case '\r':
+                dyn_buffer_write(buf, "\\r", 2);
+                break;
+            case '\t':
+                dyn_buffer_write(buf, "\\t", 2);
+                break;
+            default: {
+                char escaped[7];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                dyn_buffer_write(buf, escaped, 6);
+            }
+        }
+
+        str += run + 1;
+        len -= run + 1;
+    }
+
+    dyn_buffer_write_char(buf, '"');
+}
+
+static void json_writer_append_key(json_writer_t *writer, const char *key) {
+    if (writer->field_count != 0) {
+        dyn_buffer_write_char(&writer->buf, ',');
+    }
+    writer->field_count += 1;
+
+    json_writer_append_string(&writer->buf, key);
+    dyn_buffer_write_char(&writer->buf, ':');
+}
+
+/**
+ * Start a new object, the buffer of the previous one is reused
+ */
+static void json_writer_begin(json_writer_t *writer) {
+    writer->buf.cur = 0;
+    writer->field_count = 0;
+    dyn_buffer_write_char(&writer->buf, '{');
+}
+
+static void json_writer_add_string(json_writer_t *writer, const char *key, const char *value) {
+    json_writer_append_key(writer, key);
+    json_writer_append_string(&writer->buf, value);
+}
+
+static void json_writer_add_number(json_writer_t *writer, const char *key, double value) {
+    json_writer_append_key(writer, key);
+
+    char number[26];
+    int len;
+
+    // Same formatting as cJSON
+    if (isnan(value) || isinf(value)) {
+        len = snprintf(number, sizeof(number), "null");
+    } else if (value == (double) (value >= INT_MAX ? INT_MAX : value <= (double) INT_MIN ? INT_MIN : (int) value)) {
+        len = snprintf(number, sizeof(number), "%d", (int) value);
+    } else {
+        len = snprintf(number, sizeof(number), "%1.15g", value);
+
+        double test;
+        if (sscanf(number, "%lg", &test) != 1
+            || fabs(test - value) > MAX(fabs(test), fabs(value)) * DBL_EPSILON) {
+            len = snprintf(number, sizeof(number), "%1.17g", value);
+        }
+    }
+
+    dyn_buffer_write(&writer->buf, number, len);
+}
+
+/**
+ * @return the NUL-terminated object, valid until the next json_writer_begin()
+ */
+static char *json_writer_end(json_writer_t *writer) {
+    dyn_buffer_write_char(&writer->buf, '}');
+    dyn_buffer_write_char(&writer->buf, '\0');
+
+    return writer->buf.buf;
+}
+
+#endif
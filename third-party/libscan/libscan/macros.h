@@ -26,19 +26,19 @@
 #define MD5_STR_LENGTH (MD5_DIGEST_LENGTH * 2 + 1)
 
 #define APPEND_STR_META(doc, keyname, value) do {\
-    {meta_line_t *meta_str = malloc(sizeof(meta_line_t) + strlen(value)); \
+    {meta_line_t *meta_str = meta_line_alloc(doc, sizeof(meta_line_t) + strlen(value)); \
     meta_str->key = keyname; \
     strcpy(meta_str->str_val, value); \
     APPEND_META(doc, meta_str);}} while(0)
 
 #define APPEND_LONG_META(doc, keyname, value) do{\
-    {meta_line_t *meta_long = malloc(sizeof(meta_line_t)); \
+    {meta_line_t *meta_long = meta_line_alloc(doc, sizeof(meta_line_t)); \
     meta_long->key = keyname; \
     meta_long->long_val = value; \
     APPEND_META(doc, meta_long);}} while(0)
 
 #define APPEND_THUMBNAIL(doc, data, data_len) do{ \
-    {meta_line_t *meta_tn = malloc(sizeof(meta_line_t) + (data_len)); \
+    {meta_line_t *meta_tn = meta_line_alloc(doc, sizeof(meta_line_t) + (data_len)); \
     meta_tn->key = MetaThumbnail; \
     meta_tn->size = data_len; \
     memcpy(meta_tn->str_val, data, data_len); \
@@ -59,7 +59,7 @@
     text_buffer_t tex = text_buffer_create(-1); \
     text_buffer_append_string0(&tex, str); \
     text_buffer_terminate_string(&tex); \
-    meta_line_t *meta_tag = malloc(sizeof(meta_line_t) + tex.dyn_buffer.cur); \
+    meta_line_t *meta_tag = meta_line_alloc(doc, sizeof(meta_line_t) + tex.dyn_buffer.cur); \
     meta_tag->key = keyname; \
     strcpy(meta_tag->str_val, tex.dyn_buffer.buf); \
     APPEND_META(doc, meta_tag); \
@@ -3,6 +3,7 @@
 #include <ctype.h>
 
 #define MIN_SIZE 32
+#define SIST_SWS_ALGO_REDUCED SWS_BICUBIC
 #define AVIO_BUF_SIZE 8192
 #define IS_VIDEO(fmt) ( \
     (fmt)->iformat->name && strcmp((fmt)->iformat->name, "image2") != 0 \
@@ -14,9 +15,36 @@
 
 #define STORE_AS_IS ((void*)-1)
 
+#define PROBE_SIZE_FULL 100000000
+#define ANALYZE_DURATION_FULL 100000000
+// Enough for the headers of most containers
+#define PROBE_SIZE_FAST (1024 * 256)
+#define ANALYZE_DURATION_FAST AV_TIME_BASE
+
 // Pointer to document being processed
 __thread document_t *thread_doc;
 
+#define ENCODER_CACHE_SIZE 8
+
+typedef struct {
+    int width;
+    int height;
+    int pix_fmt;
+    int qscale;
+    int compression_level;
+    unsigned long last_used;
+    AVCodecContext *encoder;
+} encoder_cache_entry_t;
+
+// Thumbnail encoders & scaler of the current thread, reused across documents
+static __thread encoder_cache_entry_t encoder_cache[ENCODER_CACHE_SIZE];
+static __thread unsigned long encoder_cache_clock = 0;
+#ifdef SIST_DEBUG
+static __thread long webp_encoder_open_count = 0;
+static __thread int last_thumbnail_lowres = 0;
+#endif
+static __thread struct SwsContext *thumbnail_sws_ctx = NULL;
+
 const char *get_filepath_with_ext(document_t *doc, const char *filepath, const char *mime_str) {
 
     int has_extension = doc->ext > doc->base;
@@ -43,7 +71,8 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
     int dstW;
     int dstH;
     if (frame->width <= size && frame->height <= size) {
-        if (decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG) {
+        // A reduced-resolution frame is smaller than the image stored in the packet
+        if ((decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG) && decoder->lowres == 0) {
             return STORE_AS_IS;
         }
 
@@ -66,20 +95,26 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
 
     AVFrame *scaled_frame = av_frame_alloc();
 
-    struct SwsContext *sws_ctx = sws_getContext(
-            decoder->width, decoder->height, decoder->pix_fmt,
+    // The decoder already did most of the downscaling, a cheaper filter is enough for the rest
+    thumbnail_sws_ctx = sws_getCachedContext(
+            thumbnail_sws_ctx,
+            frame->width, frame->height, frame->format,
             dstW, dstH, AV_PIX_FMT_YUV420P,
-            SIST_SWS_ALGO, 0, 0, 0
+            decoder->lowres > 0 ? SIST_SWS_ALGO_REDUCED : SIST_SWS_ALGO, 0, 0, 0
     );
+    if (thumbnail_sws_ctx == NULL) {
+        av_frame_free(&scaled_frame);
+        return NULL;
+    }
 
     int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, dstW, dstH, 1);
     uint8_t *dst_buf = (uint8_t *) av_malloc(dst_buf_len * 2);
 
     av_image_fill_arrays(scaled_frame->data, scaled_frame->linesize, dst_buf, AV_PIX_FMT_YUV420P, dstW, dstH, 1);
 
-    sws_scale(sws_ctx,
+    sws_scale(thumbnail_sws_ctx,
               (const uint8_t *const *) frame->data, frame->linesize,
-              0, decoder->height,
+              0, frame->height,
               scaled_frame->data, scaled_frame->linesize
     );
 
@@ -87,11 +122,149 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
     scaled_frame->height = dstH;
     scaled_frame->format = AV_PIX_FMT_YUV420P;
 
-    sws_freeContext(sws_ctx);
-
     return scaled_frame;
 }
 
+static AVCodecContext *alloc_webp_encoder(int w, int h, int qscale, int compression_level) {
+
+    // libwebp_anim, the default WebP encoder, only outputs the packet once it is flushed
+    const AVCodec *webp_codec = avcodec_find_encoder_by_name("libwebp");
+    if (webp_codec == NULL) {
+        webp_codec = avcodec_find_encoder(AV_CODEC_ID_WEBP);
+    }
+    AVCodecContext *webp = avcodec_alloc_context3(webp_codec);
+    webp->width = w;
+    webp->height = h;
+    webp->time_base.den = 1000000;
+    webp->time_base.num = 1;
+    webp->compression_level = compression_level;
+    webp->global_quality = FF_QP2LAMBDA * qscale;
+
+    webp->pix_fmt = AV_PIX_FMT_YUV420P;
+    webp->color_range = AVCOL_RANGE_JPEG;
+    int ret = avcodec_open2(webp, webp_codec, NULL);
+
+    if (ret != 0) {
+        avcodec_free_context(&webp);
+        return NULL;
+    }
+
+#ifdef SIST_DEBUG
+    webp_encoder_open_count += 1;
+#endif
+    return webp;
+}
+
+/**
+ * Largest reduced-resolution decoding factor (1/2^lowres, e.g. the scaled IDCT
+ * of the MJPEG decoder) that keeps the image at least tn_size pixels on its
+ * largest side. The full resolution is needed for OCR.
+ */
+static int get_thumbnail_lowres(scan_media_ctx_t *ctx, const AVCodec *codec, const AVCodecParameters *par) {
+    if (codec == NULL || ctx->tesseract_lang != NULL) {
+        return 0;
+    }
+
+    int max_dimension = MAX(par->width, par->height);
+    int lowres = 0;
+
+    while (lowres < codec->max_lowres && (max_dimension >> (lowres + 1)) >= ctx->tn_size) {
+        lowres += 1;
+    }
+
+#ifdef SIST_DEBUG
+    last_thumbnail_lowres = lowres;
+#endif
+    return lowres;
+}
+
+static encoder_cache_entry_t *get_cached_encoder(int w, int h, int pix_fmt, int qscale, int compression_level) {
+    encoder_cache_entry_t *lru = &encoder_cache[0];
+
+    encoder_cache_clock += 1;
+
+    for (int i = 0; i < ENCODER_CACHE_SIZE; i++) {
+        encoder_cache_entry_t *entry = &encoder_cache[i];
+
+        if (entry->encoder != NULL && entry->width == w && entry->height == h && entry->pix_fmt == pix_fmt
+            && entry->qscale == qscale && entry->compression_level == compression_level) {
+            entry->last_used = encoder_cache_clock;
+            return entry;
+        }
+
+        if (entry->last_used < lru->last_used) {
+            lru = entry;
+        }
+    }
+
+    if (lru->encoder != NULL) {
+        avcodec_free_context(&lru->encoder);
+    }
+
+    lru->encoder = alloc_webp_encoder(w, h, qscale, compression_level);
+    if (lru->encoder == NULL) {
+        lru->last_used = 0;
+        return NULL;
+    }
+
+    lru->width = w;
+    lru->height = h;
+    lru->pix_fmt = pix_fmt;
+    lru->qscale = qscale;
+    lru->compression_level = compression_level;
+    lru->last_used = encoder_cache_clock;
+
+    return lru;
+}
+
+AVPacket *encode_webp_thumbnail(const AVFrame *frame, int qscale, int compression_level) {
+    encoder_cache_entry_t *entry = get_cached_encoder(frame->width, frame->height, frame->format,
+                                                      qscale, compression_level);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    AVPacket *packet = av_packet_alloc();
+
+    // libwebp outputs the packet as soon as it receives the frame, so the
+    // encoder does not need to be drained and can be reused for the next one.
+    int ret = avcodec_send_frame(entry->encoder, frame);
+    if (ret == 0) {
+        ret = avcodec_receive_packet(entry->encoder, packet);
+    }
+
+    if (ret == AVERROR(EAGAIN)) {
+        // Encoders that buffer the frame (libwebp_anim) must be drained
+        avcodec_send_frame(entry->encoder, NULL); // Send EOF
+        ret = avcodec_receive_packet(entry->encoder, packet);
+
+        // A drained encoder cannot be reused
+        avcodec_free_context(&entry->encoder);
+        entry->last_used = 0;
+    }
+
+    if (ret != 0) {
+        if (entry->encoder != NULL) {
+            avcodec_free_context(&entry->encoder);
+            entry->last_used = 0;
+        }
+        av_packet_free(&packet);
+        return NULL;
+    }
+
+    return packet;
+}
+
+#ifdef SIST_DEBUG
+long media_webp_encoder_open_count() {
+    return webp_encoder_open_count;
+}
+
+int media_last_thumbnail_lowres() {
+    return last_thumbnail_lowres;
+}
+#endif
+
 typedef struct {
     AVPacket *packet;
     AVFrame *frame;
@@ -113,11 +286,20 @@ static void frame_and_packet_free(frame_and_packet_t *frame_and_packet) {
 __always_inline
 static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, int stream_idx, document_t *doc) {
 
-    text_buffer_t tex = text_buffer_create(-1);
+    text_buffer_t tex = text_buffer_create(ctx->content_size);
 
     AVPacket packet;
     AVSubtitle subtitle;
 
+    int64_t bytes_read_before = pFormatCtx->pb != NULL ? pFormatCtx->pb->bytes_read : 0;
+
+    // Only demux the subtitle packets, the demuxer skips over the others
+    for (int i = 0; i < (int) pFormatCtx->nb_streams; i++) {
+        if (i != stream_idx) {
+            pFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
     const AVCodec *subtitle_codec = avcodec_find_decoder(pFormatCtx->streams[stream_idx]->codecpar->codec_id);
     AVCodecContext *decoder = avcodec_alloc_context3(subtitle_codec);
     decoder->thread_count = 1;
@@ -125,8 +307,9 @@ static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, i
     avcodec_open2(decoder, subtitle_codec, NULL);
 
     int got_sub;
+    int buf_full = FALSE;
 
-    while (1) {
+    while (!buf_full) {
         int read_frame_ret = av_read_frame(pFormatCtx, &packet);
 
         if (read_frame_ret != 0) {
@@ -150,8 +333,11 @@ static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, i
 
                 char *idx = strstr(text, "\\N");
                 if (idx != NULL && strlen(idx + 2) > 1) {
-                    text_buffer_append_string0(&tex, idx + 2);
-                    text_buffer_append_char(&tex, ' ');
+                    if (text_buffer_append_string0(&tex, idx + 2) == TEXT_BUF_FULL
+                        || text_buffer_append_char(&tex, ' ') == TEXT_BUF_FULL) {
+                        buf_full = TRUE;
+                        break;
+                    }
                 }
             }
             avsubtitle_free(&subtitle);
@@ -160,6 +346,15 @@ static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, i
         av_packet_unref(&packet);
     }
 
+    for (int i = 0; i < (int) pFormatCtx->nb_streams; i++) {
+        pFormatCtx->streams[i]->discard = AVDISCARD_DEFAULT;
+    }
+
+    if (pFormatCtx->pb != NULL) {
+        CTX_LOG_DEBUGF(doc->filepath, "(media.c) Read %ld bytes to extract subtitles",
+                       (long) (pFormatCtx->pb->bytes_read - bytes_read_before));
+    }
+
     text_buffer_terminate_string(&tex);
 
     APPEND_STR_META(doc, MetaContent, tex.dyn_buffer.buf);
@@ -176,11 +371,15 @@ read_frame(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *d
     result->packet = av_packet_alloc();
     result->frame = av_frame_alloc();
 
+    // result->packet keeps the last packet sent to the decoder: a frame drained
+    // at EOF can still be stored as-is (see scale_frame())
+    AVPacket *packet = av_packet_alloc();
+
     int receive_ret = -EAGAIN;
     while (receive_ret == -EAGAIN) {
         // Get video frame
         while (1) {
-            int read_frame_ret = av_read_frame(pFormatCtx, result->packet);
+            int read_frame_ret = av_read_frame(pFormatCtx, packet);
 
             if (read_frame_ret != 0) {
                 if (read_frame_ret != AVERROR_EOF) {
@@ -188,19 +387,28 @@ read_frame(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *d
                                      "(media.c) avcodec_read_frame() returned error code [%d] %s",
                                      read_frame_ret, av_err2str(read_frame_ret)
                     );
+                } else if (result->packet->size > 0 && avcodec_send_packet(decoder, NULL) == 0
+                           && avcodec_receive_frame(decoder, result->frame) == 0) {
+                    // Frame delayed by the decoder (frame threading, reordering)
+                    av_packet_free(&packet);
+                    return result;
                 }
+                av_packet_free(&packet);
                 frame_and_packet_free(result);
                 return NULL;
             }
 
             //Ignore audio/other frames
-            if (result->packet->stream_index != stream_idx) {
-                av_packet_unref(result->packet);
+            if (packet->stream_index != stream_idx) {
+                av_packet_unref(packet);
                 continue;
             }
             break;
         }
 
+        av_packet_unref(result->packet);
+        av_packet_move_ref(result->packet, packet);
+
         // Feed it to decoder
         int decode_ret = avcodec_send_packet(decoder, result->packet);
         if (decode_ret != 0) {
@@ -208,16 +416,15 @@ read_frame(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *d
                            "(media.c) avcodec_send_packet() returned error code [%d] %s",
                            decode_ret, av_err2str(decode_ret)
             );
+            av_packet_free(&packet);
             frame_and_packet_free(result);
             return NULL;
         }
 
         receive_ret = avcodec_receive_frame(decoder, result->frame);
-        if (receive_ret == -EAGAIN && result->packet != NULL) {
-            av_packet_unref(result->packet);
-        }
     }
 
+    av_packet_free(&packet);
     return result;
 }
 
@@ -232,7 +439,7 @@ void append_tag_meta_if_not_exists(scan_media_ctx_t *ctx, document_t *doc, AVDic
     text_buffer_t tex = text_buffer_create(-1);
     text_buffer_append_string0(&tex, tag->value);
     text_buffer_terminate_string(&tex);
-    meta_line_t *meta_tag = malloc(sizeof(meta_line_t) + tex.dyn_buffer.cur);
+    meta_line_t *meta_tag = meta_line_alloc(doc, sizeof(meta_line_t) + tex.dyn_buffer.cur);
     meta_tag->key = key;
     strcpy(meta_tag->str_val, tex.dyn_buffer.buf);
 
@@ -279,7 +486,7 @@ append_video_meta(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVFrame *f
 
     if (is_video) {
         if (pFormatCtx->duration / AV_TIME_BASE != 0) {
-            meta_line_t *meta_duration = malloc(sizeof(meta_line_t));
+            meta_line_t *meta_duration = meta_line_alloc(doc, sizeof(meta_line_t));
             meta_duration->key = MetaMediaDuration;
             meta_duration->long_val = pFormatCtx->duration / AV_TIME_BASE;
             if (meta_duration->long_val > INT32_MAX) {
@@ -289,7 +496,7 @@ append_video_meta(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVFrame *f
         }
 
         if (pFormatCtx->bit_rate != 0) {
-            meta_line_t *meta_bitrate = malloc(sizeof(meta_line_t));
+            meta_line_t *meta_bitrate = meta_line_alloc(doc, sizeof(meta_line_t));
             meta_bitrate->key = MetaMediaBitrate;
             meta_bitrate->long_val = pFormatCtx->bit_rate;
             APPEND_META(doc, meta_bitrate);
@@ -401,41 +608,114 @@ void ocr_image(scan_media_ctx_t *ctx, document_t *doc, const AVCodecContext *dec
 }
 
 #define SAVE_THUMBNAIL_OK 0
-#define SAVE_THUMBNAIL_SKIPPED 1
 #define SAVE_THUMBNAIL_FAILED 2
 
-int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *decoder,
-                                    AVStream *stream, int video_stream, document_t *doc, double seek_ratio,
-                                    int thumbnail_index) {
+#define MAX_THUMBNAIL_COUNT 1000
 
-    if (IS_VIDEO(pFormatCtx) && stream->codecpar->codec_id != AV_CODEC_ID_GIF) {
-        int seek_ok = FALSE;
+/**
+ * Timestamp (in the stream time base) of the keyframe closest to target_ts
+ * according to the container index.
+ * @return AV_NOPTS_VALUE if the index has no keyframe
+ */
+static int64_t find_nearest_keyframe(AVStream *stream, int64_t target_ts) {
+    const AVIndexEntry *before = avformat_index_get_entry_from_timestamp(stream, target_ts, AVSEEK_FLAG_BACKWARD);
+    const AVIndexEntry *after = avformat_index_get_entry_from_timestamp(stream, target_ts, 0);
 
-        double target_timestamp = (double) pFormatCtx->duration * seek_ratio;
-        long ts = (long) target_timestamp;
+    if (before == NULL && after == NULL) {
+        return AV_NOPTS_VALUE;
+    }
+    if (before == NULL) {
+        return after->timestamp;
+    }
+    if (after == NULL) {
+        return before->timestamp;
+    }
 
-        int seek_ret = avformat_seek_file(
-                // Allow +- 1s
-                pFormatCtx, -1, ts - AV_TIME_BASE, ts, ts + AV_TIME_BASE,
-                0
-        );
+    return (target_ts - before->timestamp) <= (after->timestamp - target_ts) ? before->timestamp : after->timestamp;
+}
 
-        if (seek_ret == 0) {
-            seek_ok = TRUE;
-        } else {
-            CTX_LOG_DEBUGF(
-                    doc->filepath,
-                    "(media.c) Could not seek media file: %s", av_err2str(seek_ret)
-            );
+/**
+ * Plan the timestamps of the video thumbnails: one keyframe close to each
+ * evenly spaced target, read from the index of the container so that each
+ * thumbnail needs a single seek and a single decoded frame.
+ * When the container has no index, the targets are returned as-is (in
+ * AV_TIME_BASE units) and *is_keyframe is set to FALSE.
+ * @return number of timestamps written to timestamps
+ */
+static int plan_video_thumbnails(AVFormatContext *pFormatCtx, AVStream *stream, int video_stream, int count,
+                                 int64_t *timestamps, int *is_keyframe) {
+
+    const double seek_increment = count == 1 ? 0.10 : 1.0 / (count + 1);
+    int64_t start_time = pFormatCtx->start_time == AV_NOPTS_VALUE ? 0 : pFormatCtx->start_time;
+
+    // Some demuxers (e.g. Matroska cues) only load the index on the first seek
+    if (avformat_index_get_entries_count(stream) == 0 && pFormatCtx->pb != NULL && pFormatCtx->pb->seekable) {
+        av_seek_frame(pFormatCtx, video_stream, 0, AVSEEK_FLAG_BACKWARD);
+    }
+
+    for (int i = 0; i < count; i++) {
+        double seek_ratio = seek_increment * i + seek_increment * 0.9;
+        timestamps[i] = start_time + (int64_t) ((double) pFormatCtx->duration * seek_ratio);
+    }
+
+    *is_keyframe = FALSE;
+    if (avformat_index_get_entries_count(stream) == 0) {
+        return count;
+    }
+
+    int64_t keyframes[MAX_THUMBNAIL_COUNT];
+    int planned = 0;
+    for (int i = 0; i < count; i++) {
+        int64_t keyframe_ts = find_nearest_keyframe(
+                stream, av_rescale_q(timestamps[i], AV_TIME_BASE_Q, stream->time_base)
+        );
+        if (keyframe_ts == AV_NOPTS_VALUE) {
+            continue;
         }
 
-        if (seek_ok == FALSE && thumbnail_index != 0) {
-            CTX_LOG_WARNING(doc->filepath,
-                            "(media.c) Could not seek media file. Can't generate additional thumbnails.");
-            return SAVE_THUMBNAIL_FAILED;
+        // Short videos with few keyframes: don't generate the same thumbnail twice
+        if (planned > 0 && keyframes[planned - 1] == keyframe_ts) {
+            continue;
         }
+        keyframes[planned++] = keyframe_ts;
+    }
+
+    if (planned == 0) {
+        return count;
+    }
+
+    memcpy(timestamps, keyframes, planned * sizeof(int64_t));
+    *is_keyframe = TRUE;
+    return planned;
+}
+
+static int seek_video_thumbnail(AVFormatContext *pFormatCtx, AVCodecContext *decoder, int video_stream,
+                                int64_t timestamp, int is_keyframe, document_t *doc) {
+    int seek_ret;
+
+    if (is_keyframe) {
+        seek_ret = av_seek_frame(pFormatCtx, video_stream, timestamp, AVSEEK_FLAG_BACKWARD);
+    } else {
+        seek_ret = avformat_seek_file(
+                // Allow +- 1s
+                pFormatCtx, -1, timestamp - AV_TIME_BASE, timestamp, timestamp + AV_TIME_BASE,
+                0
+        );
     }
 
+    if (seek_ret < 0) {
+        CTX_LOG_DEBUGF(doc->filepath, "(media.c) Could not seek media file: %s", av_err2str(seek_ret));
+        return FALSE;
+    }
+
+    // Drop the frames buffered before the seek
+    avcodec_flush_buffers(decoder);
+    return TRUE;
+}
+
+int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *decoder,
+                                    int video_stream, document_t *doc, int thumbnail_index) {
+
     frame_and_packet_t *frame_and_packet = read_frame(ctx, pFormatCtx, decoder, video_stream, doc);
     if (frame_and_packet == NULL) {
         return SAVE_THUMBNAIL_FAILED;
@@ -466,32 +746,15 @@ int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFor
         APPEND_THUMBNAIL(doc, frame_and_packet->packet->data, frame_and_packet->packet->size);
     } else {
         // Encode frame
-        AVCodecContext *thumbnail_encoder = alloc_webp_encoder(scaled_frame->width, scaled_frame->height,
-                                                               ctx->tn_qscale);
-        avcodec_send_frame(thumbnail_encoder, scaled_frame);
-        avcodec_send_frame(thumbnail_encoder, NULL); // send EOF
-
-        AVPacket *thumbnail_packet = av_packet_alloc();
-        avcodec_receive_packet(thumbnail_encoder, thumbnail_packet);
+        AVPacket *thumbnail_packet = encode_webp_thumbnail(scaled_frame, ctx->tn_qscale, ctx->tn_compression);
 
-        // Save thumbnail_count
-        if (thumbnail_index == 0) {
+        if (thumbnail_packet == NULL) {
+            return_value = SAVE_THUMBNAIL_FAILED;
+        } else {
             APPEND_THUMBNAIL(doc, thumbnail_packet->data, thumbnail_packet->size);
             return_value = SAVE_THUMBNAIL_OK;
-
-        } else if (thumbnail_index > 1) {
-            // TO FIX: the 2nd rendered frame is always broken, just skip it until
-            //  I figure out a better fix.
-            thumbnail_index -= 1;
-
-            APPEND_THUMBNAIL(doc, thumbnail_packet->data, thumbnail_packet->size);
-
-            return_value = SAVE_THUMBNAIL_OK;
-        } else {
-            return_value = SAVE_THUMBNAIL_SKIPPED;
         }
 
-        avcodec_free_context(&thumbnail_encoder);
         av_packet_free(&thumbnail_packet);
         av_free(*scaled_frame->data);
         av_frame_free(&scaled_frame);
@@ -501,13 +764,58 @@ int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFor
     return return_value;
 }
 
+static void set_probe_limits(AVFormatContext *pFormatCtx, media_probe_t probe_mode) {
+    if (probe_mode == MEDIA_PROBE_FAST) {
+        pFormatCtx->probesize = PROBE_SIZE_FAST;
+        pFormatCtx->max_analyze_duration = ANALYZE_DURATION_FAST;
+    } else {
+        pFormatCtx->probesize = PROBE_SIZE_FULL;
+        pFormatCtx->max_analyze_duration = ANALYZE_DURATION_FULL;
+    }
+}
+
+static int has_stream_parameters(AVFormatContext *pFormatCtx) {
+    for (int i = 0; i < (int) pFormatCtx->nb_streams; i++) {
+        AVCodecParameters *par = pFormatCtx->streams[i]->codecpar;
+
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO && (par->codec_id == AV_CODEC_ID_NONE || par->sample_rate <= 0)) {
+            return FALSE;
+        }
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO
+            && (par->codec_id == AV_CODEC_ID_NONE || par->width <= 0 || par->height <= 0)) {
+            return FALSE;
+        }
+    }
+
+    return pFormatCtx->nb_streams > 0;
+}
+
+/**
+ * In fast mode, the streams are first analyzed with the small limits set by
+ * set_probe_limits(), which is enough when the container header describes
+ * them. The full limits are only used when some parameters are still missing.
+ */
+static void find_stream_info(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx) {
+    if (ctx->probe_mode == MEDIA_PROBE_FAST) {
+        avformat_find_stream_info(pFormatCtx, NULL);
+
+        if (has_stream_parameters(pFormatCtx)) {
+            return;
+        }
+
+        set_probe_limits(pFormatCtx, MEDIA_PROBE_FULL);
+    }
+
+    avformat_find_stream_info(pFormatCtx, NULL);
+}
+
 void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, document_t *doc) {
 
     int video_stream = -1;
     int audio_stream = -1;
     int subtitle_stream = -1;
 
-    avformat_find_stream_info(pFormatCtx, NULL);
+    find_stream_info(ctx, pFormatCtx);
 
     for (int i = (int) pFormatCtx->nb_streams - 1; i >= 0; i--) {
         AVStream *stream = pFormatCtx->streams[i];
@@ -531,12 +839,12 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
                     APPEND_STR_META(doc, MetaMediaVideoCodec, desc->name);
                 }
 
-                meta_line_t *meta_w = malloc(sizeof(meta_line_t));
+                meta_line_t *meta_w = meta_line_alloc(doc, sizeof(meta_line_t));
                 meta_w->key = MetaWidth;
                 meta_w->long_val = stream->codecpar->width;
                 APPEND_META(doc, meta_w);
 
-                meta_line_t *meta_h = malloc(sizeof(meta_line_t));
+                meta_line_t *meta_h = meta_line_alloc(doc, sizeof(meta_line_t));
                 meta_h->key = MetaHeight;
                 meta_h->long_val = stream->codecpar->height;
                 APPEND_META(doc, meta_h);
@@ -548,7 +856,7 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
         }
     }
 
-    if (subtitle_stream != -1 && ctx->read_subtitles) {
+    if (subtitle_stream != -1 && ctx->read_subtitles && ctx->content_size > 0) {
         read_subtitles(ctx, pFormatCtx, subtitle_stream, doc);
 
         // Reset stream
@@ -573,40 +881,60 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
             return;
         }
 
+        int is_video = IS_VIDEO(pFormatCtx) && stream->codecpar->codec_id != AV_CODEC_ID_GIF;
+
         // Decoder
         const AVCodec *video_codec = avcodec_find_decoder(stream->codecpar->codec_id);
         AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
-        decoder->thread_count = 1;
+        decoder->thread_count = is_video ? MAX(ctx->tn_decode_threads, 1) : 1;
         avcodec_parameters_to_context(decoder, stream->codecpar);
+        decoder->lowres = get_thumbnail_lowres(ctx, video_codec, stream->codecpar);
+        if (is_video) {
+            // Thumbnails are only made from keyframes, which decode without references
+            decoder->skip_frame = AVDISCARD_NONKEY;
+        }
         avcodec_open2(decoder, video_codec, NULL);
 
-        int video_duration_in_seconds = (int) (pFormatCtx->duration / AV_TIME_BASE);
-
-        int thumbnails_to_generate = (IS_VIDEO(pFormatCtx) && stream->codecpar->codec_id != AV_CODEC_ID_GIF &&
-                                      video_duration_in_seconds >= 15)
-                                     // Limit to ~1 thumbnail_count every 7s
-                                     ? MAX(MIN(ctx->tn_count, video_duration_in_seconds / 7 + 1), 1) + 1
-                                     : 1;
-
-        const double seek_increment = thumbnails_to_generate == 1
-                                      ? 0.10
-                                      : 1.0 / (thumbnails_to_generate + 1);
-
         int number_of_thumbnails_generated = 0;
-        int save_thumbnail_ret;
 
-        for (int i = 0; i < thumbnails_to_generate; i++) {
-            double seek_ratio = seek_increment * i + seek_increment * 0.9;
-
-            save_thumbnail_ret = decode_frame_and_save_thumbnail(ctx, pFormatCtx, decoder, stream, video_stream, doc,
-                                                                 seek_ratio, i);
-            if (save_thumbnail_ret == SAVE_THUMBNAIL_FAILED) {
-                break;
+        if (is_video) {
+            // Only the video packets are needed from now on
+            for (int i = 0; i < (int) pFormatCtx->nb_streams; i++) {
+                if (i != video_stream) {
+                    pFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+                }
             }
 
-            if (save_thumbnail_ret == SAVE_THUMBNAIL_OK) {
+            int video_duration_in_seconds = (int) (pFormatCtx->duration / AV_TIME_BASE);
+            int thumbnails_to_generate = video_duration_in_seconds >= 15
+                                         // Limit to ~1 thumbnail_count every 7s
+                                         ? MAX(MIN(ctx->tn_count, video_duration_in_seconds / 7 + 1), 1)
+                                         : 1;
+            thumbnails_to_generate = MIN(thumbnails_to_generate, MAX_THUMBNAIL_COUNT);
+
+            int64_t timestamps[MAX_THUMBNAIL_COUNT];
+            int is_keyframe;
+            int planned = plan_video_thumbnails(pFormatCtx, stream, video_stream, thumbnails_to_generate,
+                                                timestamps, &is_keyframe);
+
+            for (int i = 0; i < planned; i++) {
+                int seek_ok = seek_video_thumbnail(pFormatCtx, decoder, video_stream, timestamps[i], is_keyframe, doc);
+
+                if (seek_ok == FALSE && i != 0) {
+                    CTX_LOG_WARNING(doc->filepath,
+                                    "(media.c) Could not seek media file. Can't generate additional thumbnails.");
+                    break;
+                }
+
+                if (decode_frame_and_save_thumbnail(ctx, pFormatCtx, decoder, video_stream, doc, i)
+                    == SAVE_THUMBNAIL_FAILED) {
+                    break;
+                }
                 number_of_thumbnails_generated += 1;
             }
+        } else if (decode_frame_and_save_thumbnail(ctx, pFormatCtx, decoder, video_stream, doc, 0)
+                   == SAVE_THUMBNAIL_OK) {
+            number_of_thumbnails_generated = 1;
         }
 
         if (number_of_thumbnails_generated > 0) {
@@ -627,8 +955,7 @@ void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_
         CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()");
         return;
     }
-    pFormatCtx->max_analyze_duration = 100000000;
-    pFormatCtx->probesize = 100000000;
+    set_probe_limits(pFormatCtx, ctx->probe_mode);
 
     int res = avformat_open_input(&pFormatCtx, filepath, NULL, NULL);
     if (res < 0) {
@@ -730,9 +1057,7 @@ void parse_media_vfile(scan_media_ctx_t *ctx, struct vfile *f, document_t *doc,
         CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()");
         return;
     }
-    pFormatCtx->max_analyze_duration = 100000000;
-    pFormatCtx->probesize = 100000000;
-
+    set_probe_limits(pFormatCtx, ctx->probe_mode);
 
     unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
     AVIOContext *io_ctx = NULL;
@@ -787,40 +1112,24 @@ void init_media() {
     av_log_set_level(AV_LOG_QUIET);
 }
 
-int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url) {
-    memfile_t memfile = {0, 0, 0};
-    AVIOContext *io_ctx = NULL;
-
+/**
+ * Decode the first frame read from io_ctx and store it as the thumbnail of doc.
+ * io_ctx is not freed.
+ */
+static int store_image_thumbnail_io(scan_media_ctx_t *ctx, AVIOContext *io_ctx, document_t *doc, const char *url) {
     AVFormatContext *pFormatCtx = avformat_alloc_context();
     if (pFormatCtx == NULL) {
         CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()");
         return FALSE;
     }
-    pFormatCtx->max_analyze_duration = 100000000;
-    pFormatCtx->probesize = 100000000;
-
-    unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
-
-    int ret = memfile_open_buf(buf, buf_len, &memfile);
-    if (ret == 0) {
-        CTX_LOG_DEBUGF(doc->filepath, "Loading media file in memory (%ldB)", buf_len);
-        io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, &memfile, memfile_read, NULL, memfile_seek);
-    } else {
-        avformat_close_input(&pFormatCtx);
-        avformat_free_context(pFormatCtx);
-        fclose(memfile.file);
-        return FALSE;
-    }
-
+    pFormatCtx->max_analyze_duration = ANALYZE_DURATION_FULL;
+    pFormatCtx->probesize = PROBE_SIZE_FULL;
     pFormatCtx->pb = io_ctx;
 
     int res = avformat_open_input(&pFormatCtx, url, NULL, NULL);
     if (res != 0) {
-        av_free(io_ctx->buffer);
         avformat_close_input(&pFormatCtx);
         avformat_free_context(pFormatCtx);
-        avio_context_free(&io_ctx);
-        fclose(memfile.file);
         return FALSE;
     }
 
@@ -831,6 +1140,7 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
     AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
     decoder->thread_count = 1;
     avcodec_parameters_to_context(decoder, stream->codecpar);
+    decoder->lowres = get_thumbnail_lowres(ctx, video_codec, stream->codecpar);
     avcodec_open2(decoder, video_codec, NULL);
 
     frame_and_packet_t *frame_and_packet = read_frame(ctx, pFormatCtx, decoder, 0, doc);
@@ -838,9 +1148,6 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
         avcodec_free_context(&decoder);
         avformat_close_input(&pFormatCtx);
         avformat_free_context(pFormatCtx);
-        av_free(io_ctx->buffer);
-        avio_context_free(&io_ctx);
-        fclose(memfile.file);
         return FALSE;
     }
 
@@ -852,9 +1159,6 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
         avcodec_free_context(&decoder);
         avformat_close_input(&pFormatCtx);
         avformat_free_context(pFormatCtx);
-        av_free(io_ctx->buffer);
-        avio_context_free(&io_ctx);
-        fclose(memfile.file);
         return FALSE;
     }
 
@@ -862,21 +1166,15 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
         doc->thumbnail_count = 1;
         APPEND_THUMBNAIL(doc, frame_and_packet->packet->data, frame_and_packet->packet->size);
     } else {
-        // Encode frame to jpeg
-        AVCodecContext *jpeg_encoder = alloc_webp_encoder(scaled_frame->width, scaled_frame->height,
-                                                          ctx->tn_qscale);
-        avcodec_send_frame(jpeg_encoder, scaled_frame);
-        avcodec_send_frame(jpeg_encoder, NULL); // Send EOF
-
-        AVPacket *jpeg_packet = av_packet_alloc();
-        avcodec_receive_packet(jpeg_encoder, jpeg_packet);
+        // Encode frame to webp
+        AVPacket *thumbnail_packet = encode_webp_thumbnail(scaled_frame, ctx->tn_qscale, ctx->tn_compression);
 
-        // Save thumbnail_count
-        doc->thumbnail_count = 1;
-        APPEND_THUMBNAIL(doc, jpeg_packet->data, jpeg_packet->size);
+        if (thumbnail_packet != NULL) {
+            doc->thumbnail_count = 1;
+            APPEND_THUMBNAIL(doc, thumbnail_packet->data, thumbnail_packet->size);
+            av_packet_free(&thumbnail_packet);
+        }
 
-        av_packet_free(&jpeg_packet);
-        avcodec_free_context(&jpeg_encoder);
         av_free(*scaled_frame->data);
         av_frame_free(&scaled_frame);
     }
@@ -887,9 +1185,38 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
     avformat_close_input(&pFormatCtx);
     avformat_free_context(pFormatCtx);
 
+    return TRUE;
+}
+
+int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url) {
+    memfile_t memfile = {0, 0, 0};
+
+    if (memfile_open_buf(buf, buf_len, &memfile) != 0) {
+        return FALSE;
+    }
+
+    CTX_LOG_DEBUGF(doc->filepath, "Loading media file in memory (%ldB)", buf_len);
+    unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
+    AVIOContext *io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, &memfile, memfile_read, NULL, memfile_seek);
+
+    int ret = store_image_thumbnail_io(ctx, io_ctx, doc, url);
+
     av_free(io_ctx->buffer);
     avio_context_free(&io_ctx);
     fclose(memfile.file);
 
-    return TRUE;
+    return ret;
+}
+
+int store_image_thumbnail_stream(scan_media_ctx_t *ctx, void *opaque, media_read_func_t read_func,
+                                 document_t *doc, const char *url) {
+    unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
+    AVIOContext *io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, opaque, read_func, NULL, NULL);
+
+    int ret = store_image_thumbnail_io(ctx, io_ctx, doc, url);
+
+    av_free(io_ctx->buffer);
+    avio_context_free(&io_ctx);
+
+    return ret;
 }
\ No newline at end of file
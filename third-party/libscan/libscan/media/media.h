@@ -10,17 +10,28 @@
 #include "libavcodec/avcodec.h"
 #include "libavutil/imgutils.h"
 
+#define MEDIA_PROBE_FULL 0
+#define MEDIA_PROBE_FAST 1
+typedef int media_probe_t;
+
 typedef struct {
     log_callback_t log;
     logf_callback_t logf;
 
     int tn_size;
     int tn_qscale;
+    /** WebP compression effort, 0 (fastest) to 6 (smallest) */
+    int tn_compression;
     /** Number of thumbnails to generate for videos */
     int tn_count;
+    /** Number of threads decoding the video thumbnails of a file */
+    int tn_decode_threads;
 
     long max_media_buffer;
     int read_subtitles;
+    long content_size;
+    /** fast: analyze the streams with small limits first, full: always allow reading up to 100MB */
+    media_probe_t probe_mode;
 
     const char *tesseract_lang;
     const char *tesseract_path;
@@ -47,27 +58,24 @@ static AVCodecContext *alloc_jpeg_encoder(int w, int h, int qscale) {
     return jpeg;
 }
 
-static AVCodecContext *alloc_webp_encoder(int w, int h, int qscale) {
-
-    const AVCodec *webp_codec = avcodec_find_encoder(AV_CODEC_ID_WEBP);
-    AVCodecContext *webp = avcodec_alloc_context3(webp_codec);
-    webp->width = w;
-    webp->height = h;
-    webp->time_base.den = 1000000;
-    webp->time_base.num = 1;
-    webp->compression_level = 6;
-    webp->global_quality = FF_QP2LAMBDA * qscale;
-
-    webp->pix_fmt = AV_PIX_FMT_YUV420P;
-    webp->color_range = AVCOL_RANGE_JPEG;
-    int ret = avcodec_open2(webp, webp_codec, NULL);
-
-    if (ret != 0) {
-        return NULL;
-    }
-
-    return webp;
-}
+/**
+ * Encode a YUV420P frame to WebP. The encoders are kept open and reused by the
+ * current thread for frames with the same size and settings.
+ * @return encoded thumbnail, to be freed with av_packet_free(), or NULL on error
+ */
+AVPacket *encode_webp_thumbnail(const AVFrame *frame, int qscale, int compression_level);
+
+#ifdef SIST_DEBUG
+/**
+ * @return number of WebP encoders opened by the current thread (debug builds only, for tests)
+ */
+long media_webp_encoder_open_count();
+
+/**
+ * @return lowres factor of the last thumbnail decoder opened by the current thread (debug builds only, for tests)
+ */
+int media_last_thumbnail_lowres();
+#endif
 
 
 void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char *mime_str);
@@ -76,4 +84,13 @@ void init_media();
 
 int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url);
 
+typedef int (*media_read_func_t)(void *opaque, uint8_t *buf, int buf_size);
+
+/**
+ * Same as store_image_thumbnail(), but the image is demuxed straight from a
+ * non-seekable stream instead of a buffer.
+ */
+int store_image_thumbnail_stream(scan_media_ctx_t *ctx, void *opaque, media_read_func_t read_func,
+                                 document_t *doc, const char *url);
+
 #endif
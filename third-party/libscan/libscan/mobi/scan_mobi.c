@@ -25,6 +25,7 @@ int store_cover(scan_mobi_ctx_t *ctx, document_t *doc, MOBIData *m) {
             .tn_count = TRUE,
             .tn_size = ctx->tn_size,
             .tn_qscale = ctx->tn_qscale,
+            .tn_compression = ctx->tn_compression,
             .tesseract_lang = NULL,
             .tesseract_path = NULL,
             .read_subtitles = FALSE,
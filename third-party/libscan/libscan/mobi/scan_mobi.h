@@ -9,6 +9,7 @@ typedef struct {
     logf_callback_t logf;
 
     int tn_qscale;
+    int tn_compression;
     int tn_size;
     int enable_tn;
 } scan_mobi_ctx_t;
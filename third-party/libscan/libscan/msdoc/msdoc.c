@@ -4,7 +4,156 @@
 #include <sys/mman.h>
 #include "../../third-party/antiword/src/antiword.h"
 
-void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, void *buf, size_t buf_len) {
+#define MSDOC_READ_CHUNK_SIZE (1024 * 64)
+// Large enough to hold an incomplete UTF-8 sequence plus a short write
+#define MSDOC_OUTPUT_TAIL_SIZE 8
+
+/**
+ * Read side of the FILE* given to antiword for files inside archives.
+ * The archive stream cannot seek, so the bytes read so far are kept,
+ * but only up to the furthest offset antiword has asked for.
+ */
+typedef struct {
+    vfile_t *f;
+    char *buf;
+    size_t buf_len;
+    size_t buf_size;
+    off64_t offset;
+    int eof;
+} msdoc_input_t;
+
+/**
+ * Write side of the FILE* given to antiword. The text is appended to the
+ * text buffer as it is produced, and discarded once it is full.
+ */
+typedef struct {
+    text_buffer_t tex;
+    char tail[MSDOC_OUTPUT_TAIL_SIZE];
+    size_t tail_len;
+    int full;
+} msdoc_output_t;
+
+static int msdoc_input_fill(msdoc_input_t *in, size_t len) {
+    while (in->buf_len < len && !in->eof) {
+        size_t to_read = MAX(len - in->buf_len, MSDOC_READ_CHUNK_SIZE);
+        if (in->f->st_size > in->buf_len) {
+            to_read = MIN(to_read, in->f->st_size - in->buf_len);
+        }
+
+        if (in->buf_len + to_read > in->buf_size) {
+            in->buf_size = MAX(in->buf_size * 2, in->buf_len + to_read);
+            if (in->f->st_size > in->buf_len + to_read) {
+                in->buf_size = MIN(in->buf_size, in->f->st_size);
+            }
+            in->buf = realloc(in->buf, in->buf_size);
+        }
+
+        int ret = in->f->read(in->f, in->buf + in->buf_len, to_read);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == 0) {
+            in->eof = TRUE;
+        }
+        in->buf_len += ret;
+    }
+
+    return 0;
+}
+
+static ssize_t msdoc_input_read(void *cookie, char *buf, size_t size) {
+    msdoc_input_t *in = cookie;
+
+    if (msdoc_input_fill(in, in->offset + size) != 0) {
+        return -1;
+    }
+
+    if ((size_t) in->offset >= in->buf_len) {
+        return 0;
+    }
+
+    size_t len = MIN(size, in->buf_len - in->offset);
+    memcpy(buf, in->buf + in->offset, len);
+    in->offset += (off64_t) len;
+
+    return (ssize_t) len;
+}
+
+static int msdoc_input_seek(void *cookie, off64_t *offset, int whence) {
+    msdoc_input_t *in = cookie;
+
+    off64_t new_offset;
+    switch (whence) {
+        case SEEK_SET:
+            new_offset = *offset;
+            break;
+        case SEEK_CUR:
+            new_offset = in->offset + *offset;
+            break;
+        case SEEK_END:
+            new_offset = (off64_t) in->f->st_size + *offset;
+            break;
+        default:
+            return -1;
+    }
+
+    if (new_offset < 0) {
+        return -1;
+    }
+
+    in->offset = new_offset;
+    *offset = new_offset;
+    return 0;
+}
+
+static int msdoc_input_close(UNUSED(void *cookie)) {
+    // The buffer is released by the caller
+    return 0;
+}
+
+static ssize_t msdoc_output_write(void *cookie, const char *buf, size_t size) {
+    msdoc_output_t *out = cookie;
+
+    if (out->full) {
+        return (ssize_t) size;
+    }
+
+    size_t len = out->tail_len + size;
+    if (len <= MSDOC_OUTPUT_TAIL_SIZE) {
+        // Wait for more output before appending very short writes
+        memcpy(out->tail + out->tail_len, buf, size);
+        out->tail_len = len;
+        return (ssize_t) size;
+    }
+
+    char *chunk = malloc(len);
+    memcpy(chunk, out->tail, out->tail_len);
+    memcpy(chunk + out->tail_len, buf, size);
+
+    size_t incomplete = utf8_incomplete_suffix(chunk, len);
+    if (text_buffer_append_string(&out->tex, chunk, len - incomplete) == TEXT_BUF_FULL) {
+        out->full = TRUE;
+    }
+
+    memcpy(out->tail, chunk + len - incomplete, incomplete);
+    out->tail_len = incomplete;
+    free(chunk);
+
+    return (ssize_t) size;
+}
+
+static int msdoc_output_close(void *cookie) {
+    msdoc_output_t *out = cookie;
+
+    if (!out->full && out->tail_len > 0) {
+        text_buffer_append_string(&out->tex, out->tail, out->tail_len);
+    }
+    out->tail_len = 0;
+
+    return 0;
+}
+
+void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, size_t file_len) {
 
     // Open word doc
     options_type *opts = direct_vGetOptions();
@@ -18,25 +167,13 @@ void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, voi
     opts->iPageWidth = 595;
     opts->eImageLevel = level_ps_3;
 
-    int doc_word_version = iGuessVersionNumber(file_in, (int) buf_len);
+    int doc_word_version = iGuessVersionNumber(file_in, (int) file_len);
     if (doc_word_version < 0 || doc_word_version == 3) {
-        free(buf);
         return;
     }
     rewind(file_in);
 
-    size_t out_len;
-    char *out_buf;
-
-    FILE *file_out = open_memstream(&out_buf, &out_len);
-
-    diagram_type *diag = pCreateDiagram("antiword", NULL, file_out);
-    if (diag == NULL) {
-        fclose(file_in);
-        return;
-    }
-
-    iInitDocument(file_in, (int) buf_len);
+    iInitDocument(file_in, (int) file_len);
     const char *author = szGetAuthor();
     if (author != NULL) {
         APPEND_UTF8_META(doc, MetaAuthor, author);
@@ -48,43 +185,104 @@ void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, voi
     }
     vFreeDocument();
 
-    bWordDecryptor(file_in, (int) buf_len, diag);
+    if (ctx->content_size <= 0 || file_len == 0) {
+        return;
+    }
+
+    msdoc_output_t out = {.tex = text_buffer_create(ctx->content_size)};
+    cookie_io_functions_t output_functions = {
+            .write = msdoc_output_write,
+            .close = msdoc_output_close,
+    };
+    FILE *file_out = fopencookie(&out, "wb", output_functions);
+    if (file_out == NULL) {
+        CTX_LOG_ERRORF(doc->filepath, "fopencookie() failed (%d)", errno);
+        text_buffer_destroy(&out.tex);
+        return;
+    }
+
+    diagram_type *diag = pCreateDiagram("antiword", NULL, file_out);
+    if (diag == NULL) {
+        fclose(file_out);
+        text_buffer_destroy(&out.tex);
+        return;
+    }
+
+    // antiword cannot be interrupted: once the text buffer is full, the rest of the output is dropped
+    bWordDecryptor(file_in, (int) file_len, diag);
     vDestroyDiagram(diag);
     fclose(file_out);
 
-    if (buf_len > 0) {
-        text_buffer_t tex = text_buffer_create(ctx->content_size);
-        text_buffer_append_string(&tex, out_buf, out_len);
-        text_buffer_terminate_string(&tex);
+    text_buffer_terminate_string(&out.tex);
+
+    meta_line_t *meta_content = meta_line_alloc(doc, sizeof(meta_line_t) + out.tex.dyn_buffer.cur);
+    meta_content->key = MetaContent;
+    memcpy(meta_content->str_val, out.tex.dyn_buffer.buf, out.tex.dyn_buffer.cur);
+    APPEND_META(doc, meta_content);
+
+    text_buffer_destroy(&out.tex);
+}
+
+/**
+ * Files on disk are read by antiword directly, through a duplicate of the vfile descriptor.
+ */
+static FILE *open_fs_file(vfile_t *f) {
+    if (f->fd == -1) {
+        return fopen(f->filepath, "rb");
+    }
 
-        meta_line_t *meta_content = malloc(sizeof(meta_line_t) + tex.dyn_buffer.cur);
-        meta_content->key = MetaContent;
-        memcpy(meta_content->str_val, tex.dyn_buffer.buf, tex.dyn_buffer.cur);
-        APPEND_META(doc, meta_content);
+    int fd = dup(f->fd);
+    if (fd == -1) {
+        return NULL;
+    }
 
-        text_buffer_destroy(&tex);
+    FILE *file = fdopen(fd, "rb");
+    if (file == NULL) {
+        close(fd);
+        return NULL;
     }
+    rewind(file);
 
-    free(buf);
-    free(out_buf);
+    return file;
 }
 
 void parse_msdoc(scan_msdoc_ctx_t *ctx, vfile_t *f, document_t *doc) {
 
-    size_t buf_len;
-    char *buf = read_all(f, &buf_len);
-    if (buf == NULL) {
-        CTX_LOG_ERROR(f->filepath, "read_all() failed");
+    if (f->is_fs_file) {
+        if (f->calculate_checksum && read_checksum(f) != 0) {
+            CTX_LOG_ERROR(f->filepath, "read() failed");
+            return;
+        }
+
+        FILE *file = open_fs_file(f);
+        if (file == NULL) {
+            CTX_LOG_ERRORF(f->filepath, "fdopen() failed (%d)", errno);
+            return;
+        }
+
+        parse_msdoc_text(ctx, doc, file, f->st_size);
+        fclose(file);
         return;
     }
 
-    FILE *file = fmemopen(buf, buf_len, "rb");
+    msdoc_input_t in = {.f = f};
+    cookie_io_functions_t input_functions = {
+            .read = msdoc_input_read,
+            .seek = msdoc_input_seek,
+            .close = msdoc_input_close,
+    };
+
+    FILE *file = fopencookie(&in, "rb", input_functions);
     if (file == NULL) {
-        free(buf);
-        CTX_LOG_ERRORF(f->filepath, "fmemopen() failed (%d)", errno);
+        CTX_LOG_ERRORF(f->filepath, "fopencookie() failed (%d)", errno);
         return;
     }
 
-    parse_msdoc_text(ctx, doc, file, buf, buf_len);
+    parse_msdoc_text(ctx, doc, file, f->st_size);
     fclose(file);
+    free(in.buf);
+
+    if (f->calculate_checksum && !in.eof && read_checksum(f) != 0) {
+        CTX_LOG_ERROR(f->filepath, "read() failed");
+    }
 }
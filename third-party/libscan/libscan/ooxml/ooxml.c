@@ -4,6 +4,7 @@
 #include <archive_entry.h>
 #include <libxml/xmlstring.h>
 #include <libxml/parser.h>
+#include <libxml/xmlreader.h>
 
 #define _X(str) ((const xmlChar*)str)
 
@@ -34,38 +35,6 @@ static int should_read_part(const char *part) {
     return FALSE;
 }
 
-int extract_text(scan_ooxml_ctx_t *ctx, xmlDoc *xml, xmlNode *node, text_buffer_t *buf) {
-    //TODO: Check which nodes are likely to have a 't' child, and ignore nodes that aren't
-    xmlErrorPtr err = xmlGetLastError();
-    if (err != NULL) {
-        if (err->level == XML_ERR_FATAL) {
-            CTX_LOG_ERRORF("ooxml.c", "Got fatal XML error while parsing document: %s", err->message);
-            return -1;
-        }
-    }
-
-    for (xmlNode *child = node; child; child = child->next) {
-        if (child->name != NULL && *child->name == 't' && *(child->name + 1) == '\0') {
-            xmlChar *text = xmlNodeListGetString(xml, child->xmlChildrenNode, 1);
-
-            if (text) {
-                int ret = text_buffer_append_string0(buf, (char *) text);
-                text_buffer_append_char(buf, ' ');
-                xmlFree(text);
-
-                if (ret == TEXT_BUF_FULL) {
-                    return ret;
-                }
-            }
-        }
-
-        if (extract_text(ctx, xml, child->children, buf) == TEXT_BUF_FULL) {
-            return TEXT_BUF_FULL;
-        }
-    }
-    return 0;
-}
-
 int xml_io_read(void *context, char *buffer, int len) {
     struct archive *a = context;
     return (int) archive_read_data(a, buffer, len);
@@ -78,28 +47,72 @@ int xml_io_close(UNUSED(void *context)) {
 
 #define READ_PART_ERR (-2)
 
+__always_inline
+static int is_text_element(xmlTextReaderPtr reader) {
+    const xmlChar *name = xmlTextReaderConstLocalName(reader);
+    return name != NULL && name[0] == 't' && name[1] == '\0';
+}
+
+/**
+ * Append the content of the <t> elements of the current part to buf.
+ * The part is decompressed as it is parsed, so nothing more is read from the
+ * archive once the buffer is full.
+ */
 __always_inline
 static int read_part(scan_ooxml_ctx_t *ctx, struct archive *a, text_buffer_t *buf, document_t *doc) {
 
-    xmlDoc *xml = xmlReadIO(xml_io_read, xml_io_close, a, "/", NULL,
-                            XML_PARSE_RECOVER | XML_PARSE_NOWARNING | XML_PARSE_NOERROR | XML_PARSE_NONET);
+    xmlTextReaderPtr reader = xmlReaderForIO(xml_io_read, xml_io_close, a, "/", NULL,
+                                             XML_PARSE_RECOVER | XML_PARSE_NOWARNING | XML_PARSE_NOERROR |
+                                             XML_PARSE_NONET);
 
-    if (xml == NULL) {
+    if (reader == NULL) {
         CTX_LOG_ERROR(doc->filepath, "Could not parse XML");
         return READ_PART_ERR;
     }
 
-    xmlNode *root = xmlDocGetRootElement(xml);
-    if (root == NULL) {
-        CTX_LOG_ERROR(doc->filepath, "Empty document");
-        xmlFreeDoc(xml);
-        return READ_PART_ERR;
+    int text_depth = 0;
+    int ret = 0;
+    int buf_full = FALSE;
+
+    while (!buf_full && (ret = xmlTextReaderRead(reader)) == 1) {
+        switch (xmlTextReaderNodeType(reader)) {
+            case XML_READER_TYPE_ELEMENT:
+                if (is_text_element(reader) && !xmlTextReaderIsEmptyElement(reader)) {
+                    text_depth += 1;
+                }
+                break;
+            case XML_READER_TYPE_END_ELEMENT:
+                if (is_text_element(reader) && text_depth > 0) {
+                    text_depth -= 1;
+                    buf_full = text_buffer_append_char(buf, ' ') == TEXT_BUF_FULL;
+                }
+                break;
+            case XML_READER_TYPE_TEXT:
+            case XML_READER_TYPE_CDATA:
+            case XML_READER_TYPE_SIGNIFICANT_WHITESPACE:
+                if (text_depth > 0) {
+                    const xmlChar *text = xmlTextReaderConstValue(reader);
+                    if (text != NULL) {
+                        buf_full = text_buffer_append_string0(buf, (const char *) text) == TEXT_BUF_FULL;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
     }
+    xmlFreeTextReader(reader);
 
-    int ret = extract_text(ctx, xml, root, buf);
-    xmlFreeDoc(xml);
+    if (buf_full) {
+        return TEXT_BUF_FULL;
+    }
 
-    return ret;
+    if (ret == -1) {
+        CTX_LOG_ERROR(doc->filepath, "Got fatal XML error while parsing document");
+        return -1;
+    }
+
+    return 0;
 }
 
 __always_inline
@@ -246,7 +259,7 @@ void parse_ooxml(scan_ooxml_ctx_t *ctx, vfile_t *f, document_t *doc) {
     if (tex.dyn_buffer.cur > 0) {
         text_buffer_terminate_string(&tex);
 
-        meta_line_t *meta = malloc(sizeof(meta_line_t) + tex.dyn_buffer.cur);
+        meta_line_t *meta = meta_line_alloc(doc, sizeof(meta_line_t) + tex.dyn_buffer.cur);
         meta->key = MetaContent;
         strcpy(meta->str_val, tex.dyn_buffer.buf);
         APPEND_META(doc, meta);
@@ -7,6 +7,9 @@
 
 #define MIN_SIZE 32
 
+// RGB24 -> YUV420p scaler of the thumbnails, reused across documents
+static __thread struct SwsContext *sws_ctx = NULL;
+
 int store_thumbnail_jpeg(scan_raw_ctx_t *ctx, libraw_thumbnail_t img, document_t *doc) {
 
     scan_media_ctx_t media_ctx = {
@@ -17,6 +20,7 @@ int store_thumbnail_jpeg(scan_raw_ctx_t *ctx, libraw_thumbnail_t img, document_t
             .logf = ctx->logf,
             .tn_size = ctx->tn_size,
             .tn_qscale = ctx->tn_qscale,
+            .tn_compression = ctx->tn_compression,
             .tesseract_lang = NULL,
             .tesseract_path = NULL
     };
@@ -49,7 +53,8 @@ int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, do
 
     AVFrame *scaled_frame = av_frame_alloc();
 
-    struct SwsContext *sws_ctx = sws_getContext(
+    sws_ctx = sws_getCachedContext(
+            sws_ctx,
             img->width, img->height, AV_PIX_FMT_RGB24,
             dstW, dstH, AV_PIX_FMT_YUV420P,
             SIST_SWS_ALGO, 0, 0, 0
@@ -73,27 +78,82 @@ int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, do
     scaled_frame->height = dstH;
     scaled_frame->format = AV_PIX_FMT_YUV420P;
 
-    sws_freeContext(sws_ctx);
+    AVPacket *thumbnail_packet = encode_webp_thumbnail(scaled_frame, ctx->tn_qscale, ctx->tn_compression);
 
-    AVCodecContext *thumbnail_encoder = alloc_webp_encoder(scaled_frame->width, scaled_frame->height, ctx->tn_qscale);
-    avcodec_send_frame(thumbnail_encoder, scaled_frame);
-    avcodec_send_frame(thumbnail_encoder, NULL); // Send EOF
+    av_free(*scaled_frame->data);
+    av_frame_free(&scaled_frame);
 
-    AVPacket thumbnail_packet;
-    av_init_packet(&thumbnail_packet);
-    avcodec_receive_packet(thumbnail_encoder, &thumbnail_packet);
+    if (thumbnail_packet == NULL) {
+        return FALSE;
+    }
 
     doc->thumbnail_count = 1;
-    APPEND_THUMBNAIL(doc, (char *) thumbnail_packet.data, thumbnail_packet.size);
+    APPEND_THUMBNAIL(doc, (char *) thumbnail_packet->data, thumbnail_packet->size);
 
-    av_packet_unref(&thumbnail_packet);
-    av_free(*scaled_frame->data);
-    av_frame_free(&scaled_frame);
-    avcodec_free_context(&thumbnail_encoder);
+    av_packet_free(&thumbnail_packet);
 
     return TRUE;
 }
 
+/**
+ * Whether the thumbnail should be made from the preview image embedded in the
+ * raw file instead of decoding (demosaicing) the whole image.
+ */
+static int use_embedded_thumbnail(scan_raw_ctx_t *ctx, libraw_data_t *libraw_lib) {
+    switch (ctx->tn_source) {
+        case THUMBNAIL_SOURCE_EMBEDDED:
+            return TRUE;
+        case THUMBNAIL_SOURCE_DECODE:
+            return FALSE;
+        case THUMBNAIL_SOURCE_AUTO:
+        default: {
+            int width = libraw_lib->thumbnail.twidth;
+            int height = libraw_lib->thumbnail.theight;
+
+            // The size of the preview is not always known before it is unpacked
+            if (width == 0 || height == 0) {
+                return TRUE;
+            }
+            return MAX(width, height) >= ctx->tn_size;
+        }
+    }
+}
+
+static int store_embedded_thumbnail(scan_raw_ctx_t *ctx, libraw_data_t *libraw_lib, document_t *doc) {
+    int unpack_ret = libraw_unpack_thumb(libraw_lib);
+    if (unpack_ret != 0) {
+        CTX_LOG_DEBUGF(doc->filepath, "libraw_unpack_thumb returned error code %d", unpack_ret);
+        return FALSE;
+    }
+
+    if (ctx->tn_source == THUMBNAIL_SOURCE_AUTO
+        && MAX(libraw_lib->thumbnail.twidth, libraw_lib->thumbnail.theight) < ctx->tn_size) {
+        return FALSE;
+    }
+
+    if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) {
+        // Stored as-is when it is not larger than tn_size
+        return store_thumbnail_jpeg(ctx, libraw_lib->thumbnail, doc);
+    }
+
+    if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_BITMAP) {
+        // TODO: technically this should work but is currently untested
+
+        int errc = 0;
+        libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(libraw_lib, &errc);
+        if (errc != 0) {
+            libraw_dcraw_clear_mem(thumb);
+            return FALSE;
+        }
+
+        int tn_ok = store_thumbnail_rgb24(ctx, thumb, doc);
+        libraw_dcraw_clear_mem(thumb);
+        return tn_ok;
+    }
+
+    return FALSE;
+}
+
 #define DMS_REF(ref) (((ref) == 'S' || (ref) == 'W') ? -1 : 1)
 
 void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
@@ -104,14 +164,29 @@ void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
         return;
     }
 
-    size_t buf_len = 0;
-    void *buf = read_all(f, &buf_len);
-    if (buf == NULL) {
-        CTX_LOG_ERROR(f->filepath, "read_all() failed");
-        return;
+    void *buf = NULL;
+    int ret;
+
+    if (f->is_fs_file) {
+        // LibRaw reads the file by itself, only the parts it needs are loaded
+        if (f->calculate_checksum && read_checksum(f) != 0) {
+            CTX_LOG_ERROR(f->filepath, "read() failed");
+            libraw_close(libraw_lib);
+            return;
+        }
+        ret = libraw_open_file(libraw_lib, f->filepath);
+    } else {
+        // The C API of LibRaw has no custom datastream, files inside archives are loaded in memory
+        size_t buf_len = 0;
+        buf = read_all(f, &buf_len);
+        if (buf == NULL) {
+            CTX_LOG_ERROR(f->filepath, "read_all() failed");
+            libraw_close(libraw_lib);
+            return;
+        }
+        ret = libraw_open_buffer(libraw_lib, buf, buf_len);
     }
 
-    int ret = libraw_open_buffer(libraw_lib, buf, buf_len);
     if (ret != 0) {
         CTX_LOG_ERROR(f->filepath, "Could not open raw file");
         free(buf);
@@ -177,37 +252,19 @@ void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
         return;
     }
 
-    int unpack_ret = libraw_unpack_thumb(libraw_lib);
-    if (unpack_ret != 0) {
-        CTX_LOG_ERRORF(f->filepath, "libraw_unpack_thumb returned error code %d", unpack_ret);
-        free(buf);
-        libraw_close(libraw_lib);
-        return;
-    }
-
-    int tn_ok = 0;
+    if (use_embedded_thumbnail(ctx, libraw_lib)) {
+        int tn_ok = store_embedded_thumbnail(ctx, libraw_lib, doc);
 
-    if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) {
-        tn_ok = store_thumbnail_jpeg(ctx, libraw_lib->thumbnail, doc);
-    } else if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_BITMAP) {
-        // TODO: technically this should work but is currently untested
-
-        int errc = 0;
-        libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(libraw_lib, &errc);
-        if (errc != 0) {
+        if (tn_ok == TRUE || ctx->tn_source == THUMBNAIL_SOURCE_EMBEDDED) {
             free(buf);
-            libraw_dcraw_clear_mem(thumb);
             libraw_close(libraw_lib);
             return;
         }
-
-        tn_ok = store_thumbnail_rgb24(ctx, thumb, doc);
     }
 
-    if (tn_ok == TRUE) {
-        free(buf);
-        libraw_close(libraw_lib);
-        return;
+    // Half-size demosaicing is enough for the thumbnail, and needs a quarter of the memory
+    if (MAX(libraw_lib->sizes.width, libraw_lib->sizes.height) / 2 >= ctx->tn_size) {
+        libraw_lib->params.half_size = 1;
     }
 
     ret = libraw_unpack(libraw_lib);
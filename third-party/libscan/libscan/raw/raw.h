@@ -3,6 +3,11 @@
 
 #include "../scan.h"
 
+#define THUMBNAIL_SOURCE_AUTO 0
+#define THUMBNAIL_SOURCE_EMBEDDED 1
+#define THUMBNAIL_SOURCE_DECODE 2
+typedef int thumbnail_source_t;
+
 typedef struct {
     log_callback_t log;
     logf_callback_t logf;
@@ -10,6 +15,12 @@ typedef struct {
     int enable_tn;
     int tn_size;
     int tn_qscale;
+    int tn_compression;
+    /**
+     * auto: use the embedded preview if it is at least tn_size pixels,
+     * embedded: always use the embedded preview, decode: always decode the raw image
+     */
+    thumbnail_source_t tn_source;
 } scan_raw_ctx_t;
 
 void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc);
@@ -51,8 +51,6 @@ typedef int scan_code_t;
 // 0000000.000000000
 #define SIST_SID_LEN 18
 
-#define EBOOK_LOCKS 0
-
 enum metakey {
     // String
     MetaContent = 1,
@@ -108,6 +106,20 @@ typedef struct meta_line {
     };
 } meta_line_t;
 
+typedef struct scan_arena_block scan_arena_block_t;
+
+/**
+ * Bump allocator for the memory of a single parse job, released all at once
+ * with scan_arena_reset().
+ */
+typedef struct {
+    scan_arena_block_t *head;
+    /** Number of allocations served by the arena */
+    long alloc_count;
+    long alloc_bytes;
+    /** Number of blocks that had to be allocated on the heap */
+    long block_count;
+} scan_arena_t;
 
 typedef struct document {
     unsigned long size;
@@ -118,8 +130,12 @@ typedef struct document {
     meta_line_t *meta_head;
     meta_line_t *meta_tail;
     int thumbnail_count;
-    char filepath[PATH_MAX * 2 + 1];
-    char parent[PATH_MAX * 2 + 1];
+    /** Backs the meta lines of the document, NULL if they are allocated with malloc() */
+    scan_arena_t *arena;
+    /** Owned by the parse job, valid until the document is written */
+    const char *filepath;
+    /** Path of the archive that contains the document, empty for files on disk */
+    const char *parent;
 } document_t;
 
 typedef struct vfile vfile_t;
@@ -144,7 +160,8 @@ typedef struct vfile {
     int is_fs_file;
     int has_checksum;
     int calculate_checksum;
-    char filepath[PATH_MAX * 2 + 1];
+    /** Owned by the parse job */
+    const char *filepath;
 
     int mtime;
     size_t st_size;
@@ -168,10 +185,16 @@ typedef struct {
     int base;
     int ext;
     struct vfile vfile;
-    char parent[PATH_MAX * 2 + 1];
-    char filepath[PATH_MAX * 2 + 1];
+    scan_arena_t arena;
+    /** Path of the archive that contains the file, it outlives the job */
+    const char *parent;
+    /** Stored right after the job for jobs created with create_parse_job() */
+    char *filepath;
 } parse_job_t;
 
+// Longer paths of files inside archives are truncated
+#define SCAN_PATH_MAX (PATH_MAX * 2)
+
 #define IS_SUB_JOB(job) ((job)->parent[0] != '\0')
 
 
@@ -39,7 +39,7 @@ scan_code_t parse_text(scan_text_ctx_t *ctx, vfile_t *f, document_t *doc) {
     return SCAN_OK;
 }
 
-#define MAX_MARKUP_SIZE (1024 * 1024)
+#define MARKUP_CHUNK_SIZE (1024 * 64)
 
 scan_code_t parse_markup(scan_text_ctx_t *ctx, vfile_t *f, document_t *doc) {
 
@@ -47,20 +47,40 @@ scan_code_t parse_markup(scan_text_ctx_t *ctx, vfile_t *f, document_t *doc) {
         return SCAN_OK;
     }
 
-    int to_read = MIN(MAX_MARKUP_SIZE, f->st_size);
-
-    char *buf = malloc(to_read + 1);
-    int ret = f->read(f, buf, to_read);
-    if (ret < 0) {
-        CTX_LOG_ERRORF(doc->filepath, "read() returned error code: [%d]", ret);
-        free(buf);
-        return SCAN_ERR_READ;
-    }
-
-    *(buf + to_read) = '\0';
+    char *buf = malloc(MARKUP_CHUNK_SIZE);
+    size_t buf_len = 0;
+    size_t total_read = 0;
 
     text_buffer_t tex = text_buffer_create(ctx->content_size);
-    text_buffer_append_markup(&tex, buf);
+    markup_parser_t parser = markup_parser_create();
+
+    while (TRUE) {
+        size_t to_read = MIN(MARKUP_CHUNK_SIZE - buf_len, f->st_size - total_read);
+
+        int ret = 0;
+        if (to_read > 0) {
+            ret = f->read(f, buf + buf_len, to_read);
+            if (ret < 0) {
+                CTX_LOG_ERRORF(doc->filepath, "read() returned error code: [%d]", ret);
+                free(buf);
+                text_buffer_destroy(&tex);
+                return SCAN_ERR_READ;
+            }
+        }
+
+        total_read += ret;
+        buf_len += ret;
+        int eof = ret == 0;
+
+        long consumed = text_buffer_append_markup_chunk(&tex, &parser, buf, buf_len, eof);
+        if (consumed == TEXT_BUF_FULL || eof) {
+            break;
+        }
+
+        // Keep the unconsumed tail for the next chunk
+        buf_len -= consumed;
+        memmove(buf, buf + consumed, buf_len);
+    }
     text_buffer_terminate_string(&tex);
 
     APPEND_STR_META(doc, MetaContent, tex.dyn_buffer.buf);
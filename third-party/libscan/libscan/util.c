@@ -0,0 +1,82 @@
+#include "scan.h"
+
+#define ARENA_ALIGNMENT 16
+
+struct scan_arena_block {
+    struct scan_arena_block *next;
+    size_t size;
+    size_t cur;
+    _Alignas(ARENA_ALIGNMENT) char data[];
+};
+
+static __thread scan_arena_block_t *free_blocks = NULL;
+static __thread int free_block_count = 0;
+
+void scan_arena_init(scan_arena_t *arena) {
+    arena->head = NULL;
+    arena->alloc_count = 0;
+    arena->alloc_bytes = 0;
+    arena->block_count = 0;
+}
+
+static scan_arena_block_t *arena_new_block(scan_arena_t *arena, size_t size) {
+    scan_arena_block_t *block;
+
+    if (size <= ARENA_BLOCK_SIZE && free_blocks != NULL) {
+        block = free_blocks;
+        free_blocks = block->next;
+        free_block_count -= 1;
+    } else {
+        size = MAX(size, ARENA_BLOCK_SIZE);
+        block = malloc(sizeof(scan_arena_block_t) + size);
+        block->size = size;
+        arena->block_count += 1;
+    }
+
+    block->cur = 0;
+    return block;
+}
+
+void *scan_arena_alloc(scan_arena_t *arena, size_t size) {
+    size_t aligned_size = (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+
+    arena->alloc_count += 1;
+    arena->alloc_bytes += (long) size;
+
+    scan_arena_block_t *block = arena->head;
+    if (block == NULL || block->cur + aligned_size > block->size) {
+        block = arena_new_block(arena, aligned_size);
+
+        // Oversized blocks go behind the current one so that its free space is not lost
+        if (arena->head != NULL && block->size > ARENA_BLOCK_SIZE) {
+            block->next = arena->head->next;
+            arena->head->next = block;
+        } else {
+            block->next = arena->head;
+            arena->head = block;
+        }
+    }
+
+    void *ptr = block->data + block->cur;
+    block->cur += aligned_size;
+    return ptr;
+}
+
+void scan_arena_reset(scan_arena_t *arena) {
+    scan_arena_block_t *block = arena->head;
+
+    while (block != NULL) {
+        scan_arena_block_t *next = block->next;
+
+        if (block->size == ARENA_BLOCK_SIZE && free_block_count < ARENA_MAX_FREE_BLOCKS) {
+            block->next = free_blocks;
+            free_blocks = block;
+            free_block_count += 1;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+
+    arena->head = NULL;
+}
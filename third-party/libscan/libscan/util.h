@@ -13,6 +13,23 @@
 #define TEXT_BUF_FULL (-1)
 #define INITIAL_BUF_SIZE (1024 * 16)
 
+#define ARENA_BLOCK_SIZE (1024 * 64)
+// Blocks kept by each thread for the next jobs
+#define ARENA_MAX_FREE_BLOCKS 16
+
+void scan_arena_init(scan_arena_t *arena);
+
+/**
+ * Allocate size bytes from the arena. The memory is only released by scan_arena_reset().
+ */
+void *scan_arena_alloc(scan_arena_t *arena, size_t size);
+
+/**
+ * Release all the allocations of the arena at once. Regular blocks are kept by
+ * the current thread and reused by the next arena.
+ */
+void scan_arena_reset(scan_arena_t *arena);
+
 #define SHOULD_IGNORE_CHAR(c) !(SHOULD_KEEP_CHAR(c))
 #define SHOULD_KEEP_CHAR(c) (\
     ((c) >= '\'' && (c) <= ';') || \
@@ -234,6 +251,15 @@ static int text_buffer_append_string16_be(text_buffer_t *buf, const char *str, s
     return ret;
 }
 
+static int is_ascii(const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((unsigned char) str[i] >= 0x80) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 #define UTF8_END_OF_STRING \
     (ptr - str >= len || *ptr == 0 || \
     (0xc0 == (0xe0 & *ptr) && ptr - str > len - 2) || \
@@ -249,10 +275,11 @@ static int text_buffer_append_string(text_buffer_t *buf, const char *str, size_t
         return 0;
     }
 
-    if (len <= 4) {
+    // Short ASCII runs are common between tags and entities, multibyte runs take the UTF-8 path
+    if (len <= 4 && is_ascii(str, len)) {
         for (int i = 0; i < len; i++) {
-            if (((utf8_int32_t) 0xffffff80 & str[i]) == 0 && SHOULD_KEEP_CHAR(str[i])) {
-                dyn_buffer_write_char(&buf->dyn_buffer, str[i]);
+            if (text_buffer_append_char(buf, str[i]) == TEXT_BUF_FULL) {
+                return TEXT_BUF_FULL;
             }
         }
         return 0;
@@ -285,46 +312,307 @@ static int text_buffer_append_string0(text_buffer_t *buf, const char *str) {
     return text_buffer_append_string(buf, str, strlen(str));
 }
 
-static int text_buffer_append_markup(text_buffer_t *buf, const char *markup) {
+#define MARKUP_STATE_TEXT 0
+#define MARKUP_STATE_TAG 1
+#define MARKUP_STATE_COMMENT 2
+#define MARKUP_STATE_RAW_TEXT 3
+
+// Longest prefix that needs to be visible to recognize a tag or an entity
+#define MARKUP_LOOKAHEAD 12
+
+typedef struct {
+    int state;
+    /** Closing tag that ends the current <script> or <style> body */
+    const char *raw_text_end;
+} markup_parser_t;
+
+static markup_parser_t markup_parser_create() {
+    markup_parser_t parser;
+
+    parser.state = MARKUP_STATE_TEXT;
+    parser.raw_text_end = NULL;
+
+    return parser;
+}
+
+/**
+ * Number of trailing bytes of str that form an incomplete UTF-8 sequence
+ */
+static size_t utf8_incomplete_suffix(const char *str, size_t len) {
+    for (size_t i = 1; i <= 3 && i <= len; i++) {
+        unsigned char c = (unsigned char) str[len - i];
+
+        if ((c & 0xc0) == 0x80) {
+            continue;
+        }
+
+        size_t seq_len = 1;
+        if ((c & 0xe0) == 0xc0) {
+            seq_len = 2;
+        } else if ((c & 0xf0) == 0xe0) {
+            seq_len = 3;
+        } else if ((c & 0xf8) == 0xf0) {
+            seq_len = 4;
+        }
+
+        return seq_len > i ? i : 0;
+    }
+    return 0;
+}
 
-    int tag_open = TRUE;
-    const char *ptr = markup;
-    const char *start = markup;
+static const struct {
+    const char *name;
+    int c;
+} MarkupEntities[] = {
+        {"amp",    '&'},
+        {"lt",     '<'},
+        {"gt",     '>'},
+        {"quot",   '"'},
+        {"apos",   '\''},
+        {"nbsp",   0x00A0},
+        {"copy",   0x00A9},
+        {"reg",    0x00AE},
+        {"laquo",  0x00AB},
+        {"raquo",  0x00BB},
+        {"ndash",  0x2013},
+        {"mdash",  0x2014},
+        {"lsquo",  0x2018},
+        {"rsquo",  0x2019},
+        {"ldquo",  0x201C},
+        {"rdquo",  0x201D},
+        {"hellip", 0x2026},
+        {"euro",   0x20AC},
+        {"trade",  0x2122},
+};
+
+/**
+ * Decode the body of an entity (without the leading '&' and the trailing ';').
+ * @return the code point, or 0 if the entity is unknown
+ */
+static int markup_decode_entity(const char *entity, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
 
-    while (*ptr != '\0') {
-        if (tag_open) {
-            if (*ptr == '>') {
-                tag_open = FALSE;
-                start = ptr + 1;
+    if (entity[0] == '#') {
+        int base = 10;
+        size_t i = 1;
+        if (len > 1 && (entity[1] == 'x' || entity[1] == 'X')) {
+            base = 16;
+            i = 2;
+        }
+        if (i == len) {
+            return 0;
+        }
+
+        int c = 0;
+        for (; i < len; i++) {
+            int digit;
+            if (entity[i] >= '0' && entity[i] <= '9') {
+                digit = entity[i] - '0';
+            } else if (base == 16 && (entity[i] | 0x20) >= 'a' && (entity[i] | 0x20) <= 'f') {
+                digit = (entity[i] | 0x20) - 'a' + 10;
+            } else {
+                return 0;
             }
-        } else {
-            if (*ptr == '<') {
-                tag_open = TRUE;
-                if (ptr != start) {
-                    if (text_buffer_append_string(buf, start, (ptr - start)) == TEXT_BUF_FULL) {
-                        return TEXT_BUF_FULL;
-                    }
-                    if (text_buffer_append_char(buf, ' ') == TEXT_BUF_FULL) {
-                        return TEXT_BUF_FULL;
-                    }
-                }
+            c = c * base + digit;
+            if (c > 0x10FFFF) {
+                return 0;
             }
         }
 
-        ptr += 1;
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            return 0;
+        }
+        return c;
     }
 
-    if (ptr != start) {
-        if (text_buffer_append_string(buf, start, (ptr - start)) == TEXT_BUF_FULL) {
-            return TEXT_BUF_FULL;
+    for (int i = 0; i < sizeof(MarkupEntities) / sizeof(MarkupEntities[0]); i++) {
+        if (strlen(MarkupEntities[i].name) == len && memcmp(MarkupEntities[i].name, entity, len) == 0) {
+            return MarkupEntities[i].c;
         }
-        if (text_buffer_append_char(buf, ' ') == TEXT_BUF_FULL) {
-            return TEXT_BUF_FULL;
+    }
+    return 0;
+}
+
+static int markup_is_tag_name(const char *ptr, const char *end, const char *name) {
+    size_t len = strlen(name);
+
+    if (end - ptr < len + 1 || strncasecmp(ptr, name, len) != 0) {
+        return FALSE;
+    }
+
+    char next = ptr[len];
+    return next == '>' || next == '/' || next == ' ' || next == '\t' || next == '\n' || next == '\r';
+}
+
+/**
+ * Strip tags from a chunk of HTML/XML and append the text to buf. <script> and
+ * <style> bodies and comments are skipped, common entities are decoded.
+ *
+ * The parser state is kept across calls, so the input can be fed in chunks of
+ * any size. Bytes that could not be interpreted yet (a partial tag name, entity
+ * or UTF-8 sequence at the end of the chunk) are not consumed and must be
+ * passed again at the start of the next chunk. When eof is set, the whole chunk
+ * is consumed.
+ *
+ * @return number of bytes consumed, or TEXT_BUF_FULL
+ */
+static long text_buffer_append_markup_chunk(text_buffer_t *buf, markup_parser_t *parser,
+                                            const char *chunk, size_t len, int eof) {
+
+    const char *ptr = chunk;
+    const char *end = chunk + len;
+
+    while (ptr < end) {
+        if (parser->state == MARKUP_STATE_TEXT) {
+            const char *lt = memchr(ptr, '<', end - ptr);
+            const char *run_end = lt == NULL ? end : lt;
+            const char *amp = memchr(ptr, '&', run_end - ptr);
+            if (amp != NULL) {
+                run_end = amp;
+            }
+
+            if (run_end == end && !eof) {
+                if (end - ptr < MARKUP_LOOKAHEAD) {
+                    break;
+                }
+                run_end -= utf8_incomplete_suffix(ptr, end - ptr);
+            }
+
+            if (run_end != ptr) {
+                if (text_buffer_append_string(buf, ptr, run_end - ptr) == TEXT_BUF_FULL) {
+                    return TEXT_BUF_FULL;
+                }
+                ptr = run_end;
+            }
+
+            if (ptr == end || (*ptr != '<' && *ptr != '&')) {
+                // Incomplete UTF-8 sequence
+                break;
+            }
+
+            if (end - ptr < MARKUP_LOOKAHEAD && !eof) {
+                break;
+            }
+
+            if (*ptr == '&') {
+                const char *semicolon = memchr(ptr + 1, ';', MIN(end - ptr - 1, MARKUP_LOOKAHEAD - 1));
+                int c = semicolon == NULL ? 0 : markup_decode_entity(ptr + 1, semicolon - ptr - 1);
+
+                if (c != 0) {
+                    ptr = semicolon + 1;
+                } else {
+                    c = '&';
+                    ptr += 1;
+                }
+
+                if (text_buffer_append_char(buf, c) == TEXT_BUF_FULL) {
+                    return TEXT_BUF_FULL;
+                }
+                continue;
+            }
+
+            if (text_buffer_append_char(buf, ' ') == TEXT_BUF_FULL) {
+                return TEXT_BUF_FULL;
+            }
+
+            if (end - ptr >= 4 && memcmp(ptr, "<!--", 4) == 0) {
+                parser->state = MARKUP_STATE_COMMENT;
+                ptr += 4;
+                continue;
+            }
+
+            if (markup_is_tag_name(ptr + 1, end, "script")) {
+                parser->raw_text_end = "</script";
+            } else if (markup_is_tag_name(ptr + 1, end, "style")) {
+                parser->raw_text_end = "</style";
+            }
+            parser->state = MARKUP_STATE_TAG;
+            ptr += 1;
+
+        } else if (parser->state == MARKUP_STATE_TAG) {
+            const char *gt = memchr(ptr, '>', end - ptr);
+            if (gt == NULL) {
+                // Keep the last byte to detect self-closing tags
+                ptr = eof ? end : MAX(ptr, end - 1);
+                break;
+            }
+
+            if (parser->raw_text_end != NULL && (gt == chunk || *(gt - 1) != '/')) {
+                parser->state = MARKUP_STATE_RAW_TEXT;
+            } else {
+                parser->raw_text_end = NULL;
+                parser->state = MARKUP_STATE_TEXT;
+            }
+            ptr = gt + 1;
+
+        } else if (parser->state == MARKUP_STATE_COMMENT) {
+            const char *comment_end = memmem(ptr, end - ptr, "-->", 3);
+            if (comment_end == NULL) {
+                ptr = eof ? end : MAX(ptr, end - 2);
+                break;
+            }
+
+            parser->state = MARKUP_STATE_TEXT;
+            ptr = comment_end + 3;
+
+        } else {
+            const char *lt = memchr(ptr, '<', end - ptr);
+            if (lt == NULL) {
+                ptr = end;
+                break;
+            }
+
+            size_t end_tag_len = strlen(parser->raw_text_end);
+            if (end - lt < end_tag_len && !eof) {
+                ptr = lt;
+                break;
+            }
+
+            if (end - lt >= end_tag_len && strncasecmp(lt, parser->raw_text_end, end_tag_len) == 0) {
+                parser->raw_text_end = NULL;
+                parser->state = MARKUP_STATE_TAG;
+                ptr = lt + end_tag_len;
+            } else {
+                ptr = lt + 1;
+            }
         }
     }
+
+    return eof ? (long) len : ptr - chunk;
+}
+
+static int text_buffer_append_markup(text_buffer_t *buf, const char *markup) {
+    markup_parser_t parser = markup_parser_create();
+
+    long ret = text_buffer_append_markup_chunk(buf, &parser, markup, strlen(markup), TRUE);
+    if (ret == TEXT_BUF_FULL) {
+        return TEXT_BUF_FULL;
+    }
+
+    if (text_buffer_append_char(buf, ' ') == TEXT_BUF_FULL) {
+        return TEXT_BUF_FULL;
+    }
     return 0;
 }
 
+/**
+ * Allocate a meta line for doc, from its arena if it has one
+ */
+static meta_line_t *meta_line_alloc(document_t *doc, size_t size) {
+    if (doc->arena != NULL) {
+        return (meta_line_t *) scan_arena_alloc(doc->arena, size);
+    }
+    return (meta_line_t *) malloc(size);
+}
+
+static void meta_line_free(document_t *doc, meta_line_t *meta) {
+    if (doc->arena == NULL) {
+        free(meta);
+    }
+}
+
 static void *read_all(vfile_t *f, size_t *size) {
     void *buf = malloc(f->st_size);
     *size = f->read(f, buf, f->st_size);
@@ -337,6 +625,33 @@ static void *read_all(vfile_t *f, size_t *size) {
     return buf;
 }
 
+#define CHECKSUM_BUF_SIZE (1024 * 64)
+
+/**
+ * Read the rest of the file through the vfile so that its checksum is complete,
+ * without keeping it in memory.
+ * @return 0 on success
+ */
+static int read_checksum(vfile_t *f) {
+    char *buf = malloc(CHECKSUM_BUF_SIZE);
+    size_t total_read = 0;
+
+    while (total_read < f->st_size) {
+        int ret = f->read(f, buf, CHECKSUM_BUF_SIZE);
+        if (ret < 0) {
+            free(buf);
+            return ret;
+        }
+        if (ret == 0) {
+            break;
+        }
+        total_read += ret;
+    }
+
+    free(buf);
+    return 0;
+}
+
 #define STACK_BUFFER_SIZE (size_t)(4096 * 8)
 
 __always_inline
@@ -360,12 +675,16 @@ static void safe_digest_update(EVP_MD_CTX *ctx, void *buf, size_t size) {
 }
 
 static parse_job_t *create_parse_job(const char *filepath, int mtime, size_t st_size) {
-    parse_job_t *job = (parse_job_t *) malloc(sizeof(parse_job_t));
+    size_t filepath_len = strlen(filepath);
+
+    // The job and its path are allocated (and freed) together
+    parse_job_t *job = (parse_job_t *) malloc(sizeof(parse_job_t) + filepath_len + 1);
 
-    job->parent[0] = '\0';
+    job->parent = "";
 
-    strcpy(job->filepath, filepath);
-    strcpy(job->vfile.filepath, filepath);
+    job->filepath = (char *) (job + 1);
+    memcpy(job->filepath, filepath, filepath_len + 1);
+    job->vfile.filepath = job->filepath;
     job->vfile.st_size = st_size;
     job->vfile.mtime = mtime;
 
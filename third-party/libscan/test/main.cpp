@@ -13,9 +13,16 @@ extern "C" {
 #include "../libscan/msdoc/msdoc.h"
 #include "../libscan/wpd/wpd.h"
 #include "../libscan/json/json.h"
+#include "../libscan/json/json_writer.h"
 #include <libavutil/avutil.h>
+#include <cjson/cJSON.h>
+#include <archive.h>
+#include <archive_entry.h>
 }
 
+#include <chrono>
+#include <string>
+
 static scan_arc_ctx_t arc_recurse_media_ctx;
 static scan_arc_ctx_t arc_list_ctx;
 static scan_arc_ctx_t arc_recurse_ooxml_ctx;
@@ -206,6 +213,53 @@ TEST(TextMarkup, Xml1) {
     cleanup(&doc, &f);
 }
 
+TEST(TextMarkup, ScriptStyleEntities) {
+    const char *content = "<html><head><style>body { color: red; }</style>"
+                          "<script type=\"text/javascript\">if (a < b) { alert('x'); }</script></head>"
+                          "<body>Hello <b>world</b><!-- hidden > text --> caf&#233; &amp; &#x4E2D;</body></html>";
+    vfile_t f;
+    document_t doc;
+    load_doc_mem((void *) content, strlen(content), &f, &doc);
+
+    parse_markup(&text_500_ctx, &f, &doc);
+
+    ASSERT_STREQ(get_meta(&doc, MetaContent)->str_val, "Hello world café 中");
+    cleanup(&doc, &f);
+}
+
+TEST(TextMarkup, ShortUtf8Runs) {
+    const char *content = "<p><b>é</b> <i>中</i>&amp;ü</p>";
+    vfile_t f;
+    document_t doc;
+    load_doc_mem((void *) content, strlen(content), &f, &doc);
+
+    parse_markup(&text_500_ctx, &f, &doc);
+
+    ASSERT_STREQ(get_meta(&doc, MetaContent)->str_val, "é 中 ü");
+    cleanup(&doc, &f);
+}
+
+TEST(TextMarkup, LargeEarlyStop) {
+    size_t content_len = 1024 * 1024 * 8;
+    char *content = (char *) malloc(content_len + 1);
+    for (size_t i = 0; i < content_len; i++) {
+        content[i] = "<p>lorem ipsum</p>\n"[i % 19];
+    }
+    content[content_len] = '\0';
+
+    vfile_t f;
+    document_t doc;
+    load_doc_mem((void *) content, content_len, &f, &doc);
+
+    parse_markup(&text_500_ctx, &f, &doc);
+
+    ASSERT_NEAR(strlen(get_meta(&doc, MetaContent)->str_val), 500, 4);
+    // Only the first chunk should have been read
+    ASSERT_LT((char *) f._test_data - content, 1024 * 1024);
+    cleanup(&doc, &f);
+    free(content);
+}
+
 /* Ebook */
 
 TEST(Ebook, CandlePdf) {
@@ -393,6 +447,131 @@ TEST(Comic, ComicCbrFilters) {
     cleanup(&doc, &f);
 }
 
+static std::string encode_test_jpeg(int width, int height) {
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    AVCodecContext *enc = avcodec_alloc_context3(codec);
+    enc->width = width;
+    enc->height = height;
+    enc->time_base = {1, 1};
+    enc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    EXPECT_EQ(avcodec_open2(enc, codec, nullptr), 0);
+
+    AVFrame *frame = av_frame_alloc();
+    frame->width = width;
+    frame->height = height;
+    frame->format = enc->pix_fmt;
+    av_frame_get_buffer(frame, 0);
+    memset(frame->data[0], 200, frame->linesize[0] * height);
+    memset(frame->data[1], 128, frame->linesize[1] * height / 2);
+    memset(frame->data[2], 128, frame->linesize[2] * height / 2);
+
+    AVPacket *packet = av_packet_alloc();
+    avcodec_send_frame(enc, frame);
+    avcodec_send_frame(enc, nullptr);
+    EXPECT_EQ(avcodec_receive_packet(enc, packet), 0);
+    std::string data((const char *) packet->data, packet->size);
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    return data;
+}
+
+/**
+ * Comic with a landscape page10.jpg stored before a portrait page2.jpg
+ */
+static void write_test_comic(const char *path, int zip) {
+    struct archive *a = archive_write_new();
+    if (zip) {
+        archive_write_set_format_zip(a);
+    } else {
+        archive_write_set_format_pax_restricted(a);
+    }
+    ASSERT_EQ(archive_write_open_filename(a, path), ARCHIVE_OK);
+
+    const char *names[] = {"page10.jpg", "page2.jpg"};
+    std::string pages[] = {encode_test_jpeg(96, 32), encode_test_jpeg(32, 96)};
+
+    for (int i = 0; i < 2; i++) {
+        struct archive_entry *entry = archive_entry_new();
+        archive_entry_set_pathname(entry, names[i]);
+        archive_entry_set_size(entry, (la_int64_t) pages[i].size());
+        archive_entry_set_filetype(entry, AE_IFREG);
+        archive_entry_set_perm(entry, 0644);
+        ASSERT_EQ(archive_write_header(a, entry), ARCHIVE_OK);
+        ASSERT_EQ(archive_write_data(a, pages[i].data(), pages[i].size()), (la_ssize_t) pages[i].size());
+        archive_entry_free(entry);
+    }
+
+    archive_write_close(a);
+    archive_write_free(a);
+}
+
+static void get_thumbnail_dimensions(meta_line_t *meta, int *width, int *height) {
+    // Images smaller than tn_size are stored as-is
+    int is_jpeg = meta->size > 2 && (unsigned char) meta->str_val[0] == 0xFF && (unsigned char) meta->str_val[1] == 0xD8;
+    const AVCodec *codec = avcodec_find_decoder(is_jpeg ? AV_CODEC_ID_MJPEG : AV_CODEC_ID_WEBP);
+    AVCodecContext *dec = avcodec_alloc_context3(codec);
+    ASSERT_EQ(avcodec_open2(dec, codec, nullptr), 0);
+
+    AVPacket *packet = av_packet_alloc();
+    packet->data = (uint8_t *) meta->str_val;
+    packet->size = (int) meta->size;
+    AVFrame *frame = av_frame_alloc();
+
+    ASSERT_EQ(avcodec_send_packet(dec, packet), 0);
+    ASSERT_EQ(avcodec_receive_frame(dec, frame), 0);
+    *width = frame->width;
+    *height = frame->height;
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&dec);
+}
+
+TEST(Comic, CoverSortedName) {
+    std::string path = testing::TempDir() + "libscan_cover_order.cbz";
+    write_test_comic(path.c_str(), TRUE);
+
+    vfile_t f;
+    document_t doc;
+    load_doc_file(path.c_str(), &f, &doc);
+
+    parse_comic(&comic_ctx, &f, &doc);
+
+    // page2.jpg comes first in version order, although it is stored second
+    meta_line_t *tn = get_meta(&doc, MetaThumbnail);
+    ASSERT_NE(tn, nullptr);
+    int width, height;
+    get_thumbnail_dimensions(tn, &width, &height);
+    ASSERT_LT(width, height);
+
+    cleanup(&doc, &f);
+    remove(path.c_str());
+}
+
+TEST(Comic, CoverStreamOrder) {
+    // Like RAR, tar archives cannot be listed without reading them
+    std::string path = testing::TempDir() + "libscan_cover_order.cbt";
+    write_test_comic(path.c_str(), FALSE);
+
+    vfile_t f;
+    document_t doc;
+    load_doc_file(path.c_str(), &f, &doc);
+
+    parse_comic(&comic_ctx, &f, &doc);
+
+    // The first page in archive order is used
+    meta_line_t *tn = get_meta(&doc, MetaThumbnail);
+    ASSERT_NE(tn, nullptr);
+    int width, height;
+    get_thumbnail_dimensions(tn, &width, &height);
+    ASSERT_GT(width, height);
+
+    cleanup(&doc, &f);
+    remove(path.c_str());
+}
+
 
 /* Media (image) */
 
@@ -483,6 +662,62 @@ TEST(MediaImage, Mem2AsIs) {
     cleanup(&doc, &f);
 }
 
+#ifdef SIST_DEBUG
+TEST(MediaImage, WebpEncoderReused) {
+    AVFrame *frame = av_frame_alloc();
+    frame->width = 64;
+    frame->height = 48;
+    frame->format = AV_PIX_FMT_YUV420P;
+    ASSERT_EQ(av_frame_get_buffer(frame, 0), 0);
+
+    for (int plane = 0; plane < 3; plane++) {
+        memset(frame->data[plane], 128, frame->linesize[plane] * (plane == 0 ? 48 : 24));
+    }
+
+    long open_count = media_webp_encoder_open_count();
+
+    // Settings that no other test uses, so that the encoder is not cached yet
+    AVPacket *first = encode_webp_thumbnail(frame, 17, 3);
+    AVPacket *second = encode_webp_thumbnail(frame, 17, 3);
+
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    ASSERT_GT(second->size, 0);
+    ASSERT_EQ(media_webp_encoder_open_count(), open_count + 1);
+
+    av_packet_free(&first);
+    av_packet_free(&second);
+    av_frame_free(&frame);
+}
+
+TEST(MediaImage, LargeJpegLowres) {
+    std::string path = testing::TempDir() + "libscan_large.jpg";
+    std::string jpeg = encode_test_jpeg(4000, 3000);
+    FILE *file = fopen(path.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(fwrite(jpeg.data(), 1, jpeg.size(), file), jpeg.size());
+    fclose(file);
+
+    vfile_t f;
+    document_t doc;
+    load_doc_file(path.c_str(), &f, &doc);
+
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+
+    // Decoded at 1/8 scale (500x375), which is still as large as the thumbnail
+    ASSERT_GT(media_last_thumbnail_lowres(), 0);
+
+    meta_line_t *tn = get_meta(&doc, MetaThumbnail);
+    ASSERT_NE(tn, nullptr);
+    int width, height;
+    get_thumbnail_dimensions(tn, &width, &height);
+    ASSERT_GE(MAX(width, height), media_ctx.tn_size);
+
+    cleanup(&doc, &f);
+    remove(path.c_str());
+}
+#endif
+
 TEST(MediaVideo, VidMkvSubDisabled) {
     vfile_t f;
     document_t doc;
@@ -530,6 +765,141 @@ TEST(MediaVideo, Vid3Mp4) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaVideo, Vid3Mp4KeyframeThumbnail) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+    doc.thumbnail_count = 0;
+
+    scan_media_ctx_t ctx = media_ctx;
+    ctx.tn_decode_threads = 4;
+
+    parse_media(&ctx, &f, &doc, "video/mp4");
+
+    ASSERT_EQ(doc.thumbnail_count, 1);
+
+    cleanup(&doc, &f);
+}
+
+/**
+ * Write a 64x64 Matroska video of the given length, at one frame per second
+ */
+static void write_test_video(const char *path, AVCodecID codec_id, int gop_size, int seconds) {
+    AVFormatContext *out = nullptr;
+    ASSERT_GE(avformat_alloc_output_context2(&out, nullptr, "matroska", path), 0);
+
+    const AVCodec *codec = avcodec_find_encoder(codec_id);
+    ASSERT_NE(codec, nullptr);
+    AVCodecContext *enc = avcodec_alloc_context3(codec);
+    enc->width = 64;
+    enc->height = 64;
+    enc->time_base = {1, 1};
+    enc->framerate = {1, 1};
+    enc->pix_fmt = codec_id == AV_CODEC_ID_MJPEG ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+    enc->gop_size = gop_size;
+    enc->max_b_frames = 0;
+    if (out->oformat->flags & AVFMT_GLOBALHEADER) {
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    ASSERT_EQ(avcodec_open2(enc, codec, nullptr), 0);
+
+    AVStream *stream = avformat_new_stream(out, nullptr);
+    avcodec_parameters_from_context(stream->codecpar, enc);
+    stream->time_base = enc->time_base;
+
+    ASSERT_GE(avio_open(&out->pb, path, AVIO_FLAG_WRITE), 0);
+    ASSERT_GE(avformat_write_header(out, nullptr), 0);
+
+    AVFrame *frame = av_frame_alloc();
+    frame->width = enc->width;
+    frame->height = enc->height;
+    frame->format = enc->pix_fmt;
+    av_frame_get_buffer(frame, 0);
+
+    AVPacket *packet = av_packet_alloc();
+    for (int i = 0; i <= seconds; i++) {
+        if (i < seconds) {
+            av_frame_make_writable(frame);
+            memset(frame->data[0], 16 + i * 3, frame->linesize[0] * frame->height);
+            memset(frame->data[1], 128, frame->linesize[1] * frame->height / 2);
+            memset(frame->data[2], 128, frame->linesize[2] * frame->height / 2);
+            frame->pts = i;
+            avcodec_send_frame(enc, frame);
+        } else {
+            avcodec_send_frame(enc, nullptr);
+        }
+
+        while (avcodec_receive_packet(enc, packet) == 0) {
+            av_packet_rescale_ts(packet, enc->time_base, stream->time_base);
+            packet->stream_index = 0;
+            av_interleaved_write_frame(out, packet);
+        }
+    }
+
+    av_write_trailer(out);
+    avio_closep(&out->pb);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    avformat_free_context(out);
+}
+
+static int count_thumbnails(document_t *doc) {
+    int count = 0;
+    for (meta_line_t *meta = get_meta(doc, MetaThumbnail); meta != nullptr;
+         meta = get_meta_from(meta->next, MetaThumbnail)) {
+        EXPECT_GT(meta->size, 0);
+        count += 1;
+    }
+    return count;
+}
+
+TEST(MediaVideo, KeyframeThumbnailPlanning) {
+    std::string path = testing::TempDir() + "libscan_keyframes.mkv";
+    // Every frame is a keyframe, small enough to be stored as-is
+    write_test_video(path.c_str(), AV_CODEC_ID_MJPEG, 1, 60);
+
+    vfile_t f;
+    document_t doc;
+    load_doc_file(path.c_str(), &f, &doc);
+    doc.thumbnail_count = 0;
+
+    scan_media_ctx_t ctx = media_ctx;
+    ctx.tn_count = 4;
+    ctx.tn_decode_threads = 4;
+
+    parse_media(&ctx, &f, &doc, "video/x-matroska");
+
+    ASSERT_EQ(doc.thumbnail_count, 4);
+    ASSERT_EQ(count_thumbnails(&doc), 4);
+
+    cleanup(&doc, &f);
+    remove(path.c_str());
+}
+
+TEST(MediaVideo, KeyframeThumbnailDedup) {
+    std::string path = testing::TempDir() + "libscan_single_keyframe.mkv";
+    // Only the first frame is a keyframe: all the targets resolve to it
+    write_test_video(path.c_str(), AV_CODEC_ID_MPEG4, 1000, 60);
+
+    vfile_t f;
+    document_t doc;
+    load_doc_file(path.c_str(), &f, &doc);
+    doc.thumbnail_count = 0;
+
+    scan_media_ctx_t ctx = media_ctx;
+    ctx.tn_count = 4;
+    ctx.tn_decode_threads = 4;
+
+    parse_media(&ctx, &f, &doc, "video/x-matroska");
+
+    ASSERT_EQ(doc.thumbnail_count, 1);
+    ASSERT_EQ(count_thumbnails(&doc), 1);
+
+    cleanup(&doc, &f);
+    remove(path.c_str());
+}
+
 TEST(MediaVideo, Vid3Ogv) {
     vfile_t f;
     document_t doc;
@@ -835,6 +1205,27 @@ TEST(RAW, Panasonic) {
     cleanup(&doc, &f);
 }
 
+TEST(RAW, PanasonicThumbnailSource) {
+    vfile_t f;
+    document_t doc;
+
+    scan_raw_ctx_t ctx = raw_ctx;
+
+    ctx.tn_source = THUMBNAIL_SOURCE_DECODE;
+    load_doc_file("libscan-test-files/test_files/raw/Panasonic.RW2", &f, &doc);
+    doc.thumbnail_count = 0;
+    parse_raw(&ctx, &f, &doc);
+    ASSERT_EQ(doc.thumbnail_count, 1);
+    cleanup(&doc, &f);
+
+    ctx.tn_source = THUMBNAIL_SOURCE_EMBEDDED;
+    load_doc_file("libscan-test-files/test_files/raw/Panasonic.RW2", &f, &doc);
+    doc.thumbnail_count = 0;
+    parse_raw(&ctx, &f, &doc);
+    ASSERT_EQ(doc.thumbnail_count, 1);
+    cleanup(&doc, &f);
+}
+
 TEST(RAW, ExifGps1) {
     vfile_t f;
     document_t doc;
@@ -1059,7 +1450,9 @@ TEST(Msdoc, TestFuzz1) {
 
         fuzz_buffer(buf_copy, &buf_len_copy, 3, 8, 5);
         FILE *file = fmemopen(buf_copy, buf_len_copy, "rb");
-        parse_msdoc_text(&msdoc_text_ctx, &doc, file, buf_copy, buf_len_copy);
+        parse_msdoc_text(&msdoc_text_ctx, &doc, file, buf_len_copy);
+        fclose(file);
+        free(buf_copy);
     }
     free(buf);
     cleanup(&doc, &f);
@@ -1098,6 +1491,221 @@ TEST(Json, NDJson1) {
     cleanup(&doc, &f);
 }
 
+TEST(Json, MemValuesOnly) {
+    const char *content = "{\"key\": \"value\", \"n\": 1, \"arr\": [\"a\", {\"k\": \"nested\"}],"
+                          " \"esc\": \"line\\nbreak \\u00e9t\\u00e9\"}";
+    vfile_t f;
+    document_t doc;
+    load_doc_mem((void *) content, strlen(content), &f, &doc);
+
+    parse_json(&json_ctx, &f, &doc);
+
+    ASSERT_STREQ(get_meta(&doc, MetaContent)->str_val, "value a nested line break été");
+    cleanup(&doc, &f);
+}
+
+TEST(Json, ShortUtf8Values) {
+    const char *content = "{\"a\":\"中\",\"b\":\"é\"}";
+    vfile_t f;
+    document_t doc;
+    load_doc_mem((void *) content, strlen(content), &f, &doc);
+
+    parse_json(&json_ctx, &f, &doc);
+
+    ASSERT_STREQ(get_meta(&doc, MetaContent)->str_val, "中 é");
+    cleanup(&doc, &f);
+}
+
+TEST(Json, NDJsonLargeEarlyStop) {
+    const char *line = "{\"k\": \"lorem ipsum\"}\n";
+    size_t line_len = strlen(line);
+    size_t content_len = line_len * 500000;
+    char *content = (char *) malloc(content_len + 1);
+    for (size_t i = 0; i < content_len; i += line_len) {
+        memcpy(content + i, line, line_len);
+    }
+    content[content_len] = '\0';
+
+    vfile_t f;
+    document_t doc;
+    load_doc_mem((void *) content, content_len, &f, &doc);
+
+    parse_ndjson(&json_ctx, &f, &doc);
+
+    ASSERT_NEAR(strlen(get_meta(&doc, MetaContent)->str_val), json_ctx.content_size, 4);
+    ASSERT_LT((char *) f._test_data - content, 1024 * 1024);
+    cleanup(&doc, &f);
+    free(content);
+}
+
+/* json_writer */
+typedef struct {
+    const char *key;
+    const char *str_val;
+    double num_val;
+} json_test_field_t;
+
+static std::string cjson_print(const json_test_field_t *fields, int field_count) {
+    cJSON *json = cJSON_CreateObject();
+    for (int i = 0; i < field_count; i++) {
+        if (fields[i].str_val != nullptr) {
+            cJSON_AddStringToObject(json, fields[i].key, fields[i].str_val);
+        } else {
+            cJSON_AddNumberToObject(json, fields[i].key, fields[i].num_val);
+        }
+    }
+    char *str = cJSON_PrintUnformatted(json);
+    std::string result(str);
+    free(str);
+    cJSON_Delete(json);
+    return result;
+}
+
+static std::string json_writer_print(json_writer_t *writer, const json_test_field_t *fields, int field_count) {
+    json_writer_begin(writer);
+    for (int i = 0; i < field_count; i++) {
+        if (fields[i].str_val != nullptr) {
+            json_writer_add_string(writer, fields[i].key, fields[i].str_val);
+        } else {
+            json_writer_add_number(writer, fields[i].key, fields[i].num_val);
+        }
+    }
+    return std::string(json_writer_end(writer));
+}
+
+TEST(JsonWriter, SameOutputAsCJSON) {
+    std::string content;
+    for (int i = 0; i < 2000; i++) {
+        content += "Lorem ipsum \"dolor\"\tsit amet,\\ 调查项目\r\n";
+        content += (char) (i % 0x20 + 1);
+    }
+
+    json_test_field_t fields[] = {
+            {"extension", "mkv", 0},
+            {"name", "", 0},
+            {"path", "dir/sub dir/\x01\x1f\x7f", 0},
+            {"content", content.c_str(), 0},
+            {"width", nullptr, 1920},
+            {"duration", nullptr, 0},
+            {"bitrate", nullptr, 3000000000.0},
+            {"pages", nullptr, -12},
+            {"title", "Ünïcödé ]5C", 0},
+    };
+    int field_count = sizeof(fields) / sizeof(fields[0]);
+
+    json_writer_t writer = json_writer_create();
+
+    ASSERT_EQ(json_writer_print(&writer, fields, field_count), cjson_print(fields, field_count));
+    ASSERT_EQ(json_writer_print(&writer, fields, 3), cjson_print(fields, 3));
+    ASSERT_EQ(json_writer_print(&writer, fields, 0), cjson_print(fields, 0));
+
+    json_writer_destroy(&writer);
+}
+
+TEST(JsonWriter, Benchmark) {
+    std::string content;
+    while (content.size() < 32768) {
+        content += "The quick brown fox jumps over the lazy dog. ";
+    }
+
+    json_test_field_t media_fields[] = {
+            {"extension", "mp4", 0},
+            {"name", "Some video file", 0},
+            {"path", "videos/2019/holidays", 0},
+            {"width", nullptr, 1920},
+            {"height", nullptr, 1080},
+            {"duration", nullptr, 3600},
+            {"bitrate", nullptr, 4000000},
+            {"videoc", "h264", 0},
+            {"audioc", "aac", 0},
+    };
+    json_test_field_t text_fields[] = {
+            {"extension", "pdf", 0},
+            {"name", "Some document", 0},
+            {"path", "documents/2019", 0},
+            {"pages", nullptr, 120},
+            {"author", "Someone", 0},
+            {"content", content.c_str(), 0},
+    };
+
+    const int iterations = 2000;
+    json_writer_t writer = json_writer_create();
+
+    auto start = std::chrono::steady_clock::now();
+    size_t cjson_len = 0;
+    for (int i = 0; i < iterations; i++) {
+        cjson_len += cjson_print(media_fields, 9).size();
+        cjson_len += cjson_print(text_fields, 6).size();
+    }
+    auto cjson_time = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    size_t writer_len = 0;
+    for (int i = 0; i < iterations; i++) {
+        writer_len += json_writer_print(&writer, media_fields, 9).size();
+        writer_len += json_writer_print(&writer, text_fields, 6).size();
+    }
+    auto writer_time = std::chrono::steady_clock::now() - start;
+
+    json_writer_destroy(&writer);
+
+    ASSERT_EQ(cjson_len, writer_len);
+    printf("cJSON: %ld us, json_writer: %ld us (%d documents)\n",
+           (long) std::chrono::duration_cast<std::chrono::microseconds>(cjson_time).count(),
+           (long) std::chrono::duration_cast<std::chrono::microseconds>(writer_time).count(),
+           iterations * 2);
+}
+
+/* arena */
+TEST(Arena, MetaLinesFromArena) {
+    // Take all the blocks that the previous tests left on the free list
+    scan_arena_t drain;
+    scan_arena_init(&drain);
+    for (int i = 0; i < ARENA_MAX_FREE_BLOCKS; i++) {
+        scan_arena_alloc(&drain, ARENA_BLOCK_SIZE);
+    }
+
+    scan_arena_t arena;
+    scan_arena_init(&arena);
+
+    document_t doc;
+    doc.meta_head = nullptr;
+    doc.meta_tail = nullptr;
+    doc.arena = &arena;
+
+    char thumbnail[1024 * 100] = {0,};
+
+    APPEND_STR_META(&doc, MetaTitle, "title");
+    APPEND_LONG_META(&doc, MetaPages, 42);
+    APPEND_THUMBNAIL(&doc, thumbnail, sizeof(thumbnail));
+
+    ASSERT_STREQ(get_meta(&doc, MetaTitle)->str_val, "title");
+    ASSERT_EQ(get_meta(&doc, MetaPages)->long_val, 42);
+    ASSERT_EQ(get_meta(&doc, MetaThumbnail)->size, sizeof(thumbnail));
+    ASSERT_EQ(arena.alloc_count, 3);
+    ASSERT_GT(arena.alloc_bytes, (long) sizeof(thumbnail));
+    // The thumbnail does not fit in a regular block
+    ASSERT_EQ(arena.block_count, 2);
+
+    scan_arena_alloc(&arena, ARENA_BLOCK_SIZE);
+    ASSERT_EQ(arena.block_count, 3);
+
+    scan_arena_reset(&arena);
+    ASSERT_EQ(arena.head, nullptr);
+
+    // The two regular blocks are reused, the oversized one was released
+    scan_arena_t next;
+    scan_arena_init(&next);
+    scan_arena_alloc(&next, ARENA_BLOCK_SIZE);
+    scan_arena_alloc(&next, ARENA_BLOCK_SIZE);
+    ASSERT_EQ(next.block_count, 0);
+    scan_arena_alloc(&next, ARENA_BLOCK_SIZE);
+    ASSERT_EQ(next.block_count, 1);
+
+    scan_arena_reset(&next);
+    scan_arena_reset(&drain);
+}
+
 int main(int argc, char **argv) {
     setlocale(LC_ALL, "");
 
@@ -1138,6 +1746,7 @@ int main(int argc, char **argv) {
     ebook_ctx.logf = noop_logf;
     ebook_ctx.fast_epub_parse = 0;
     ebook_ctx.tn_qscale = 2;
+    ebook_ctx.tn_compression = 6;
 
     ebook_500_ctx = ebook_ctx;
     ebook_500_ctx.content_size = 500;
@@ -1146,6 +1755,7 @@ int main(int argc, char **argv) {
     ebook_fast_ctx.fast_epub_parse = 1;
 
     comic_ctx.tn_qscale = 2;
+    comic_ctx.tn_compression = 6;
     comic_ctx.tn_size = 500;
     comic_ctx.enable_tn = TRUE;
     comic_ctx.log = noop_log;
@@ -1153,6 +1763,7 @@ int main(int argc, char **argv) {
     comic_ctx.store = counter_store;
 
     comic_big_ctx.tn_qscale = 2;
+    comic_big_ctx.tn_compression = 6;
     comic_big_ctx.tn_size = 5000;
     comic_big_ctx.enable_tn = TRUE;
     comic_big_ctx.log = noop_log;
@@ -1165,6 +1776,8 @@ int main(int argc, char **argv) {
     media_ctx.tn_size = 500;
     media_ctx.tn_count = 1;
     media_ctx.tn_qscale = 2;
+    media_ctx.tn_compression = 6;
+    media_ctx.content_size = 999999999999;
     media_ctx.max_media_buffer = (long) 2000 * (long) 1024 * (long) 1024;
 
     ooxml_500_ctx.content_size = 500;
@@ -1183,6 +1796,7 @@ int main(int argc, char **argv) {
     raw_ctx.tn_size = 500;
     raw_ctx.enable_tn = TRUE;
     raw_ctx.tn_qscale = 5.0;
+    raw_ctx.tn_compression = 6;
 
     msdoc_ctx.log = noop_log;
     msdoc_ctx.logf = noop_logf;
@@ -23,7 +23,7 @@ int fs_read(struct vfile *f, void *buf, size_t size) {
 int mem_read(vfile_t *f, void *buf, size_t size) {
     memcpy(buf, f->_test_data, size);
     f->_test_data = (char *) f->_test_data + size;
-    return 0;
+    return (int) size;
 }
 
 void fs_close(vfile_t *f) {
@@ -35,12 +35,18 @@ void fs_close(vfile_t *f) {
 void load_doc_file(const char *filepath, vfile_t *f, document_t *doc) {
     doc->meta_head = nullptr;
     doc->meta_tail = nullptr;
+    doc->arena = nullptr;
+    doc->filepath = filepath;
+    doc->parent = "";
     load_file(filepath, f);
 }
 
 void load_doc_mem(void *mem, size_t mem_len, vfile_t *f, document_t *doc) {
     doc->meta_head = nullptr;
     doc->meta_tail = nullptr;
+    doc->arena = nullptr;
+    doc->filepath = "_mem_";
+    doc->parent = "";
     load_mem(mem, mem_len, f);
 }
 
@@ -62,7 +68,7 @@ void load_file(const char *filepath, vfile_t *f) {
         FAIL() << FILE_NOT_FOUND_ERR;
     }
 
-    memcpy(f->filepath, filepath, sizeof(f->filepath));
+    f->filepath = filepath;
     f->read = fs_read;
     f->close = fs_close;
     f->is_fs_file = TRUE;
@@ -71,7 +77,7 @@ void load_file(const char *filepath, vfile_t *f) {
 }
 
 void load_mem(void *mem, size_t size, vfile_t *f) {
-    memcpy(f->filepath, "_mem_", strlen("_mem_"));
+    f->filepath = "_mem_";
     f->_test_data = mem;
     f->st_size = size;
     f->read = mem_read;